@@ -0,0 +1,739 @@
+/* Benchmarks for the evaluation and rendering hot paths.
+ *
+ * Times every evaluator in nurbs.c, and render_point() / render_run(), in
+ * ns per point, on the shipped curves and on generated ones of 10 to
+ * 10000 control points, with random and sequential-u sample orders.
+ * Every evaluator's output is checked against nurbs_evaluate() (and that
+ * against nurbs_evaluate_ref()) on the same samples, and the results go
+ * to stdout as JSON. Exits nonzero if anything is off by more than its
+ * tolerance. Run it from the top of the tree, so data/ can be found.
+ * What's built on the renderer is checked by bench_show.c.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "render.h"
+
+#define SAMPLES		4096
+#define REF_SAMPLES	256
+#define MIN_NS		50000000LL
+#define DAC_SCALE	10000
+
+/* Tolerances, in DAC units. render_run() may put a sample in a different
+ * patch to render_point() by rounding at a patch edge, so it's allowed a
+ * little more. */
+#define EVAL_TOLERANCE	1.0
+#define RUN_TOLERANCE	2.0
+
+/* The tessellation cache is built to CACHE_ERROR; rounding to whole DAC
+ * units can add one more. */
+#define CACHE_ERROR	1.0
+#define CACHE_TOLERANCE	(CACHE_ERROR + 1.0)
+
+/* Arc-length tables get ARCLEN_ENTRIES entries, or ARCLEN_PER_SPAN for
+ * each span if that's more. ARCLEN_GAP is how uneven their spacing may be:
+ * the largest gap between neighbouring samples over the mean gap. It's
+ * only checked on curves with ARCLEN_SAMPLES_PER_SPAN samples per span,
+ * since sparser chords cut across the wiggles and come out short. */
+#define ARCLEN_ENTRIES	4096
+#define ARCLEN_PER_SPAN	16
+#define ARCLEN_GAP	1.05
+#define ARCLEN_SAMPLES_PER_SPAN	32
+
+/* Derivatives are checked against central differences of step
+ * DERIV_STEP, on curves whose spans are at least DERIV_SPAN_STEPS steps
+ * wide, skipping samples where the difference would straddle a knot. The
+ * error is relative to the size of the derivative, or to 1 if smaller. */
+#define DERIV_STEP	1e-3
+#define DERIV_SPAN_STEPS	20
+#define DERIV_TOLERANCE	1e-2
+
+/* Scanner limits for the motion schedule, in DAC units per point and
+ * per point per point */
+#define SCHEDULE_SPEED	2000
+#define SCHEDULE_ACCEL	200
+#define SCHEDULE_ENTRIES	4096
+
+/* The pattern tmain plays by default */
+#define PATTERN_POINTS	150000
+#define REDRAW_COUNT	250
+
+struct bench_curve {
+	char name[32];
+	struct nurbs_line *line;
+	struct nurbs_sweep sweep;
+	struct nurbs_patch *patch;
+	struct nurbs_bezier_patch *bezier;
+	struct nurbs_fixed_patch *fixed;
+	struct nurbs_arclen *arclen;
+};
+
+struct workload {
+	const char *name;
+	float u[SAMPLES], v[SAMPLES];
+};
+
+typedef void eval_fn(const struct bench_curve *c, const struct workload *w,
+                     struct xy *out, int n);
+
+static int first_result = 1, failures;
+
+static long long now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* time_ns(fn, c, w, out, n)
+ *
+ * Return the average time per point of fn over n points, repeating it
+ * for at least MIN_NS.
+ */
+static double time_ns(eval_fn *fn, const struct bench_curve *c,
+                      const struct workload *w, struct xy *out, int n) {
+	long long start = now_ns(), elapsed;
+	long reps = 0;
+
+	do {
+		fn(c, w, out, n);
+		reps++;
+		elapsed = now_ns() - start;
+	} while (elapsed < MIN_NS);
+
+	return (double)elapsed / reps / n;
+}
+
+/* max_error(a, b, n)
+ *
+ * Return the largest difference in x or y between two sets of points, in
+ * DAC units.
+ */
+static double max_error(const struct xy *a, const struct xy *b, int n) {
+	double err = 0;
+	for (int i = 0; i < n; i++) {
+		err = fmax(err, fabs(a[i].x - b[i].x) * DAC_SCALE);
+		err = fmax(err, fabs(a[i].y - b[i].y) * DAC_SCALE);
+	}
+	return err;
+}
+
+static void print_result(const char *curve, int points, const char *evaluator,
+                         const char *workload, double ns, double err,
+                         const char *vs, double tolerance) {
+	int ok = err <= tolerance;
+	if (!ok)
+		failures++;
+
+	printf("%s    {\"curve\": \"%s\", \"points\": %d, "
+	       "\"evaluator\": \"%s\", "
+	       "\"workload\": \"%s\", \"ns_per_point\": %.2f, "
+	       "\"max_err_dac\": %.4g, \"vs\": \"%s\", \"ok\": %s}",
+	       first_result ? "" : ",\n", curve, points, evaluator, workload,
+	       ns, err, vs, ok ? "true" : "false");
+	first_result = 0;
+}
+
+static void eval_ref(const struct bench_curve *c, const struct workload *w,
+                     struct xy *out, int n) {
+	for (int i = 0; i < n; i++)
+		out[i] = nurbs_evaluate_ref(c->patch, w->u[i], w->v[i]);
+}
+
+static void eval_plain(const struct bench_curve *c, const struct workload *w,
+                       struct xy *out, int n) {
+	for (int i = 0; i < n; i++)
+		out[i] = nurbs_evaluate(c->patch, w->u[i], w->v[i]);
+}
+
+static void eval_batch(const struct bench_curve *c, const struct workload *w,
+                       struct xy *out, int n) {
+	nurbs_evaluate_batch(c->patch, w->u, w->v, out, n);
+}
+
+static void eval_bezier(const struct bench_curve *c, const struct workload *w,
+                        struct xy *out, int n) {
+	for (int i = 0; i < n; i++)
+		out[i] = nurbs_bezier_evaluate(c->bezier, w->u[i], w->v[i]);
+}
+
+/* Before truncation, and back out of DAC units */
+static void eval_fixed(const struct bench_curve *c, const struct workload *w,
+                       struct xy *out, int n) {
+	for (int i = 0; i < n; i++) {
+		struct xy xy = nurbs_fixed_evaluate_unrounded(c->fixed,
+			lrint(w->u[i] * (double)NURBS_FIXED_ONE),
+			lrint(w->v[i] * (double)NURBS_FIXED_ONE));
+		out[i] = (struct xy){ xy.x / DAC_SCALE, xy.y / DAC_SCALE };
+	}
+}
+
+static void eval_sweep(const struct bench_curve *c, const struct workload *w,
+                       struct xy *out, int n) {
+	for (int i = 0; i < n; i++)
+		out[i] = nurbs_sweep_evaluate(&c->sweep, w->u[i], w->v[i]);
+}
+
+static void eval_sweep_batch(const struct bench_curve *c,
+                             const struct workload *w, struct xy *out, int n) {
+	nurbs_sweep_evaluate_batch(&c->sweep, w->u, w->v, out, n);
+}
+
+static void eval_deriv(const struct bench_curve *c, const struct workload *w,
+                       struct xy *out, int n) {
+	struct nurbs_deriv d;
+	for (int i = 0; i < n; i++) {
+		nurbs_evaluate_deriv(c->patch, w->u[i], w->v[i], &d);
+		out[i] = d.p;
+	}
+}
+
+static int near_knot(const float *knots, int count, float x) {
+	for (int i = 0; i < count; i++)
+		if (fabs(knots[i] - x) < 2 * DERIV_STEP)
+			return 1;
+	return 0;
+}
+
+static double deriv_error(struct xy d, struct xy a, struct xy b) {
+	double fx = (a.x - b.x) / (2 * DERIV_STEP);
+	double fy = (a.y - b.y) / (2 * DERIV_STEP);
+	return hypot(d.x - fx, d.y - fy) / fmax(1, hypot(d.x, d.y));
+}
+
+/* Central differences of the first derivatives, for the second */
+static double deriv2_error(const struct bench_curve *c, float u, float v,
+                           const struct nurbs_deriv *d) {
+	struct nurbs_deriv u1, u0, v1, v0;
+	nurbs_evaluate_deriv(c->patch, u + DERIV_STEP, v, &u1);
+	nurbs_evaluate_deriv(c->patch, u - DERIV_STEP, v, &u0);
+	nurbs_evaluate_deriv(c->patch, u, v + DERIV_STEP, &v1);
+	nurbs_evaluate_deriv(c->patch, u, v - DERIV_STEP, &v0);
+
+	double err = deriv_error(d->duu, u1.du, u0.du);
+	err = fmax(err, deriv_error(d->duv, v1.du, v0.du));
+	err = fmax(err, deriv_error(d->duv, u1.dv, u0.dv));
+	return fmax(err, deriv_error(d->dvv, v1.dv, v0.dv));
+}
+
+/* The first derivatives from nurbs_evaluate_deriv() against central
+ * differences of nurbs_evaluate(), and the second against central
+ * differences of the first */
+static void bench_deriv(struct bench_curve *c, const struct workload *w) {
+	const float *knots = nurbs_line_knots(c->line);
+	int points = c->line->points;
+
+	for (int k = 2; k < points; k++)
+		if (knots[k] < knots[k + 1]
+		    && knots[k + 1] - knots[k] < DERIV_SPAN_STEPS * DERIV_STEP)
+			return;
+
+	double err = 0, err2 = 0;
+	for (int i = 0; i < SAMPLES; i++) {
+		float u = w->u[i], v = w->v[i];
+		if (near_knot(knots, points + 3, u)
+		    || near_knot(nurbs_t_knots, NURBS_T_POINTS + 3, v))
+			continue;
+
+		struct nurbs_deriv d;
+		nurbs_evaluate_deriv(c->patch, u, v, &d);
+		err = fmax(err, deriv_error(d.du,
+		           nurbs_evaluate(c->patch, u + DERIV_STEP, v),
+		           nurbs_evaluate(c->patch, u - DERIV_STEP, v)));
+		err = fmax(err, deriv_error(d.dv,
+		           nurbs_evaluate(c->patch, u, v + DERIV_STEP),
+		           nurbs_evaluate(c->patch, u, v - DERIV_STEP)));
+		err2 = fmax(err2, deriv2_error(c, u, v, &d));
+	}
+
+	int ok = err <= DERIV_TOLERANCE && err2 <= DERIV_TOLERANCE;
+	if (!ok)
+		failures++;
+
+	printf(",\n    {\"curve\": \"%s\", \"points\": %d, "
+	       "\"evaluator\": \"nurbs_evaluate_deriv\", \"workload\": \"%s\", "
+	       "\"max_rel_err_d1\": %.4g, \"max_rel_err_d2\": %.4g, "
+	       "\"vs\": \"central differences\", \"ok\": %s}",
+	       c->name, points, w->name, err, err2, ok ? "true" : "false");
+}
+
+/* Distance between two floats in units in the last place: how many
+ * representable floats apart they are */
+static int64_t ulp_distance(float a, float b) {
+	if (isnan(a) || isnan(b))
+		return INT64_MAX;
+
+	int32_t ia, ib;
+	memcpy(&ia, &a, sizeof ia);
+	memcpy(&ib, &b, sizeof ib);
+	int64_t oa = ia < 0 ? -(int64_t)(ia & INT32_MAX) : ia;
+	int64_t ob = ib < 0 ? -(int64_t)(ib & INT32_MAX) : ib;
+	return oa > ob ? oa - ob : ob - oa;
+}
+
+/* bench_batch(c, w, name, fn, vs, expected)
+ *
+ * A batch evaluator against the scalar one it promises to match to within
+ * NURBS_BATCH_ULP, whose results are in expected; DAC units would hide a
+ * broken lane on small curves.
+ */
+static void bench_batch(struct bench_curve *c, const struct workload *w,
+                        const char *name, eval_fn *fn, const char *vs,
+                        const struct xy *expected) {
+	static struct xy out[SAMPLES];
+	fn(c, w, out, SAMPLES);
+
+	int64_t ulp = 0;
+	for (int i = 0; i < SAMPLES; i++) {
+		int64_t dx = ulp_distance(out[i].x, expected[i].x);
+		int64_t dy = ulp_distance(out[i].y, expected[i].y);
+		if (dx > ulp)
+			ulp = dx;
+		if (dy > ulp)
+			ulp = dy;
+	}
+
+	int ok = ulp <= NURBS_BATCH_ULP;
+	if (!ok)
+		failures++;
+
+	printf(",\n    {\"curve\": \"%s\", \"points\": %d, "
+	       "\"evaluator\": \"%s\", \"workload\": \"%s\", "
+	       "\"max_ulp\": %lld, \"ulp_limit\": %d, \"vs\": \"%s\", "
+	       "\"ok\": %s}",
+	       c->name, c->line->points, name, w->name, (long long)ulp,
+	       NURBS_BATCH_ULP, vs, ok ? "true" : "false");
+}
+
+/* Only meaningful for the sequential workload, where u steps evenly */
+static void eval_stepper(const struct bench_curve *c, const struct workload *w,
+                         struct xy *out, int n) {
+	struct nurbs_stepper s;
+	nurbs_stepper_start(&s, c->bezier, w->u[0], w->v[0], 1.0 / SAMPLES, 0);
+	for (int i = 0; i < n; i++)
+		out[i] = nurbs_stepper_next(&s);
+}
+
+static const struct {
+	const char *name;
+	eval_fn *fn;
+	int sequential_only;
+} evaluators[] = {
+	{ "nurbs_evaluate_batch", eval_batch, 0 },
+	{ "nurbs_bezier_evaluate", eval_bezier, 0 },
+	{ "nurbs_sweep_evaluate", eval_sweep, 0 },
+	{ "nurbs_sweep_evaluate_batch", eval_sweep_batch, 0 },
+	{ "nurbs_evaluate_deriv", eval_deriv, 0 },
+	{ "nurbs_stepper", eval_stepper, 1 },
+};
+
+/* generate_line(points, seed)
+ *
+ * Make up a curve: a wobbly loop of the given number of control points,
+ * with random weights and a clamped, uniform knot vector.
+ */
+static struct nurbs_line *generate_line(int points, unsigned *seed) {
+	struct nurbs_line *line = malloc(sizeof *line
+	                                 + points * sizeof (struct nurbs_point)
+	                                 + (points + 3) * sizeof (float));
+	if (!line)
+		return NULL;
+
+	line->points = points;
+	for (int i = 0; i < points; i++) {
+		float theta = 2 * M_PI * i / (points - 1);
+		float r = 0.8 + 0.4 * rand_r(seed) / RAND_MAX;
+		line->t[i] = (struct nurbs_point){
+			r * cosf(theta), r * sinf(theta),
+			0.5 + (float)rand_r(seed) / RAND_MAX
+		};
+	}
+
+	float *knots = (float *)(line->t + points);
+	for (int i = 0; i < points + 3; i++) {
+		int k = i < 3 ? 0 : (i > points ? points - 2 : i - 2);
+		knots[i] = (float)k / (points - 2);
+	}
+
+	return line;
+}
+
+/* curve_init(c)
+ *
+ * Sweep c->line along a path that turns and drifts a little, and build
+ * every form of the resulting patch.
+ */
+static int curve_init(struct bench_curve *c) {
+	for (int j = 0; j < NURBS_T_POINTS; j++) {
+		float a = 0.2 * j;
+		c->sweep.path[j] = (struct nurbs_affine){
+			cosf(a), -sinf(a),
+			sinf(a), cosf(a),
+			0.1 * j, -0.05 * j
+		};
+	}
+	c->sweep.line = c->line;
+
+	c->patch = nurbs_sweep_patch(&c->sweep);
+	if (!c->patch)
+		return -1;
+
+	c->bezier = nurbs_bezier_compile(c->patch);
+	c->fixed = c->bezier ? nurbs_fixed_compile(c->bezier, DAC_SCALE) : NULL;
+	int entries = ARCLEN_PER_SPAN * c->line->points;
+	c->arclen = nurbs_arclen_build(c->line, entries > ARCLEN_ENTRIES
+	                                        ? entries : ARCLEN_ENTRIES);
+	return c->bezier && c->fixed && c->arclen ? 0 : -1;
+}
+
+static void eval_line(const struct bench_curve *c, const struct workload *w,
+                      struct xy *out, int n) {
+	for (int i = 0; i < n; i++)
+		out[i] = nurbs_line_evaluate(c->line, w->u[i]);
+}
+
+static void eval_arclen(const struct bench_curve *c, const struct workload *w,
+                        struct xy *out, int n) {
+	for (int i = 0; i < n; i++)
+		out[i] = nurbs_line_evaluate(c->line,
+		                             nurbs_arclen_param(c->arclen,
+		                                                w->u[i]));
+}
+
+/* gap_ratio(pts, n)
+ *
+ * Return the largest distance between neighbouring points over the mean.
+ * A pattern needs this many times the points it would with even spacing
+ * to keep its widest gap the same.
+ */
+static double gap_ratio(const struct xy *pts, int n) {
+	double max = 0, sum = 0;
+	for (int i = 1; i < n; i++) {
+		double d = hypot(pts[i].x - pts[i - 1].x,
+		                 pts[i].y - pts[i - 1].y);
+		max = fmax(max, d);
+		sum += d;
+	}
+	return sum > 0 ? max / (sum / (n - 1)) : 0;
+}
+
+/* Point spacing along the line itself, sampled evenly in u and then
+ * evenly by arc length */
+static void bench_arclen(struct bench_curve *c, const struct workload *w) {
+	static struct xy out[SAMPLES];
+
+	time_ns(eval_line, c, w, out, SAMPLES);
+	double uneven = gap_ratio(out, SAMPLES);
+	double ns = time_ns(eval_arclen, c, w, out, SAMPLES);
+	double even = gap_ratio(out, SAMPLES);
+
+	int ok = even <= ARCLEN_GAP
+	      || SAMPLES < ARCLEN_SAMPLES_PER_SPAN * c->line->points;
+	if (!ok)
+		failures++;
+
+	printf(",\n    {\"curve\": \"%s\", \"points\": %d, "
+	       "\"evaluator\": \"nurbs_arclen_param\", \"workload\": \"%s\", "
+	       "\"ns_per_point\": %.2f, \"gap_ratio_u\": %.4g, "
+	       "\"gap_ratio_arclen\": %.4g, \"ok\": %s}",
+	       c->name, c->line->points, w->name, ns, uneven, even,
+	       ok ? "true" : "false");
+}
+
+/* fixed_error(c, w, out, expected)
+ *
+ * The fixed-point form promises much less than a DAC unit before it
+ * truncates, at the parameters it's given. Those, and the ends of its
+ * pieces, are rounded to Q24, which moves a point on a tightly wound curve
+ * by up to a Q24 step's worth of its derivatives; that much is let off
+ * each sample, and the worst of what's left returned.
+ */
+static double fixed_error(const struct bench_curve *c,
+                          const struct workload *w, const struct xy *out,
+                          const struct xy *expected) {
+	double err = 0, step = (double)DAC_SCALE / NURBS_FIXED_ONE;
+	for (int i = 0; i < SAMPLES; i++) {
+		struct nurbs_deriv d;
+		nurbs_evaluate_deriv(c->patch, w->u[i], w->v[i], &d);
+		double dx = fabs(out[i].x - expected[i].x) * DAC_SCALE;
+		double dy = fabs(out[i].y - expected[i].y) * DAC_SCALE;
+		err = fmax(err, dx - (fabsf(d.du.x) + fabsf(d.dv.x)) * step);
+		err = fmax(err, dy - (fabsf(d.du.y) + fabsf(d.dv.y)) * step);
+	}
+	return err;
+}
+
+static void bench_curve(struct bench_curve *c, struct workload *w, int nw) {
+	static struct xy expected[SAMPLES], ref[REF_SAMPLES], out[SAMPLES];
+	int points = c->line->points;
+
+	for (int i = 0; i < nw; i++) {
+		/* The current evaluator, against the reference; the reference
+		 * is slow on big curves, so only on some of the samples */
+		double ns = time_ns(eval_ref, c, &w[i], ref, REF_SAMPLES);
+		print_result(c->name, points, "nurbs_evaluate_ref", w[i].name,
+		             ns, 0, "nurbs_evaluate_ref", EVAL_TOLERANCE);
+
+		ns = time_ns(eval_plain, c, &w[i], expected, SAMPLES);
+		print_result(c->name, points, "nurbs_evaluate", w[i].name, ns,
+		             max_error(expected, ref, REF_SAMPLES),
+		             "nurbs_evaluate_ref", EVAL_TOLERANCE);
+
+		for (int j = 0; j < sizeof evaluators / sizeof *evaluators;
+		     j++) {
+			if (evaluators[j].sequential_only
+			    && strcmp(w[i].name, "sequential"))
+				continue;
+
+			ns = time_ns(evaluators[j].fn, c, &w[i], out, SAMPLES);
+			print_result(c->name, points, evaluators[j].name,
+			             w[i].name, ns,
+			             max_error(out, expected, SAMPLES),
+			             "nurbs_evaluate", EVAL_TOLERANCE);
+		}
+
+		ns = time_ns(eval_fixed, c, &w[i], out, SAMPLES);
+		print_result(c->name, points, "nurbs_fixed_evaluate_unrounded",
+		             w[i].name, ns,
+		             fixed_error(c, &w[i], out, expected),
+		             "nurbs_evaluate", NURBS_FIXED_ERROR);
+
+		if (!strcmp(w[i].name, "sequential"))
+			bench_arclen(c, &w[i]);
+		bench_deriv(c, &w[i]);
+		bench_batch(c, &w[i], "nurbs_evaluate_batch", eval_batch,
+		            "nurbs_evaluate", expected);
+		eval_sweep(c, &w[i], out, SAMPLES);
+		bench_batch(c, &w[i], "nurbs_sweep_evaluate_batch",
+		            eval_sweep_batch, "nurbs_sweep_evaluate", out);
+	}
+}
+
+/* Render benchmarks run on the shipped pattern, so they go through
+ * render_point() one sample at a time, and the eval_fn arguments are
+ * unused. */
+static struct etherdream_point render_pts[SAMPLES];
+static const struct workload *render_workload;
+
+static void to_xy(struct xy *out, int n) {
+	for (int i = 0; i < n; i++) {
+		out[i] = (struct xy){ (float)render_pts[i].x / DAC_SCALE,
+		                      (float)render_pts[i].y / DAC_SCALE };
+	}
+}
+
+static void run_render_point(const struct bench_curve *c,
+                             const struct workload *w, struct xy *out,
+                             int n) {
+	for (int i = 0; i < n; i++)
+		render_point(&render_pts[i], render_workload->u[i],
+		             REDRAW_COUNT);
+}
+
+static void run_render_points(const struct bench_curve *c,
+                              const struct workload *w, struct xy *out,
+                              int n) {
+	render_points(render_pts, render_workload->u, n, REDRAW_COUNT);
+}
+
+static void run_render_run(const struct bench_curve *c,
+                           const struct workload *w, struct xy *out, int n) {
+	render_run(render_pts, n, 0, PATTERN_POINTS, REDRAW_COUNT);
+}
+
+static void bench_render(struct workload *w, int nw) {
+	static struct xy expected[SAMPLES], out[SAMPLES];
+
+	for (int i = 0; i < nw; i++) {
+		render_workload = &w[i];
+		double ns = time_ns(run_render_point, NULL, NULL, NULL,
+		                    SAMPLES);
+		print_result("pattern", 0, "render_point", w[i].name, ns, 0,
+		             "render_point", RUN_TOLERANCE);
+
+		/* render_points() evaluates runs of samples in batches,
+		 * with the same results */
+		to_xy(expected, SAMPLES);
+		ns = time_ns(run_render_points, NULL, NULL, NULL, SAMPLES);
+		to_xy(out, SAMPLES);
+		print_result("pattern", 0, "render_points", w[i].name, ns,
+		             max_error(out, expected, SAMPLES), "render_point",
+		             0);
+	}
+
+	/* render_run() against render_point() at the same samples */
+	static struct workload run;
+	run.name = "sequential";
+	for (int i = 0; i < SAMPLES; i++)
+		run.u[i] = (float)i / PATTERN_POINTS;
+
+	render_workload = &run;
+	run_render_point(NULL, NULL, NULL, SAMPLES);
+	to_xy(expected, SAMPLES);
+
+	double ns = time_ns(run_render_run, NULL, NULL, NULL, SAMPLES);
+	to_xy(out, SAMPLES);
+	print_result("pattern", 0, "render_run", run.name, ns,
+	             max_error(out, expected, SAMPLES),
+	             "render_point", RUN_TOLERANCE);
+}
+
+/* render_run() on the fixed-point path, over the whole pattern, against
+ * render_point() at every sample */
+static struct etherdream_point pattern_pts[PATTERN_POINTS];
+
+static void run_pattern(const struct bench_curve *c,
+                        const struct workload *w, struct xy *out, int n) {
+	render_run(pattern_pts, n, 0, PATTERN_POINTS, REDRAW_COUNT);
+}
+
+static void bench_fixed(void) {
+	static struct etherdream_point expected[PATTERN_POINTS];
+
+	for (int i = 0; i < PATTERN_POINTS; i++)
+		render_point(&expected[i], (float)i / PATTERN_POINTS,
+		             REDRAW_COUNT);
+
+	render_compile_fixed();
+	double ns = time_ns(run_pattern, NULL, NULL, NULL, PATTERN_POINTS);
+
+	double err = 0;
+	for (int i = 0; i < PATTERN_POINTS; i++) {
+		err = fmax(err, abs(pattern_pts[i].x - expected[i].x));
+		err = fmax(err, abs(pattern_pts[i].y - expected[i].y));
+	}
+
+	print_result("pattern", 0, "render_run_fixed", "sequential", ns, err,
+	             "render_point", RUN_TOLERANCE);
+}
+
+/* Render benchmarks again, once render_tessellate() has built the cache,
+ * against render_point() without it. */
+static void bench_cache(struct workload *w, int nw) {
+	static struct xy expected[2][SAMPLES], out[SAMPLES];
+	struct render_cache_stats st;
+
+	assert(nw <= 2);
+	for (int i = 0; i < nw; i++) {
+		render_workload = &w[i];
+		run_render_point(NULL, NULL, NULL, SAMPLES);
+		to_xy(expected[i], SAMPLES);
+	}
+
+	long long start = now_ns();
+	render_tessellate(CACHE_ERROR, 1);
+	double build_ms = (now_ns() - start) / 1e6;
+	render_cache_stats(&st);
+
+	for (int i = 0; i < nw; i++) {
+		render_workload = &w[i];
+		double ns = time_ns(run_render_point, NULL, NULL, NULL,
+		                    SAMPLES);
+		to_xy(out, SAMPLES);
+		print_result("pattern", 0, "render_point_cached", w[i].name,
+		             ns, max_error(out, expected[i], SAMPLES),
+		             "render_point", CACHE_TOLERANCE);
+	}
+
+	printf(",\n    {\"curve\": \"pattern\", \"evaluator\": \"tessellate\", "
+	       "\"build_ms\": %.1f, \"patches\": %d, \"grid_points\": %d, "
+	       "\"bytes\": %zu, \"max_err_dac\": %.4g}",
+	       build_ms, st.patches, st.points, st.bytes, st.max_error);
+}
+
+/* Points per trace needed to stay within the scanner limits, with and
+ * without the motion schedule */
+static void bench_schedule(void) {
+	struct render_schedule_stats st;
+
+	long long start = now_ns();
+	render_schedule(SCHEDULE_SPEED, SCHEDULE_ACCEL, SCHEDULE_ENTRIES);
+	double build_ms = (now_ns() - start) / 1e6;
+	render_schedule_stats(&st);
+
+	printf(",\n    {\"curve\": \"pattern\", \"evaluator\": \"schedule\", "
+	       "\"build_ms\": %.1f, \"max_speed\": %d, \"max_accel\": %d, "
+	       "\"points_per_trace\": %.1f, "
+	       "\"uniform_points_per_trace\": %.1f}",
+	       build_ms, SCHEDULE_SPEED, SCHEDULE_ACCEL, st.points,
+	       st.uniform_points);
+}
+
+int main(int argc, char **argv) {
+	static struct workload w[2];
+	unsigned seed = 1;
+
+	w[0].name = "random";
+	w[1].name = "sequential";
+	for (int i = 0; i < SAMPLES; i++) {
+		w[0].u[i] = (float)rand_r(&seed) / ((float)RAND_MAX + 1);
+		w[0].v[i] = (float)rand_r(&seed) / ((float)RAND_MAX + 1);
+		w[1].u[i] = (float)i / SAMPLES;
+		w[1].v[i] = 0.375;
+	}
+
+	static const char *shipped[] = { "circle", "square" };
+	static const int generated[] = { 10, 100, 1000, 10000 };
+
+	/* The loaders chatter on stdout; keep that out of the JSON. */
+	fflush(stdout);
+	int json_fd = dup(1);
+	dup2(2, 1);
+
+	int ncurves = 2 + sizeof generated / sizeof *generated;
+	struct bench_curve curves[ncurves];
+	memset(curves, 0, sizeof curves);
+
+	for (int i = 0; i < 2; i++) {
+		char path[64];
+		snprintf(path, sizeof path, "data/%s.nub", shipped[i]);
+		snprintf(curves[i].name, sizeof curves[i].name, "%s",
+		         shipped[i]);
+		curves[i].line = nurbs_load_line(path);
+		if (!curves[i].line) {
+			printf("couldn't load %s\n", path);
+			return 1;
+		}
+	}
+
+	for (int i = 2; i < ncurves; i++) {
+		int points = generated[i - 2];
+		snprintf(curves[i].name, sizeof curves[i].name,
+		         "generated-%d", points);
+		curves[i].line = generate_line(points, &seed);
+	}
+
+	for (int i = 0; i < ncurves; i++) {
+		if (!curves[i].line || curve_init(&curves[i]) < 0) {
+			printf("couldn't set up %s\n", curves[i].name);
+			return 1;
+		}
+	}
+
+	render_init();
+	render_compile();
+
+	fflush(stdout);
+	dup2(json_fd, 1);
+	close(json_fd);
+
+	printf("{\n  \"batch_isa\": \"%s\",\n  \"samples\": %d,\n"
+	       "  \"results\": [\n", nurbs_batch_isa(), SAMPLES);
+
+	for (int i = 0; i < ncurves; i++)
+		bench_curve(&curves[i], w, 2);
+	bench_render(w, 2);
+	bench_fixed();
+	bench_cache(w, 2);
+	bench_schedule();
+
+	printf("\n  ],\n  \"failures\": %d\n}\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,372 @@
+/* Checks for what's built on the renderer.
+ *
+ * bench.c times and checks the renderer itself; this does the same for
+ * planned frames, ILDA export and the feed, which it leaves out so that
+ * it needs only the renderer's core. The feed is checked with producers
+ * forked off as other processes. Results go to stdout as JSON, and it
+ * exits nonzero if anything is off. Run it from the top of the tree, so
+ * data/ can be found.
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "feed.h"
+#include "ilda.h"
+#include "render.h"
+
+/* Scanner limits for planned frames, in DAC units per point and per
+ * point per point, as bench.c uses for the motion schedule */
+#define SCHEDULE_SPEED	2000
+#define SCHEDULE_ACCEL	200
+
+/* Planned frames of several copies of the pattern, as tmain -S draws
+ * them, with the same scanner */
+#define FRAME_SHAPES	4
+#define FRAME_DWELL	2
+
+/* The feed: a small ring, so the producers fill it, and FEED_BLOCKS
+ * blocks streamed through it, alternately points and sweeps */
+#define FEED_SLOTS	4
+#define FEED_LATENCY_MS	100
+#define FEED_BLOCKS	256
+
+/* Traces of the pattern exported to an ILDA file and loaded back */
+#define ILDA_TRACES	8
+
+/* The pattern tmain plays by default */
+#define PATTERN_POINTS	150000
+#define REDRAW_COUNT	250
+
+static struct etherdream_point pattern_pts[PATTERN_POINTS];
+static int first_result = 1, failures;
+
+static long long now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* What goes before each result in the JSON list */
+static const char *separator(void) {
+	const char *s = first_result ? "" : ",\n";
+	first_result = 0;
+	return s;
+}
+
+/* bench_ilda()
+ *
+ * Export the first few traces of the pattern to an ILDA file, one frame
+ * per trace as tmain -o does, and load it back. Every field must come back
+ * exactly as the render_run() calls that ilda_export() promises give it.
+ */
+static void bench_ilda(void) {
+	int frame = PATTERN_POINTS / REDRAW_COUNT, n = ILDA_TRACES * frame;
+	char path[] = "/tmp/reticulate-bench-show-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		failures++;
+		return;
+	}
+	close(fd);
+
+	for (int start = 0; start < n; start += frame)
+		for (int i = 0; i < frame; i += ILDA_EXPORT_BLOCK)
+			render_run(pattern_pts + start + i,
+			           frame - i < ILDA_EXPORT_BLOCK
+			           ? frame - i : ILDA_EXPORT_BLOCK,
+			           start + i, PATTERN_POINTS, REDRAW_COUNT);
+
+	fflush(stdout);
+	long long start = now_ns();
+	struct etherdream_point *pts = NULL;
+	int loaded = 0;
+	if (ilda_export(path, n, PATTERN_POINTS, REDRAW_COUNT, frame, 1) == 0)
+		pts = ilda_load(path, &loaded, SIZE_MAX, 1);
+	double ns = (double)(now_ns() - start) / n;
+	unlink(path);
+
+	int differ = !pts || loaded != n;
+	for (int i = 0; i < n && !differ; i++) {
+		const struct etherdream_point *a = &pts[i];
+		const struct etherdream_point *b = &pattern_pts[i];
+		differ = a->x != b->x || a->y != b->y || a->r != b->r
+		         || a->g != b->g || a->b != b->b;
+	}
+	free(pts);
+
+	if (differ)
+		failures++;
+
+	printf("%s    {\"curve\": \"pattern\", "
+	       "\"evaluator\": \"ilda_export+ilda_load\", \"points\": %d, "
+	       "\"ns_per_point\": %.2f, \"vs\": \"render_run\", "
+	       "\"ok\": %s}", separator(), n, ns, differ ? "false" : "true");
+}
+
+/* Planned frames over one pass of the pattern: the share of points lit,
+ * against drawing each frame's shapes in the order given */
+static void bench_frames(void) {
+	static struct etherdream_point pts[PATTERN_POINTS / REDRAW_COUNT];
+	struct plan_scanner scanner = { SCHEDULE_SPEED, SCHEDULE_ACCEL,
+	                                FRAME_DWELL };
+	int n = PATTERN_POINTS / REDRAW_COUNT;
+	long lit = 0, in_order_lit = 0;
+	struct xy beam = { 0, 0 };
+
+	long long start = now_ns();
+	for (int f = 0; f < REDRAW_COUNT; f++) {
+		float u[FRAME_SHAPES];
+		for (int j = 0; j < FRAME_SHAPES; j++)
+			u[j] = (float)((f * n + PATTERN_POINTS / FRAME_SHAPES
+			                * j) % PATTERN_POINTS) / PATTERN_POINTS;
+
+		struct render_frame_stats st;
+		render_frame(pts, n, u, FRAME_SHAPES, &scanner, &beam, &st);
+		lit += st.lit;
+		in_order_lit += st.in_order_blank < n ? n - st.in_order_blank
+		                                      : 0;
+	}
+	double ns = (double)(now_ns() - start) / REDRAW_COUNT;
+
+	if (lit < in_order_lit)
+		failures++;
+
+	printf("%s    {\"curve\": \"pattern\", "
+	       "\"evaluator\": \"render_frame\", \"shapes\": %d, "
+	       "\"points\": %d, \"ns_per_frame\": %.0f, "
+	       "\"lit_fraction\": %.4f, \"in_order_lit_fraction\": %.4f}",
+	       separator(), FRAME_SHAPES, n, ns, (double)lit / PATTERN_POINTS,
+	       (double)in_order_lit / PATTERN_POINTS);
+}
+
+/* Producers for bench_feed(), run in a child process; each returns 0 if
+ * the feed did what it should on its side */
+
+/* Fill the ring with points, then find it full */
+static int feed_fill(struct feed *f, const struct nurbs_line *line) {
+	(void)line;
+	for (int i = 0; i < FEED_SLOTS; i++) {
+		struct feed_block *b = feed_claim(f);
+		if (!b)
+			return 1;
+		b->kind = FEED_POINTS;
+		b->count = 1;
+		if (feed_publish(f, b) < 0)
+			return 1;
+	}
+
+	return feed_claim(f) != NULL;
+}
+
+static size_t line_bytes(const struct nurbs_line *line) {
+	return sizeof *line + line->points * sizeof (struct nurbs_point)
+	       + (line->points + 3) * sizeof (float);
+}
+
+static void feed_sweep(struct feed_block *b, const struct nurbs_line *line,
+                       int count) {
+	b->kind = FEED_SWEEP;
+	b->count = count;
+	b->redraw_count = 1;
+	b->line_bytes = line_bytes(line);
+	for (int j = 0; j < NURBS_T_POINTS; j++)
+		b->path[j] = (struct nurbs_affine){ 1, 0, 0, 1, 0, 0 };
+	memcpy(feed_line(b), line, b->line_bytes);
+}
+
+/* Send a sweep with a NaN knot, and one with too many points */
+static int feed_malformed(struct feed *f, const struct nurbs_line *line) {
+	struct feed_block *b = feed_claim(f);
+	if (!b)
+		return 1;
+	feed_sweep(b, line, FEED_MAX_POINTS);
+	((float *)nurbs_line_knots(feed_line(b)))[1] = NAN;
+	if (feed_publish(f, b) < 0)
+		return 1;
+
+	b = feed_claim(f);
+	if (!b)
+		return 1;
+	feed_sweep(b, line, FEED_MAX_POINTS + 1);
+	return feed_publish(f, b) < 0;
+}
+
+/* Die holding a claim */
+static int feed_die(struct feed *f, const struct nurbs_line *line) {
+	(void)line;
+	return feed_claim(f) == NULL;
+}
+
+/* Send FEED_BLOCKS blocks, each with its number in the first point's x
+ * or in its count, waiting whenever the ring is full */
+static int feed_stream(struct feed *f, const struct nurbs_line *line) {
+	for (int i = 0; i < FEED_BLOCKS; i++) {
+		struct feed_block *b;
+		while (!(b = feed_claim(f)))
+			sched_yield();
+
+		if (i % 2) {
+			feed_sweep(b, line, i);
+		} else {
+			b->kind = FEED_POINTS;
+			b->count = 1;
+			feed_points(b)[0].x = i;
+		}
+
+		if (feed_publish(f, b) < 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+typedef int feed_producer(struct feed *f, const struct nurbs_line *line);
+
+static pid_t feed_fork(const char *name, feed_producer *fn,
+                       const struct nurbs_line *line) {
+	pid_t pid = fork();
+	if (pid)
+		return pid;
+
+	struct feed *f = feed_open(name);
+	_exit(!f || fn(f, line));
+}
+
+static int feed_wait(pid_t pid) {
+	int status;
+	return pid > 0 && waitpid(pid, &status, 0) == pid
+	       && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void feed_sleep(int ms) {
+	nanosleep(&(struct timespec){ .tv_sec = ms / 1000,
+	                              .tv_nsec = ms % 1000 * 1000000 }, NULL);
+}
+
+/* Whether the feed has nothing to take; anything it does have is let go */
+static int feed_none(struct feed *f) {
+	if (!feed_next(f))
+		return 1;
+	feed_release(f);
+	return 0;
+}
+
+/* bench_feed(line)
+ *
+ * Run the feed against producers in other processes, one after another:
+ * one fills the ring, whose blocks are left to go stale; one sends two
+ * malformed blocks; one dies holding a claim; and one streams blocks to be
+ * drawn as they come, in order. The consumer's counters must come out
+ * exactly as that implies.
+ */
+static void bench_feed(const struct nurbs_line *line) {
+	static struct etherdream_point pts[FEED_BLOCKS];
+	char name[64];
+	snprintf(name, sizeof name, "/reticulate-bench-show-%d", (int)getpid());
+
+	fflush(stdout);
+	struct feed *f = feed_create(name, FEED_SLOTS, FEED_LATENCY_MS);
+	if (!f) {
+		failures++;
+		return;
+	}
+
+	struct feed_stats st;
+	int ok = feed_wait(feed_fork(name, feed_fill, line));
+	feed_sleep(FEED_LATENCY_MS * 3 / 2);
+	ok &= feed_none(f);
+	feed_stats(f, &st);
+	ok &= st.stale == FEED_SLOTS && st.full == 1;
+
+	ok &= feed_wait(feed_fork(name, feed_malformed, line));
+	ok &= feed_none(f);
+	feed_stats(f, &st);
+	ok &= st.invalid == 2;
+
+	ok &= feed_wait(feed_fork(name, feed_die, line));
+	ok &= feed_none(f);
+	feed_sleep(FEED_LATENCY_MS * 3 / 2);
+	ok &= feed_none(f);
+	feed_stats(f, &st);
+	ok &= st.abandoned == 1 && st.consumed == 0;
+
+	long long start = now_ns();
+	pid_t pid = feed_fork(name, feed_stream, line);
+	int taken = 0;
+	while (taken < FEED_BLOCKS && now_ns() - start < 10000000000LL) {
+		const struct feed_item *it = feed_next(f);
+		if (!it) {
+			sched_yield();
+			continue;
+		}
+
+		if (it->kind == FEED_SWEEP) {
+			render_sweep(pts, it->count, &it->sweep,
+			             it->redraw_count);
+			ok &= it->count == taken;
+		} else {
+			ok &= it->count == 1 && it->points[0].x == taken;
+		}
+		feed_release(f);
+		taken++;
+	}
+	double ns = (double)(now_ns() - start) / FEED_BLOCKS;
+	ok &= feed_wait(pid) && taken == FEED_BLOCKS;
+
+	feed_stats(f, &st);
+	feed_close(f);
+
+	ok &= st.consumed == FEED_BLOCKS && st.stale == FEED_SLOTS
+	      && st.invalid == 2 && st.abandoned == 1
+	      && st.published == FEED_SLOTS + 2 + FEED_BLOCKS;
+	if (!ok)
+		failures++;
+
+	printf("%s    {\"curve\": \"feed\", \"evaluator\": \"feed_next\", "
+	       "\"blocks\": %d, \"ns_per_block\": %.0f, \"consumed\": %lu, "
+	       "\"stale\": %lu, \"invalid\": %lu, \"abandoned\": %lu, "
+	       "\"full\": %lu, \"ok\": %s}",
+	       separator(), FEED_BLOCKS, ns, st.consumed, st.stale, st.invalid,
+	       st.abandoned, st.full, ok ? "true" : "false");
+}
+
+int main(int argc, char **argv) {
+	/* The loaders chatter on stdout; keep that out of the JSON. */
+	fflush(stdout);
+	int json_fd = dup(1);
+	dup2(2, 1);
+
+	struct nurbs_line *line = nurbs_load_line("data/circle.nub");
+	if (!line) {
+		printf("couldn't load data/circle.nub\n");
+		return 1;
+	}
+
+	render_init();
+	render_compile();
+
+	fflush(stdout);
+	dup2(json_fd, 1);
+	close(json_fd);
+
+	printf("{\n  \"results\": [\n");
+
+	bench_ilda();
+	bench_frames();
+	bench_feed(line);
+
+	printf("\n  ],\n  \"failures\": %d\n}\n", failures);
+	free(line);
+	return failures ? 1 : 0;
+}
@@ -13,34 +13,93 @@ def nub(points, knots):
 
     return out
 
+NUBL_VERSION = 1
+NUBL_ALIGN = 64
+NUBL_HEADER_SIZE = 32
+NUBL_ENTRY_SIZE = 32
+
+def nubl(shapes):
+    """Pack a list of (name, points, knots) into a nub library; see
+    nurbs.c for the layout."""
+    shapes = sorted(shapes)
+    offset = NUBL_HEADER_SIZE + NUBL_ENTRY_SIZE * len(shapes)
+
+    index = ""
+    blocks = ""
+
+    for name, points, knots in shapes:
+        assert len(points) + 3 == len(knots)
+        assert len(name) < 16
+
+        # The point count goes just before an aligned boundary, so the
+        # control points themselves start on one
+        pad = -(offset + 4) % NUBL_ALIGN
+        blocks += "\0" * pad
+        offset += pad
+
+        line_offset = offset
+        block = struct.pack("<i", len(points))
+
+        for pt in points:
+            block += struct.pack("<fff", *pt)
+
+        for k in knots:
+            block += struct.pack("<f", k)
+
+        spans = [k for k in range(2, len(points)) if knots[k] < knots[k + 1]]
+        span_offset = line_offset + len(block)
+
+        for k in spans:
+            block += struct.pack("<i", k)
+
+        index += struct.pack("<16sIIII", name, line_offset, len(points),
+                             span_offset, len(spans))
+        blocks += block
+        offset += len(block)
+
+    header = struct.pack("<4sIIII12x", "nubL", NUBL_VERSION, len(shapes),
+                         NUBL_HEADER_SIZE, offset)
+
+    return header + index + blocks
+
+circle = (
+    (
+        (1, 0, 1),
+        (1, 1, 0.7071067811865476),
+        (0, 1, 1),
+        (-1, 1, 0.7071067811865476),
+        (-1, 0, 1),
+        (-1, -1, 0.7071067811865476),
+        (0, -1, 1),
+        (1, -1, 0.7071067811865476),
+        (1, 0, 1)
+    ),
+    (0, 0, 0, 0.25, 0.25, 0.5, 0.5, 0.75, 0.75, 1, 1, 1)
+)
+
+square = (
+    (
+        (1, 1, 1),
+        (1, 0, 1),
+        (1, -1, 1),
+        (0, -1, 1),
+        (-1, -1, 1),
+        (-1, 0, 1),
+        (-1, 1, 1),
+        (0, 1, 1),
+        (1, 1, 1),
+    ),
+    (0, 0, 0, 0.25, 0.25, 0.5, 0.5, 0.75, 0.75, 1, 1, 1)
+)
+
 with file("circle.nub", "w") as f:
-    f.write(nub(
-        (
-            (1, 0, 1),
-            (1, 1, 0.7071067811865476),
-            (0, 1, 1),
-            (-1, 1, 0.7071067811865476),
-            (-1, 0, 1),
-            (-1, -1, 0.7071067811865476),
-            (0, -1, 1),
-            (1, -1, 0.7071067811865476),
-            (1, 0, 1)
-        ),
-        (0, 0, 0, 0.25, 0.25, 0.5, 0.5, 0.75, 0.75, 1, 1, 1)
-    ))
+    f.write(nub(*circle))
 
 with file("square.nub", "w") as f:
-    f.write(nub(
-        (
-            (1, 1, 1),
-            (1, 0, 1),
-            (1, -1, 1),
-            (0, -1, 1),
-            (-1, -1, 1),
-            (-1, 0, 1),
-            (-1, 1, 1),
-            (0, 1, 1),
-            (1, 1, 1),
-        ),
-        (0, 0, 0, 0.25, 0.25, 0.5, 0.5, 0.75, 0.75, 1, 1, 1)
-    ))
+    f.write(nub(*square))
+
+with file("shapes.nubl", "w") as f:
+    f.write(nubl([
+        ("circle",) + circle,
+        ("square",) + square,
+    ]))
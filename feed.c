@@ -0,0 +1,446 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "feed.h"
+
+#define FEED_MAGIC	0x64656566	/* "feed" */
+#define FEED_VERSION	2
+
+/* The mapping is this header followed by the slots. Each slot is a
+ * cache line holding its sequence number, then its block; the sequence
+ * number says whose turn the slot is, for position pos in the ring:
+ *
+ *   pos             free, for the producer that claims pos
+ *   pos + 1         published, for the consumer
+ *   pos + slots     released, so free for position pos + slots
+ *
+ * Producers claim positions by advancing head with a compare-and-swap,
+ * so any number can share the ring; the consumer alone advances tail.
+ * A slot claimed and left unpublished for longer than the latency bound
+ * is taken back by the consumer, moving its number on from pos to
+ * pos + slots, so a producer that died holding it doesn't stop the ring;
+ * a producer that was only slow then fails to publish, as the number is
+ * no longer the one it claimed. */
+struct feed_shared {
+	uint32_t magic, version;
+	uint32_t slots, block_bytes;
+
+	/* Written by producers */
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t published, full;
+
+	/* Written by the consumer */
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t consumed, stale, invalid, abandoned;
+
+	unsigned char ring[] __attribute__((aligned(64)));
+};
+
+#define SLOT_HEADER	64
+#define SLOT_BYTES	(SLOT_HEADER + FEED_BLOCK_BYTES)
+
+struct feed {
+	struct feed_shared *sh;
+	size_t size;
+	uint32_t slots;		/* as checked at open */
+	int consumer;
+	char name[NAME_MAX];
+
+	/* Producer only: the position of the block claimed */
+	uint64_t claim_pos;
+
+	/* Consumer only: what's been taken, with a sweep's line copied out of
+	 * the ring */
+	long long max_latency_ns;
+	int out;
+	uint64_t out_pos;
+	struct feed_item item;
+	struct nurbs_line *line;
+	int waiting;		/* on an unpublished claim at wait_pos */
+	uint64_t wait_pos;
+	long long wait_since;
+	unsigned long empty, taken;
+	double latency_sum, latency_max;
+};
+
+static long long now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static unsigned char *slot(const struct feed *f, uint64_t pos) {
+	return f->sh->ring + (pos & (f->slots - 1)) * SLOT_BYTES;
+}
+
+static uint64_t *slot_seq(const struct feed *f, uint64_t pos) {
+	return (uint64_t *)slot(f, pos);
+}
+
+static struct feed_block *slot_block(const struct feed *f, uint64_t pos) {
+	return (struct feed_block *)(slot(f, pos) + SLOT_HEADER);
+}
+
+static size_t feed_size(int slots) {
+	return sizeof (struct feed_shared) + (size_t)slots * SLOT_BYTES;
+}
+
+static void count(uint64_t *counter) {
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+struct feed *feed_create(const char *name, int slots, int max_latency_ms) {
+	if (slots < 2 || (slots & (slots - 1))) {
+		printf("feed: %d slots isn't a power of two\n", slots);
+		return NULL;
+	}
+
+	struct feed *f = calloc(1, sizeof *f);
+	if (!f) {
+		printf("oom in feed_create\n");
+		return NULL;
+	}
+
+	f->line = malloc(FEED_DATA_BYTES);
+	if (!f->line) {
+		printf("oom in feed_create\n");
+		free(f);
+		return NULL;
+	}
+
+	snprintf(f->name, sizeof f->name, "%s", name);
+	f->consumer = 1;
+	f->max_latency_ns = max_latency_ms * 1000000LL;
+	f->size = feed_size(slots);
+	f->slots = slots;
+
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		perror(name);
+		free(f->line);
+		free(f);
+		return NULL;
+	}
+
+	if (ftruncate(fd, f->size) < 0) {
+		perror(name);
+		goto bail;
+	}
+
+	f->sh = mmap(NULL, f->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	             0);
+	if (f->sh == MAP_FAILED) {
+		perror(name);
+		goto bail;
+	}
+	close(fd);
+
+	struct feed_shared *sh = f->sh;
+	sh->version = FEED_VERSION;
+	sh->slots = slots;
+	sh->block_bytes = FEED_BLOCK_BYTES;
+	for (int i = 0; i < slots; i++)
+		*slot_seq(f, i) = i;
+
+	/* Producers check the magic last, so it goes in last */
+	__atomic_store_n(&sh->magic, FEED_MAGIC, __ATOMIC_RELEASE);
+	return f;
+
+bail:
+	close(fd);
+	shm_unlink(name);
+	free(f->line);
+	free(f);
+	return NULL;
+}
+
+struct feed *feed_open(const char *name) {
+	struct feed *f = calloc(1, sizeof *f);
+	if (!f) {
+		printf("oom in feed_open\n");
+		return NULL;
+	}
+
+	snprintf(f->name, sizeof f->name, "%s", name);
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		perror(name);
+		free(f);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof *f->sh) {
+		printf("%s: not a feed\n", name);
+		goto bail;
+	}
+
+	f->size = st.st_size;
+	f->sh = mmap(NULL, f->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	             0);
+	if (f->sh == MAP_FAILED) {
+		perror(name);
+		goto bail;
+	}
+	close(fd);
+
+	struct feed_shared *sh = f->sh;
+	uint32_t slots = sh->slots;
+	if (__atomic_load_n(&sh->magic, __ATOMIC_ACQUIRE) != FEED_MAGIC
+	    || sh->version != FEED_VERSION
+	    || sh->block_bytes != FEED_BLOCK_BYTES
+	    || slots < 2 || (slots & (slots - 1))
+	    || f->size != feed_size(slots)) {
+		printf("%s: not a feed, or a different version\n", name);
+		munmap(f->sh, f->size);
+		free(f);
+		return NULL;
+	}
+
+	f->slots = slots;
+	return f;
+
+bail:
+	close(fd);
+	free(f);
+	return NULL;
+}
+
+void feed_close(struct feed *f) {
+	munmap(f->sh, f->size);
+	if (f->consumer)
+		shm_unlink(f->name);
+	free(f->line);
+	free(f);
+}
+
+struct feed_block *feed_claim(struct feed *f) {
+	struct feed_shared *sh = f->sh;
+	uint64_t pos = __atomic_load_n(&sh->head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		uint64_t seq = __atomic_load_n(slot_seq(f, pos),
+		                               __ATOMIC_ACQUIRE);
+		int64_t diff = seq - pos;
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&sh->head, &pos,
+			                                pos + 1, 1,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED)) {
+				f->claim_pos = pos;
+				return slot_block(f, pos);
+			}
+		} else if (diff < 0) {
+			/* The consumer hasn't released this slot yet */
+			count(&sh->full);
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&sh->head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+int feed_publish(struct feed *f, struct feed_block *b) {
+	uint64_t *seq = (uint64_t *)((unsigned char *)b - SLOT_HEADER);
+	uint64_t pos = f->claim_pos;
+
+	/* Unless the consumer has given up on the claim and taken the slot
+	 * back, its number is still the position it was claimed at */
+	b->stamp_ns = now_ns();
+	if (!__atomic_compare_exchange_n(seq, &pos, pos + 1, 0,
+	                                 __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return -1;
+
+	count(&f->sh->published);
+	return 0;
+}
+
+/* check_block(h, line)
+ *
+ * Validate a block, from its header and line as copied out of the ring,
+ * before drawing it. A sweep's points, knots and path must be finite and
+ * its weights positive, since the evaluator divides by them.
+ */
+static int check_block(const struct feed_block *h,
+                       const struct nurbs_line *line) {
+	if (h->count < 1 || h->count > FEED_MAX_POINTS)
+		return -1;
+	if (h->kind == FEED_POINTS)
+		return 0;
+	if (h->kind != FEED_SWEEP)
+		return -1;
+
+	if (!(h->redraw_count > 0) || !isfinite(h->redraw_count))
+		return -1;
+
+	const float *path = (const float *)h->path;
+	size_t floats = NURBS_T_POINTS * sizeof *h->path / sizeof (float);
+	for (size_t i = 0; i < floats; i++)
+		if (!isfinite(path[i]))
+			return -1;
+
+	if (h->line_bytes > FEED_DATA_BYTES
+	    || nurbs_line_check(line, h->line_bytes) < 0)
+		return -1;
+
+	for (int i = 0; i < line->points; i++) {
+		const struct nurbs_point *p = &line->t[i];
+		if (!isfinite(p->x) || !isfinite(p->y) || !isfinite(p->weight)
+		    || !(p->weight > 0))
+			return -1;
+	}
+
+	/* check_knots() only orders them, which NaN slips through */
+	const float *knots = nurbs_line_knots(line);
+	for (int i = 0; i < line->points + 3; i++)
+		if (!isfinite(knots[i]))
+			return -1;
+
+	return 0;
+}
+
+/* Hand a slot back to the producers */
+static void release(struct feed *f, uint64_t pos) {
+	__atomic_store_n(slot_seq(f, pos), pos + f->slots,
+	                 __ATOMIC_RELEASE);
+	__atomic_store_n(&f->sh->tail, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* abandoned(f, pos)
+ *
+ * Whether the slot at pos, which the consumer is waiting on, has been
+ * claimed and left unpublished for longer than the latency bound, which
+ * most likely means its producer died. The wait is timed from when the
+ * consumer first found the slot claimed, as it can't trust anything the
+ * producer wrote.
+ */
+static int abandoned(struct feed *f, uint64_t pos) {
+	if (__atomic_load_n(&f->sh->head, __ATOMIC_ACQUIRE) <= pos) {
+		f->waiting = 0;
+		return 0;
+	}
+
+	long long now = now_ns();
+	if (!f->waiting || f->wait_pos != pos) {
+		f->waiting = 1;
+		f->wait_pos = pos;
+		f->wait_since = now;
+		return 0;
+	}
+
+	return now - f->wait_since > f->max_latency_ns;
+}
+
+const struct feed_item *feed_next(struct feed *f) {
+	struct feed_shared *sh = f->sh;
+	assert(f->consumer && !f->out);
+
+	for (;;) {
+		uint64_t pos = sh->tail;
+		uint64_t seq = __atomic_load_n(slot_seq(f, pos),
+		                               __ATOMIC_ACQUIRE);
+		if (seq != pos + 1) {
+			/* Take back a claim that's held too long, unless it's
+			 * published as we do */
+			if (seq == pos && abandoned(f, pos)
+			    && __atomic_compare_exchange_n(slot_seq(f, pos),
+			                                   &seq,
+			                                   pos + f->slots, 0,
+			                                   __ATOMIC_RELEASE,
+			                                   __ATOMIC_RELAXED)) {
+				count(&sh->abandoned);
+				__atomic_store_n(&sh->tail, pos + 1,
+				                 __ATOMIC_RELEASE);
+				continue;
+			}
+
+			f->empty++;
+			return NULL;
+		}
+
+		/* Copy the header, and a sweep's line, out of the ring and
+		 * only look at the copies from here on. The fence stops the
+		 * compiler reading the ring again in place of a copy. */
+		struct feed_block *b = slot_block(f, pos), h;
+		memcpy(&h, b, sizeof h);
+		if (h.kind == FEED_SWEEP && h.line_bytes <= FEED_DATA_BYTES)
+			memcpy(f->line, b->data, h.line_bytes);
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+		long long age = now_ns() - (long long)h.stamp_ns;
+		if (age > f->max_latency_ns) {
+			count(&sh->stale);
+			release(f, pos);
+			continue;
+		}
+
+		if (check_block(&h, f->line) < 0) {
+			count(&sh->invalid);
+			release(f, pos);
+			continue;
+		}
+
+		count(&sh->consumed);
+		f->taken++;
+		f->latency_sum += age / 1e6;
+		if (age / 1e6 > f->latency_max)
+			f->latency_max = age / 1e6;
+
+		f->item = (struct feed_item){
+			.kind = h.kind,
+			.count = h.count,
+			.redraw_count = h.redraw_count,
+		};
+		if (h.kind == FEED_POINTS) {
+			f->item.points = feed_points(b);
+		} else {
+			f->item.sweep.line = f->line;
+			memcpy(f->item.sweep.path, h.path,
+			       sizeof f->item.sweep.path);
+		}
+
+		f->out = 1;
+		f->out_pos = pos;
+		return &f->item;
+	}
+}
+
+void feed_release(struct feed *f) {
+	assert(f->out);
+	f->out = 0;
+	release(f, f->out_pos);
+}
+
+void feed_stats(struct feed *f, struct feed_stats *out) {
+	struct feed_shared *sh = f->sh;
+	uint64_t tail = __atomic_load_n(&sh->tail, __ATOMIC_ACQUIRE);
+	uint64_t head = __atomic_load_n(&sh->head, __ATOMIC_ACQUIRE);
+
+	*out = (struct feed_stats){
+		.slots = f->slots,
+		.depth = head - tail,
+		.published = __atomic_load_n(&sh->published, __ATOMIC_RELAXED),
+		.full = __atomic_load_n(&sh->full, __ATOMIC_RELAXED),
+		.consumed = __atomic_load_n(&sh->consumed, __ATOMIC_RELAXED),
+		.stale = __atomic_load_n(&sh->stale, __ATOMIC_RELAXED),
+		.invalid = __atomic_load_n(&sh->invalid, __ATOMIC_RELAXED),
+		.abandoned = __atomic_load_n(&sh->abandoned,
+		                             __ATOMIC_RELAXED),
+		.empty = f->empty,
+		.mean_latency_ms = f->taken ? f->latency_sum / f->taken : 0,
+		.max_latency_ms = f->latency_max,
+	};
+}
@@ -0,0 +1,111 @@
+#ifndef FEED_H
+#define FEED_H
+
+#include <stdint.h>
+
+#include "nurbs.h"
+#include "render.h"
+
+/* A ring of blocks in POSIX shared memory, through which other local
+ * processes feed reticulate things to draw. reticulate creates the feed
+ * and consumes it; any number of producers open it by name, claim a free
+ * block, fill it in place, and publish it. Points aren't copied on the
+ * way: the consumer hands them to the DAC straight out of the ring. The
+ * rest of a block is copied out before it's checked, so a producer that
+ * goes on writing to a published block can spoil what's drawn, but can't
+ * get anything past the checks.
+ *
+ * A producer must not touch a block once it's published. When the ring
+ * is full, feed_claim() fails rather than waits, and counts it, so a
+ * producer learns to back off; the consumer also drops blocks that have
+ * waited longer than its latency bound, so what's drawn is never more
+ * than that far behind, and takes back blocks claimed and not published
+ * within it, so a producer that dies can't stop the feed. */
+#define FEED_DEFAULT_NAME	"/reticulate"
+#define FEED_BLOCK_BYTES	32768
+#define FEED_DEFAULT_SLOTS	16
+
+enum feed_kind {
+	FEED_POINTS = 1,	/* count DAC points */
+	FEED_SWEEP,		/* a line, swept along path */
+};
+
+struct feed_block {
+	uint32_t kind;
+	uint32_t count;		/* points to draw */
+	uint64_t stamp_ns;	/* CLOCK_MONOTONIC when published */
+
+	/* FEED_SWEEP only: the line in data[] is traced redraw_count times
+	 * over the block's points, as render_sweep() does */
+	float redraw_count;
+	uint32_t line_bytes;
+	struct nurbs_affine path[NURBS_T_POINTS];
+
+	unsigned char data[] __attribute__((aligned(16)));
+};
+
+#define FEED_DATA_BYTES	(FEED_BLOCK_BYTES - sizeof (struct feed_block))
+#define FEED_MAX_POINTS \
+	((int)(FEED_DATA_BYTES / sizeof (struct etherdream_point)))
+
+static inline struct etherdream_point *feed_points(struct feed_block *b) {
+	return (struct etherdream_point *)b->data;
+}
+
+static inline struct nurbs_line *feed_line(struct feed_block *b) {
+	return (struct nurbs_line *)b->data;
+}
+
+struct feed_stats {
+	int slots;
+	int depth;		/* blocks claimed and not yet taken */
+	unsigned long published;
+	unsigned long full;	/* claims refused as the ring was full */
+	unsigned long consumed;
+	unsigned long stale;	/* dropped for waiting too long */
+	unsigned long invalid;	/* dropped as malformed */
+	unsigned long abandoned;	/* claims taken back unpublished */
+	unsigned long empty;	/* times the consumer found nothing */
+	double mean_latency_ms;	/* from publish to being taken */
+	double max_latency_ms;
+};
+
+/* A block as the consumer takes it, checked. Only points are left in the
+ * ring. */
+struct feed_item {
+	enum feed_kind kind;
+	int count;
+	const struct etherdream_point *points;	/* FEED_POINTS */
+	struct nurbs_sweep sweep;		/* FEED_SWEEP */
+	float redraw_count;
+};
+
+struct feed;
+
+/* Consumer: create the feed called name (for shm_open(), so "/name"),
+ * replacing any left over from before. slots must be a power of two. */
+struct feed *feed_create(const char *name, int slots, int max_latency_ms);
+
+/* Take the oldest published block, or NULL if there's none. It stays
+ * valid, and its slot stays out of the ring, until feed_release(). */
+const struct feed_item *feed_next(struct feed *f);
+void feed_release(struct feed *f);
+
+/* Producer: open an existing feed. */
+struct feed *feed_open(const char *name);
+
+/* Claim a free block to fill in, or NULL if the ring is full. A handle
+ * holds one claim at a time, which must be published; if that takes
+ * longer than the consumer's latency bound, the consumer takes the block
+ * back, and feed_publish() fails with -1. */
+struct feed_block *feed_claim(struct feed *f);
+int feed_publish(struct feed *f, struct feed_block *b);
+
+/* The consumer's counters (empty and latency) are only kept by the
+ * consumer's own handle. */
+void feed_stats(struct feed *f, struct feed_stats *out);
+
+/* Unmap the feed; the consumer also removes it. */
+void feed_close(struct feed *f);
+
+#endif
@@ -0,0 +1,164 @@
+/* A producer for reticulate's feed (see feed.h): spins a shape loaded
+ * from a .nub file, sending one block per step either as the sweep itself
+ * or as points rendered here, and reports how often the ring was full.
+ * Start reticulate with -f first.
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "feed.h"
+#include "render.h"
+
+#define PPS		30000
+#define BLOCK_POINTS	1500
+#define REDRAW_COUNT	3
+#define STEP_DEGREES	3
+#define STATS_SECONDS	1
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-n name] [-c points] [-P] [-t seconds] "
+	        "file.nub\n"
+	        "  -n  feed to send to (default %s)\n"
+	        "  -c  points per block (default %d, at most %d)\n"
+	        "  -P  render points here, rather than sending sweeps\n"
+	        "  -t  stop after this long (default: run until killed)\n",
+	        name, FEED_DEFAULT_NAME, BLOCK_POINTS, FEED_MAX_POINTS);
+	exit(1);
+}
+
+static long long now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void sleep_ns(long long ns) {
+	nanosleep(&(struct timespec){ .tv_sec = ns / 1000000000,
+	                              .tv_nsec = ns % 1000000000 }, NULL);
+}
+
+/* The shape turning from angle to angle + STEP_DEGREES over the block */
+static void make_path(struct nurbs_affine path[NURBS_T_POINTS],
+                      float angle) {
+	for (int j = 0; j < NURBS_T_POINTS; j++) {
+		float a = (angle + STEP_DEGREES * j / (NURBS_T_POINTS - 1.0))
+		        * M_PI / 180;
+		path[j] = (struct nurbs_affine){
+			cosf(a), -sinf(a),
+			sinf(a), cosf(a),
+			0, 0
+		};
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *name = FEED_DEFAULT_NAME;
+	int points = BLOCK_POINTS, raw = 0;
+	float seconds = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:c:Pt:")) != -1) {
+		switch (opt) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'c':
+			points = atoi(optarg);
+			if (points < 1 || points > FEED_MAX_POINTS)
+				usage(argv[0]);
+			break;
+		case 'P':
+			raw = 1;
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	struct nurbs_line *line = nurbs_load_line(argv[optind]);
+	if (!line)
+		return 1;
+
+	size_t line_bytes = sizeof *line
+	                  + line->points * sizeof (struct nurbs_point)
+	                  + (line->points + 3) * sizeof (float);
+	if (line_bytes > FEED_DATA_BYTES) {
+		printf("%s: too big for a feed block\n", argv[optind]);
+		return 1;
+	}
+
+	struct feed *f = feed_open(name);
+	if (!f)
+		return 1;
+
+	/* Send at the rate the blocks play out, backing off a block's time
+	 * whenever the ring is full */
+	long long block_ns = (long long)points * 1000000000 / PPS;
+	long long start = now_ns(), next = start, report = start;
+	unsigned long sent = 0, refused = 0, late = 0;
+	float angle = 0;
+
+	while (!seconds || now_ns() - start < seconds * 1e9) {
+		struct feed_block *b = feed_claim(f);
+		if (!b) {
+			refused++;
+			next += block_ns;
+			sleep_ns(block_ns);
+			continue;
+		}
+
+		b->count = points;
+		if (raw) {
+			struct nurbs_sweep s = { .line = line };
+			make_path(s.path, angle);
+			b->kind = FEED_POINTS;
+			render_sweep(feed_points(b), points, &s, REDRAW_COUNT);
+		} else {
+			b->kind = FEED_SWEEP;
+			b->redraw_count = REDRAW_COUNT;
+			b->line_bytes = line_bytes;
+			make_path(b->path, angle);
+			memcpy(feed_line(b), line, line_bytes);
+		}
+
+		if (feed_publish(f, b) < 0)
+			late++;
+		else
+			sent++;
+		angle = fmodf(angle + STEP_DEGREES, 360);
+
+		long long now = now_ns();
+		if (now - report >= STATS_SECONDS * 1000000000LL) {
+			struct feed_stats st;
+			feed_stats(f, &st);
+			printf("sent %lu, refused %lu, too late %lu; feed: "
+			       "depth %d/%d, %lu taken, %lu stale, "
+			       "%lu invalid, %lu abandoned, %lu full\n",
+			       sent, refused, late, st.depth, st.slots,
+			       st.consumed, st.stale, st.invalid, st.abandoned,
+			       st.full);
+			report = now;
+		}
+
+		next += block_ns;
+		if (next > now)
+			sleep_ns(next - now);
+	}
+
+	feed_close(f);
+	free(line);
+	return 0;
+}
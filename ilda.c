@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ilda.h"
+
+/* Each frame is a header followed by its records, and a header with no
+ * records ends the file. Multi-byte fields are big-endian, so they're kept
+ * as bytes here. */
+struct ilda_header {
+	char magic[4];
+	uint8_t reserved[3];
+	uint8_t format;
+	char name[8];
+	char company[8];
+	uint8_t records[2];
+	uint8_t number[2];
+	uint8_t total[2];
+	uint8_t projector;
+	uint8_t reserved2;
+};
+
+#define ILDA_3D_TRUE	4	/* x, y, z, status, b, g, r */
+#define ILDA_2D_TRUE	5	/* x, y, status, b, g, r */
+#define ILDA_PALETTE	2	/* r, g, b */
+
+#define STATUS_LAST	0x80
+#define STATUS_BLANK	0x40
+
+#define RECORD_SIZE	8
+
+static unsigned get16(const uint8_t *p) {
+	return p[0] << 8 | p[1];
+}
+
+static void put16(uint8_t *p, unsigned v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static size_t frame_size(int records) {
+	return sizeof (struct ilda_header) + (size_t)records * RECORD_SIZE;
+}
+
+static void put_header(uint8_t *at, int records, int number, int total) {
+	struct ilda_header h = { .format = ILDA_2D_TRUE };
+	memcpy(h.magic, "ILDA", 4);
+	strncpy(h.name, "pattern", sizeof h.name);
+	memcpy(h.company, "reticula", sizeof h.company);
+	put16(h.records, records);
+	put16(h.number, number);
+	put16(h.total, total);
+	memcpy(at, &h, sizeof h);
+}
+
+struct export_job {
+	pthread_t thread;
+	uint8_t *map;
+	int first, frames, total;
+	int points, period, frame_points;
+	float redraw_count;
+};
+
+static void *export_thread_func(void *arg) {
+	struct export_job *job = arg;
+	struct etherdream_point pts[ILDA_EXPORT_BLOCK];
+
+	for (int f = job->first; f < job->first + job->frames; f++) {
+		int start = f * job->frame_points;
+		int count = job->points - start < job->frame_points
+		          ? job->points - start : job->frame_points;
+
+		uint8_t *at = job->map + f * frame_size(job->frame_points);
+		put_header(at, count, f, job->total);
+		at += sizeof (struct ilda_header);
+
+		for (int i = 0; i < count; i += ILDA_EXPORT_BLOCK) {
+			int n = count - i < ILDA_EXPORT_BLOCK
+			      ? count - i : ILDA_EXPORT_BLOCK;
+			render_run(pts, n, (start + i) % job->period,
+			           job->period, job->redraw_count);
+
+			for (int j = 0; j < n; j++, at += RECORD_SIZE) {
+				const struct etherdream_point *pt = &pts[j];
+				put16(at, pt->x);
+				put16(at + 2, pt->y);
+				at[4] = i + j == count - 1 ? STATUS_LAST : 0;
+				if (!(pt->r | pt->g | pt->b))
+					at[4] |= STATUS_BLANK;
+				at[5] = pt->b >> 8;
+				at[6] = pt->g >> 8;
+				at[7] = pt->r >> 8;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+int ilda_export(const char *filename, int points, int period,
+                float redraw_count, int frame_points, int threads) {
+	if (points < 1 || frame_points < 1 || frame_points > ILDA_MAX_POINTS
+	    || (points - 1) / frame_points >= 65535) {
+		printf("can't fit %d points in an ILDA file\n", points);
+		return -1;
+	}
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > RENDER_MAX_THREADS)
+		threads = RENDER_MAX_THREADS;
+
+	int frames = (points + frame_points - 1) / frame_points;
+	size_t size = (frames + 1) * sizeof (struct ilda_header)
+	            + (size_t)points * RECORD_SIZE;
+
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(filename);
+		return -1;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                    fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	put_header(map + size - sizeof (struct ilda_header), 0, frames,
+	           frames);
+
+	struct export_job jobs[threads];
+	int chunk = (frames + threads - 1) / threads;
+
+	for (int i = 0; i < threads; i++) {
+		int first = i * chunk < frames ? i * chunk : frames;
+		jobs[i] = (struct export_job){
+			.map = map,
+			.first = first,
+			.frames = frames - first < chunk ? frames - first
+			                                 : chunk,
+			.total = frames,
+			.points = points,
+			.period = period,
+			.frame_points = frame_points,
+			.redraw_count = redraw_count,
+		};
+	}
+
+	/* The first range is rendered on the calling thread */
+	for (int i = 1; i < threads; i++) {
+		int res = pthread_create(&jobs[i].thread, NULL,
+		                         export_thread_func, &jobs[i]);
+		assert(res == 0);
+	}
+
+	export_thread_func(&jobs[0]);
+
+	for (int i = 1; i < threads; i++)
+		pthread_join(jobs[i].thread, NULL);
+
+	munmap(map, size);
+	return 0;
+}
+
+struct ilda_frame {
+	size_t offset;
+	int format;
+	int records;
+	int start;
+};
+
+struct load_job {
+	pthread_t thread;
+	const uint8_t *map;
+	const struct ilda_frame *frames;
+	int first, count;
+	struct etherdream_point *pts;
+};
+
+static void *load_thread_func(void *arg) {
+	struct load_job *job = arg;
+
+	for (int f = job->first; f < job->first + job->count; f++) {
+		const struct ilda_frame *fr = &job->frames[f];
+		const uint8_t *at = job->map + fr->offset;
+		int size = fr->format == ILDA_3D_TRUE ? 10 : 8;
+
+		/* In 3D records, z comes before the status and colour */
+		int skip = size - 8;
+
+		for (int i = 0; i < fr->records; i++, at += size) {
+			const uint8_t *c = at + 4 + skip;
+			int lit = !(c[0] & STATUS_BLANK);
+			job->pts[fr->start + i] = (struct etherdream_point){
+				.x = (int16_t)get16(at),
+				.y = (int16_t)get16(at + 2),
+				.r = lit ? c[3] * 257 : 0,
+				.g = lit ? c[2] * 257 : 0,
+				.b = lit ? c[1] * 257 : 0,
+			};
+		}
+	}
+
+	return NULL;
+}
+
+/* decode(map, frames, nframes, pts, threads)
+ *
+ * Decode every frame to its place in pts, sharing contiguous ranges of
+ * frames out among the given number of threads.
+ */
+static void decode(const uint8_t *map, const struct ilda_frame *frames,
+                   int nframes, struct etherdream_point *pts, int threads) {
+	if (threads < 1)
+		threads = 1;
+	if (threads > RENDER_MAX_THREADS)
+		threads = RENDER_MAX_THREADS;
+
+	struct load_job jobs[threads];
+	int chunk = (nframes + threads - 1) / threads;
+
+	for (int i = 0; i < threads; i++) {
+		int first = i * chunk < nframes ? i * chunk : nframes;
+		jobs[i] = (struct load_job){
+			.map = map,
+			.frames = frames,
+			.first = first,
+			.count = nframes - first < chunk ? nframes - first
+			                                 : chunk,
+			.pts = pts,
+		};
+	}
+
+	for (int i = 1; i < threads; i++) {
+		int res = pthread_create(&jobs[i].thread, NULL,
+		                         load_thread_func, &jobs[i]);
+		assert(res == 0);
+	}
+
+	load_thread_func(&jobs[0]);
+
+	for (int i = 1; i < threads; i++)
+		pthread_join(jobs[i].thread, NULL);
+}
+
+struct etherdream_point *ilda_load(const char *filename, int *points,
+                                   size_t max_bytes, int threads) {
+	struct etherdream_point *pts = NULL;
+	struct ilda_frame *frames = NULL;
+	int nframes = 0, total = 0;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		perror(filename);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0
+	    || st.st_size < (off_t)sizeof (struct ilda_header)) {
+		printf("not an ILDA file\n");
+		close(fd);
+		return NULL;
+	}
+
+	size_t size = st.st_size;
+	const uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	/* Find every frame first, so that they can be decoded in parallel
+	 * straight to their place in the buffer */
+	size_t off = 0;
+	while (off + sizeof (struct ilda_header) <= size) {
+		const struct ilda_header *h = (const void *)(map + off);
+		if (memcmp(h->magic, "ILDA", 4)) {
+			printf("not an ILDA file\n");
+			goto bail;
+		}
+
+		int records = get16(h->records);
+		if (!records)
+			break;
+
+		int rsize;
+		switch (h->format) {
+		case ILDA_3D_TRUE:
+			rsize = 10;
+			break;
+		case ILDA_2D_TRUE:
+			rsize = 8;
+			break;
+		case ILDA_PALETTE:
+			rsize = 3;
+			break;
+		default:
+			printf("ILDA format %d not supported\n", h->format);
+			goto bail;
+		}
+
+		off += sizeof *h;
+		if ((size - off) / rsize < (size_t)records
+		    || records > INT_MAX - total) {
+			printf("truncated ILDA file\n");
+			goto bail;
+		}
+
+		if (h->format != ILDA_PALETTE) {
+			if (nframes % 64 == 0) {
+				void *p = realloc(frames, (nframes + 64)
+				                          * sizeof *frames);
+				if (!p) {
+					printf("oom in ilda_load\n");
+					goto bail;
+				}
+				frames = p;
+			}
+
+			frames[nframes++] = (struct ilda_frame){
+				.offset = off,
+				.format = h->format,
+				.records = records,
+				.start = total,
+			};
+			total += records;
+		}
+
+		off += (size_t)records * rsize;
+	}
+
+	if (!total) {
+		printf("no points in %s\n", filename);
+		goto bail;
+	}
+
+	if ((size_t)total * sizeof *pts > max_bytes) {
+		printf("%s needs %zu KB, over the %zu KB cap\n", filename,
+		       (size_t)total * sizeof *pts >> 10, max_bytes >> 10);
+		goto bail;
+	}
+
+	pts = malloc((size_t)total * sizeof *pts);
+	if (!pts) {
+		printf("oom in ilda_load\n");
+		goto bail;
+	}
+
+	decode(map, frames, nframes, pts, threads);
+	*points = total;
+
+bail:
+	free(frames);
+	munmap((void *)map, size);
+	return pts;
+}
@@ -0,0 +1,31 @@
+#ifndef ILDA_H
+#define ILDA_H
+
+#include "render.h"
+
+/* ILDA image files, for rendering a pattern ahead of time. Frames are
+ * written as format 5 (2D, true colour); format 4 (3D, true colour) can
+ * also be read, with z ignored. A frame holds at most ILDA_MAX_POINTS. */
+#define ILDA_MAX_POINTS 65535
+
+/* Render points samples of the pattern of the given period to an ILDA file
+ * of frame_points points per frame. Each frame is rendered by render_run()
+ * from its first sample, ILDA_EXPORT_BLOCK points at a time, so it holds
+ * exactly what those calls give. The file is sized up front and mapped, and
+ * its frames are split into contiguous ranges that the given number of
+ * threads render straight into the mapping. Returns 0 on success. */
+#define ILDA_EXPORT_BLOCK 1024
+
+int ilda_export(const char *filename, int points, int period,
+                float redraw_count, int frame_points, int threads);
+
+/* Read every frame of an ILDA file into one buffer of DAC points, which
+ * can then be handed to etherdream_write() a slice at a time as is. This
+ * isn't a streaming reader: the whole file is decoded up front, by the
+ * given number of threads, so playing it takes no conversion at all, at
+ * the cost of holding all of it in memory. Returns NULL on error, or if
+ * the buffer would take more than max_bytes; release it with free(). */
+struct etherdream_point *ilda_load(const char *filename, int *points,
+                                   size_t max_bytes, int threads);
+
+#endif
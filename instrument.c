@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+
+#include "instrument.h"
+
+#ifdef INSTRUMENT
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#define RELAXED_GET(v_) __atomic_load_n(&(v_), __ATOMIC_RELAXED)
+
+static unsigned long dump_requests;
+static pthread_once_t signal_once = PTHREAD_ONCE_INIT;
+
+static void request_dump(int sig) {
+	__atomic_fetch_add(&dump_requests, 1, __ATOMIC_RELAXED);
+}
+
+static void signal_init(void) {
+	struct sigaction sa = { .sa_handler = request_dump };
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+/* bucket_value(i)
+ *
+ * Return the middle of the range of values that go in bucket i.
+ */
+static long long bucket_value(int i) {
+	if (i < HIST_SUB)
+		return i;
+
+	int shift = i / HIST_SUB - 1;
+	long long low = (long long)(HIST_SUB + i % HIST_SUB) << shift;
+	return low + ((1LL << shift) >> 1);
+}
+
+long long histogram_percentile(const struct histogram *h, double p) {
+	unsigned long count = RELAXED_GET(h->count);
+	unsigned long want = p * count, seen = 0;
+	long long max = RELAXED_GET(h->max);
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += RELAXED_GET(h->buckets[i]);
+		if (seen > want)
+			return bucket_value(i) < max ? bucket_value(i) : max;
+	}
+
+	return max;
+}
+
+void instrument_init(struct instrument *in) {
+	pthread_once(&signal_once, signal_init);
+
+	memset(in, 0, sizeof *in);
+	in->start = in->last_dump = instrument_now();
+	in->requests_seen = RELAXED_GET(dump_requests);
+}
+
+int instrument_due(struct instrument *in, int period_s) {
+	return instrument_now() - in->last_dump >= period_s * 1000000000LL
+	    || RELAXED_GET(dump_requests) != in->requests_seen;
+}
+
+static int print_histogram(char *buf, size_t size, const char *name,
+                           const struct histogram *h) {
+	unsigned long count = RELAXED_GET(h->count);
+	double mean = count ? (double)RELAXED_GET(h->sum) / count : 0;
+
+	return snprintf(buf, size, ",\"%s\":{\"count\":%lu,\"mean_us\":%.1f,"
+	                "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,"
+	                "\"p999_us\":%.1f,\"max_us\":%.1f}", name, count,
+	                mean / 1e3,
+	                histogram_percentile(h, 0.5) / 1e3,
+	                histogram_percentile(h, 0.9) / 1e3,
+	                histogram_percentile(h, 0.99) / 1e3,
+	                histogram_percentile(h, 0.999) / 1e3,
+	                RELAXED_GET(h->max) / 1e3);
+}
+
+void instrument_dump(struct instrument *in, FILE *f, int dac,
+                     int target_pps) {
+	long long now = instrument_now();
+	unsigned long points = RELAXED_GET(in->points);
+	double elapsed = (now - in->start) / 1e9;
+	double interval = (now - in->last_dump) / 1e9;
+
+	/* Build the whole line first, so that several outputs dumping at
+	 * once don't interleave. */
+	char buf[1024];
+	int len = snprintf(buf, sizeof buf, "{\"dac\":%d,\"elapsed_s\":%.3f,"
+	                   "\"points\":%lu,\"pps\":%.1f,\"avg_pps\":%.1f,"
+	                   "\"target_pps\":%d,\"write_errors\":%lu",
+	                   dac, elapsed, points,
+	                   interval > 0 ? (points - in->last_points) / interval
+	                                : 0,
+	                   elapsed > 0 ? points / elapsed : 0, target_pps,
+	                   RELAXED_GET(in->write_errors));
+	len += print_histogram(buf + len, sizeof buf - len, "render",
+	                       &in->render);
+	len += print_histogram(buf + len, sizeof buf - len, "write",
+	                       &in->write);
+	len += print_histogram(buf + len, sizeof buf - len, "wait", &in->wait);
+	snprintf(buf + len, sizeof buf - len, "}\n");
+
+	fputs(buf, f);
+	fflush(f);
+
+	in->last_dump = now;
+	in->last_points = points;
+	in->requests_seen = RELAXED_GET(dump_requests);
+}
+
+#endif
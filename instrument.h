@@ -0,0 +1,105 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+/* Timing and counters for each stage of the output loop. These are only
+ * built in with INSTRUMENT defined (make INSTRUMENT=1); otherwise the
+ * macros at the bottom compile down to the code they wrap and nothing
+ * else. */
+
+#ifdef INSTRUMENT
+
+#include <stdio.h>
+#include <time.h>
+
+/* A log-linear histogram of durations in nanoseconds, in the style of
+ * HdrHistogram: each power of two is split into HIST_SUB buckets, so a
+ * value is recorded to within 1/HIST_SUB of itself. There's one writer;
+ * other threads can read it at any time and get a slightly stale view. */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS) * HIST_SUB)
+
+struct histogram {
+	unsigned long count;
+	long long sum, max;
+	unsigned long buckets[HIST_BUCKETS];
+};
+
+/* Everything measured about one DAC's output */
+struct instrument {
+	struct histogram render;	/* filling a block of points */
+	struct histogram write;		/* etherdream_write() */
+	struct histogram wait;		/* etherdream_wait_for_ready() */
+	unsigned long write_errors;
+	unsigned long points;
+
+	/* Used by instrument_due() and instrument_dump() */
+	long long start, last_dump;
+	unsigned long last_points;
+	unsigned long requests_seen;
+};
+
+static inline long long instrument_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static inline int histogram_bucket(long long ns) {
+	if (ns < HIST_SUB)
+		return ns < 0 ? 0 : ns;
+
+	int shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + ((ns >> shift) & (HIST_SUB - 1));
+}
+
+#define RELAXED_SET(v_, x_) __atomic_store_n(&(v_), (x_), __ATOMIC_RELAXED)
+
+static inline void histogram_record(struct histogram *h, long long ns) {
+	int i = histogram_bucket(ns);
+	RELAXED_SET(h->buckets[i], h->buckets[i] + 1);
+	RELAXED_SET(h->count, h->count + 1);
+	RELAXED_SET(h->sum, h->sum + ns);
+	if (ns > h->max)
+		RELAXED_SET(h->max, ns);
+}
+
+long long histogram_percentile(const struct histogram *h, double p);
+
+/* instrument_init(in)
+ *
+ * Start measuring. The first call also sets up SIGUSR1 to ask every
+ * output for a dump.
+ */
+void instrument_init(struct instrument *in);
+
+/* instrument_due(in, period_s)
+ *
+ * Return whether it's time to dump: period_s has passed since the last
+ * one, or there's been a SIGUSR1.
+ */
+int instrument_due(struct instrument *in, int period_s);
+
+/* instrument_dump(in, f, dac, target_pps)
+ *
+ * Write everything measured so far to f as a single line of JSON.
+ */
+void instrument_dump(struct instrument *in, FILE *f, int dac,
+                     int target_pps);
+
+#define INSTRUMENT_TIME(h_, stmt_) do { \
+	long long t0_ = instrument_now(); \
+	stmt_; \
+	histogram_record((h_), instrument_now() - t0_); \
+} while (0)
+
+#define INSTRUMENT_COUNT(c_, n_) RELAXED_SET(c_, (c_) + (n_))
+
+#else
+
+#define INSTRUMENT_TIME(h_, stmt_) do { stmt_; } while (0)
+#define INSTRUMENT_COUNT(c_, n_) do { } while (0)
+
+#endif
+
+#endif
@@ -1,11 +1,57 @@
+#define _GNU_SOURCE
+
 #include "nurbs.h"
 
+#include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 const float nurbs_t_knots[7] = { 0, 0, 0, 0.5, 1, 1, 1 };
 
+/* check_knots(knots, count)
+ *
+ * Validate the knot vector for a curve of count control points.
+ */
+static int check_knots(const float *knots, int count) {
+	int repeats = 1;
+	for (int i = 1; i < count + 3; i++) {
+		if (knots[i] < knots[i - 1])
+			return -1;
+
+		if (knots[i] == knots[i - 1])
+			repeats++;
+		else
+			repeats = 1;
+
+		if (repeats > 3)
+			return -1;
+	}
+
+	if (knots[count + 2] < 1.0)
+		return -1;
+
+	return 0;
+}
+
+int nurbs_line_check(const struct nurbs_line *line, size_t size) {
+	if (size < sizeof *line)
+		return -1;
+
+	size_t points = line->points;
+	if (points < 3 || points > size / sizeof (struct nurbs_point))
+		return -1;
+	if (size < sizeof *line + points * sizeof (struct nurbs_point)
+	           + (points + 3) * sizeof (float))
+		return -1;
+
+	return check_knots(nurbs_line_knots(line), points);
+}
+
 struct nurbs_line *nurbs_load_line(const char *filename) {
 	struct nurbs_line *out = NULL;
 	FILE *fp = fopen(filename, "r");
@@ -34,7 +80,6 @@ struct nurbs_line *nurbs_load_line(const char *filename) {
 	}
 
 	out->points = count;
-	out->knots = (float *)(out->t + count);
 
 	int nfloats = (count * 4) + 3;
 	if (fread(out->t, sizeof (float), nfloats, fp) != nfloats) {
@@ -42,26 +87,7 @@ struct nurbs_line *nurbs_load_line(const char *filename) {
 		goto bail;
 	}
 
-	/* Validate the knot vector */
-	int repeats = 1;
-	for (int i = 1; i < count + 3; i++) {
-		if (out->knots[i] < out->knots[i - 1]) {
-			printf("invalid knot vector\n");
-			goto bail;
-		}
-
-		if (out->knots[i] == out->knots[i - 1])
-			repeats++;
-		else
-			repeats = 1;
-
-		if (repeats > 3) {
-			printf("invalid knot vector\n");
-			goto bail;
-		}
-	}
-
-	if (out->knots[count + 2] < 1.0) {
+	if (check_knots(nurbs_line_knots(out), count) < 0) {
 		printf("invalid knot vector\n");
 		goto bail;
 	}
@@ -75,6 +101,206 @@ bail:
 	return NULL;
 }
 
+/* Shape libraries
+ *
+ * A .nubl file holds many curves, and is mapped and used in place. All
+ * fields are little-endian:
+ *
+ *   header   struct nubl_header, at offset 0
+ *   index    count struct nubl_entry, sorted by name
+ *   blocks   for each shape: int32 points, then the control points and
+ *            knots exactly as in a .nub file, so that the block is a
+ *            struct nurbs_line; the control points start on a
+ *            NUBL_ALIGN-byte boundary. Then the indices k of the
+ *            nonzero knot spans (knots[k] < knots[k + 1]), as int32.
+ *
+ * data/nub.py writes these. Everything is checked once at open, after
+ * which lines are handed out as pointers into the mapping.
+ */
+
+#define NUBL_VERSION	1
+#define NUBL_ALIGN	64
+#define NUBL_NAME_LEN	16
+
+struct nubl_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+	uint32_t index_offset;
+	uint32_t file_size;
+	uint32_t reserved[3];
+};
+
+struct nubl_entry {
+	char name[NUBL_NAME_LEN];
+	uint32_t line_offset;
+	uint32_t points;
+	uint32_t span_offset;
+	uint32_t spans;
+};
+
+struct nurbs_library {
+	const char *map;
+	size_t size;
+	int count;
+	const struct nubl_entry *index;
+};
+
+static int check_entry(const struct nurbs_library *lib,
+                       const struct nubl_entry *e) {
+	if (!memchr(e->name, 0, sizeof e->name))
+		return -1;
+
+	size_t points = e->points;
+	size_t line_size = sizeof (struct nurbs_line)
+	                 + points * sizeof (struct nurbs_point)
+	                 + (points + 3) * sizeof (float);
+
+	/* Sizes are checked against the file before anything is subtracted
+	 * from its size, so that nothing can wrap */
+	if (points < 3 || points > lib->size || line_size > lib->size
+	    || e->line_offset % sizeof (float)
+	    || (e->line_offset + sizeof (struct nurbs_line)) % NUBL_ALIGN
+	    || e->line_offset > lib->size - line_size)
+		return -1;
+
+	const struct nurbs_line *line =
+		(const void *)(lib->map + e->line_offset);
+	if (line->points != e->points)
+		return -1;
+
+	const float *knots = nurbs_line_knots(line);
+	if (check_knots(knots, line->points) < 0)
+		return -1;
+
+	size_t span_size = (size_t)e->spans * sizeof (int32_t);
+	if (e->span_offset % sizeof (int32_t) || e->spans > points
+	    || span_size > lib->size
+	    || e->span_offset > lib->size - span_size)
+		return -1;
+
+	/* The span table must list exactly the nonzero spans */
+	const int32_t *spans = (const void *)(lib->map + e->span_offset);
+	uint32_t n = 0;
+	for (int k = 2; k < line->points; k++) {
+		if (knots[k] == knots[k + 1])
+			continue;
+		if (n == e->spans || spans[n] != k)
+			return -1;
+		n++;
+	}
+
+	return n == e->spans ? 0 : -1;
+}
+
+struct nurbs_library *nurbs_library_open(const char *filename) {
+	struct nurbs_library *lib = calloc(1, sizeof *lib);
+	if (!lib) {
+		printf("oom in nurbs_library_open\n");
+		return NULL;
+	}
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		goto bail;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof (struct nubl_header)) {
+		printf("not a nub library\n");
+		goto bail;
+	}
+
+	lib->size = st.st_size;
+	lib->map = mmap(NULL, lib->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (lib->map == MAP_FAILED) {
+		lib->map = NULL;
+		perror("mmap");
+		goto bail;
+	}
+
+	close(fd);
+	fd = -1;
+
+	const struct nubl_header *h = (const void *)lib->map;
+	if (memcmp(h->magic, "nubL", 4) || h->version != NUBL_VERSION
+	    || h->file_size != lib->size) {
+		printf("not a nub library\n");
+		goto bail;
+	}
+
+	if (h->index_offset % sizeof (uint32_t)
+	    || h->count > lib->size / sizeof (struct nubl_entry)
+	    || h->index_offset > lib->size
+	                         - h->count * sizeof (struct nubl_entry)) {
+		printf("invalid nub library index\n");
+		goto bail;
+	}
+
+	lib->count = h->count;
+	lib->index = (const void *)(lib->map + h->index_offset);
+
+	for (int i = 0; i < lib->count; i++) {
+		if (check_entry(lib, &lib->index[i]) < 0
+		    || (i && strcmp(lib->index[i - 1].name,
+		                    lib->index[i].name) >= 0)) {
+			printf("invalid nub library entry %d\n", i);
+			goto bail;
+		}
+	}
+
+	printf("library: %d shapes\n", lib->count);
+	return lib;
+
+bail:
+	if (fd >= 0)
+		close(fd);
+	nurbs_library_close(lib);
+	return NULL;
+}
+
+void nurbs_library_close(struct nurbs_library *lib) {
+	if (!lib)
+		return;
+	if (lib->map)
+		munmap((void *)lib->map, lib->size);
+	free(lib);
+}
+
+int nurbs_library_count(const struct nurbs_library *lib) {
+	return lib->count;
+}
+
+const char *nurbs_library_name(const struct nurbs_library *lib, int i) {
+	return lib->index[i].name;
+}
+
+const struct nurbs_line *nurbs_library_line(const struct nurbs_library *lib,
+                                            int i) {
+	return (const void *)(lib->map + lib->index[i].line_offset);
+}
+
+const int32_t *nurbs_library_spans(const struct nurbs_library *lib, int i,
+                                   int *count) {
+	*count = lib->index[i].spans;
+	return (const void *)(lib->map + lib->index[i].span_offset);
+}
+
+int nurbs_library_find(const struct nurbs_library *lib, const char *name) {
+	int low = 0, high = lib->count;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		int cmp = strncmp(name, lib->index[mid].name, NUBL_NAME_LEN);
+		if (!cmp)
+			return mid;
+		if (cmp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+
+	return -1;
+}
+
 static inline float nurbs_f(const float *knots, int i, int n, float u) {
 	return (u - knots[i]) / (knots[i + n] - knots[i]);
 }
@@ -101,7 +327,7 @@ static inline float nurbs_N2(const float *knots, int i, float u) {
 	return out;
 }
 
-struct xy nurbs_evaluate(const struct nurbs_patch *p, float u, float v) {
+struct xy nurbs_evaluate_ref(const struct nurbs_patch *p, float u, float v) {
 	struct xy out = { 0, 0 };
 	float div = 0;
 
@@ -128,3 +354,1207 @@ struct xy nurbs_evaluate(const struct nurbs_patch *p, float u, float v) {
 
 	return out;
 }
+
+/* nurbs_find_span(knots, points, u)
+ *
+ * Find the knot span k with knots[k] <= u < knots[k + 1] for a degree-2
+ * curve with the given number of control points. Only the basis functions
+ * N(k - 2) through N(k) are nonzero in that span. Parameters outside the
+ * domain are clamped to the first or last span, so u == 1 evaluates to the
+ * end of the curve rather than to nothing.
+ */
+static inline int nurbs_find_span(const float *knots, int points, float u) {
+	int low = 2, high = points;
+
+	if (u >= knots[high])
+		return points - 1;
+
+	while (high - low > 1) {
+		int mid = (low + high) / 2;
+		if (u < knots[mid])
+			high = mid;
+		else
+			low = mid;
+	}
+
+	return low;
+}
+
+/* nurbs_basis(knots, span, u, out)
+ *
+ * Compute the three nonzero degree-2 basis functions in the given span,
+ * using the triangular Cox-de Boor scheme. None of the denominators can
+ * be zero, since knots[span] < knots[span + 1].
+ */
+static inline void nurbs_basis(const float *knots, int span, float u,
+                               float out[3]) {
+	float left1 = u - knots[span], left2 = u - knots[span - 1];
+	float right1 = knots[span + 1] - u, right2 = knots[span + 2] - u;
+
+	/* Degree 1 */
+	float temp = 1 / (right1 + left1);
+	float n0 = right1 * temp, n1 = left1 * temp;
+
+	/* Degree 2 */
+	temp = n0 / (right1 + left2);
+	out[0] = right1 * temp;
+	float saved = left2 * temp;
+
+	temp = n1 / (right2 + left1);
+	out[1] = saved + right2 * temp;
+	out[2] = left1 * temp;
+}
+
+/* nurbs_basis_deriv(knots, span, u, out, d1, d2)
+ *
+ * Compute the three nonzero degree-2 basis functions in the given span,
+ * as nurbs_basis() does, along with their first and second derivatives.
+ * The second derivatives are constant within a span.
+ */
+static inline void nurbs_basis_deriv(const float *knots, int span, float u,
+                                     float out[3], float d1[3], float d2[3]) {
+	float left1 = u - knots[span], left2 = u - knots[span - 1];
+	float right1 = knots[span + 1] - u, right2 = knots[span + 2] - u;
+
+	/* Degree 1 */
+	float temp = 1 / (right1 + left1);
+	float n0 = right1 * temp, n1 = left1 * temp;
+
+	/* Degree 2 */
+	float w0 = 1 / (right1 + left2), w1 = 1 / (right2 + left1);
+	out[0] = right1 * n0 * w0;
+	out[1] = left2 * n0 * w0 + right2 * n1 * w1;
+	out[2] = left1 * n1 * w1;
+
+	d1[0] = -2 * n0 * w0;
+	d1[1] = 2 * (n0 * w0 - n1 * w1);
+	d1[2] = 2 * n1 * w1;
+
+	d2[0] = 2 * w0 * temp;
+	d2[1] = -2 * (w0 + w1) * temp;
+	d2[2] = 2 * w1 * temp;
+}
+
+struct xy nurbs_evaluate(const struct nurbs_patch *p, float u, float v) {
+	int su = nurbs_find_span(p->xy_knots, p->points, u);
+	int sv = nurbs_find_span(nurbs_t_knots, NURBS_T_POINTS, v);
+
+	float nu[3], nv[3];
+	nurbs_basis(p->xy_knots, su, u, nu);
+	nurbs_basis(nurbs_t_knots, sv, v, nv);
+
+	struct xy out = { 0, 0 };
+	float div = 0;
+
+	for (int i = 0; i < 3; i++) {
+		const struct nurbs_point *row = p->t[su - 2 + i] + (sv - 2);
+
+		for (int j = 0; j < 3; j++) {
+			float r = nu[i] * nv[j] * row[j].weight;
+
+			div += r;
+			out.x += r * row[j].x;
+			out.y += r * row[j].y;
+		}
+	}
+
+	out.x /= div;
+	out.y /= div;
+
+	return out;
+}
+
+void nurbs_evaluate_deriv(const struct nurbs_patch *p, float u, float v,
+                          struct nurbs_deriv *out) {
+	int su = nurbs_find_span(p->xy_knots, p->points, u);
+	int sv = nurbs_find_span(nurbs_t_knots, NURBS_T_POINTS, v);
+
+	float nu[3], nv[3], du[3], dv[3], duu[3], dvv[3];
+	nurbs_basis_deriv(p->xy_knots, su, u, nu, du, duu);
+	nurbs_basis_deriv(nurbs_t_knots, sv, v, nv, dv, dvv);
+
+	/* Homogeneous sums (w*x, w*y, w) and their derivatives: a, a_u,
+	 * a_v, a_uu, a_uv, a_vv. Each row is blended along v first, then
+	 * the rows along u. */
+	float a[6][3] = { { 0 } };
+
+	for (int i = 0; i < 3; i++) {
+		const struct nurbs_point *row = p->t[su - 2 + i] + (sv - 2);
+		float r[3][3] = { { 0 } };
+
+		for (int j = 0; j < 3; j++) {
+			float w = row[j].weight;
+			float h[3] = { w * row[j].x, w * row[j].y, w };
+
+			for (int c = 0; c < 3; c++) {
+				r[0][c] += nv[j] * h[c];
+				r[1][c] += dv[j] * h[c];
+				r[2][c] += dvv[j] * h[c];
+			}
+		}
+
+		for (int c = 0; c < 3; c++) {
+			a[0][c] += nu[i] * r[0][c];
+			a[1][c] += du[i] * r[0][c];
+			a[2][c] += nu[i] * r[1][c];
+			a[3][c] += duu[i] * r[0][c];
+			a[4][c] += du[i] * r[1][c];
+			a[5][c] += nu[i] * r[2][c];
+		}
+	}
+
+	/* Quotient rule, for S = A / W: S_u = (A_u - S W_u) / W, and so on */
+	float rw = 1 / a[0][2];
+	float w_u = a[1][2], w_v = a[2][2];
+	float w_uu = a[3][2], w_uv = a[4][2], w_vv = a[5][2];
+	float s[2], s_u[2], s_v[2];
+
+	for (int c = 0; c < 2; c++) {
+		s[c] = a[0][c] * rw;
+		s_u[c] = (a[1][c] - s[c] * w_u) * rw;
+		s_v[c] = (a[2][c] - s[c] * w_v) * rw;
+	}
+
+	float s_uu[2], s_uv[2], s_vv[2];
+	for (int c = 0; c < 2; c++) {
+		s_uu[c] = (a[3][c] - 2 * s_u[c] * w_u - s[c] * w_uu) * rw;
+		s_uv[c] = (a[4][c] - s_u[c] * w_v - s_v[c] * w_u
+		           - s[c] * w_uv) * rw;
+		s_vv[c] = (a[5][c] - 2 * s_v[c] * w_v - s[c] * w_vv) * rw;
+	}
+
+	out->p = (struct xy){ s[0], s[1] };
+	out->du = (struct xy){ s_u[0], s_u[1] };
+	out->dv = (struct xy){ s_v[0], s_v[1] };
+	out->duu = (struct xy){ s_uu[0], s_uu[1] };
+	out->duv = (struct xy){ s_uv[0], s_uv[1] };
+	out->dvv = (struct xy){ s_vv[0], s_vv[1] };
+}
+
+struct xy nurbs_line_evaluate(const struct nurbs_line *line, float u) {
+	const float *knots = nurbs_line_knots(line);
+	int su = nurbs_find_span(knots, line->points, u);
+
+	float nu[3];
+	nurbs_basis(knots, su, u, nu);
+
+	struct xy out = { 0, 0 };
+	float div = 0;
+
+	for (int i = 0; i < 3; i++) {
+		const struct nurbs_point *pt = &line->t[su - 2 + i];
+		float r = nu[i] * pt->weight;
+
+		div += r;
+		out.x += r * pt->x;
+		out.y += r * pt->y;
+	}
+
+	out.x /= div;
+	out.y /= div;
+
+	return out;
+}
+
+struct xy nurbs_sweep_evaluate(const struct nurbs_sweep *s, float u, float v) {
+	struct xy c = nurbs_line_evaluate(s->line, u);
+
+	int sv = nurbs_find_span(nurbs_t_knots, NURBS_T_POINTS, v);
+	float nv[3];
+	nurbs_basis(nurbs_t_knots, sv, v, nv);
+
+	/* Blend the path transforms at v */
+	struct nurbs_affine m = { 0, 0, 0, 0, 0, 0 };
+	for (int j = 0; j < 3; j++) {
+		const struct nurbs_affine *t = &s->path[sv - 2 + j];
+		m.xx += nv[j] * t->xx;
+		m.xy += nv[j] * t->xy;
+		m.yx += nv[j] * t->yx;
+		m.yy += nv[j] * t->yy;
+		m.dx += nv[j] * t->dx;
+		m.dy += nv[j] * t->dy;
+	}
+
+	struct xy out = {
+		m.xx * c.x + m.xy * c.y + m.dx,
+		m.yx * c.x + m.yy * c.y + m.dy,
+	};
+	return out;
+}
+
+struct nurbs_patch *nurbs_sweep_patch(const struct nurbs_sweep *s) {
+	const struct nurbs_line *line = s->line;
+
+	struct nurbs_patch *out = malloc(sizeof *out
+	                                 + sizeof (struct nurbs_point)
+	                                   * line->points * NURBS_T_POINTS);
+	if (!out) {
+		printf("oom in nurbs_sweep_patch\n");
+		return NULL;
+	}
+
+	out->points = line->points;
+	out->xy_knots = nurbs_line_knots(line);
+
+	for (int i = 0; i < line->points; i++) {
+		float x = line->t[i].x, y = line->t[i].y;
+
+		for (int j = 0; j < NURBS_T_POINTS; j++) {
+			const struct nurbs_affine *t = &s->path[j];
+			out->t[i][j].x = t->xx * x + t->xy * y + t->dx;
+			out->t[i][j].y = t->yx * x + t->yy * y + t->dy;
+			out->t[i][j].weight = line->t[i].weight;
+		}
+	}
+
+	return out;
+}
+
+/* Batch evaluation
+ *
+ * nurbs_evaluate_batch() runs the same span search and basis computation
+ * as nurbs_evaluate(), but with one point per SIMD lane. The span search
+ * and control point fetches are done per lane into a block of
+ * structure-of-arrays scratch; the arithmetic is then done a whole block
+ * at a time, in exactly the same order as the scalar path.
+ */
+
+#define BATCH_MAX_WIDTH 8
+
+struct batch_lanes {
+	float u[BATCH_MAX_WIDTH], v[BATCH_MAX_WIDTH];
+	float ku[4][BATCH_MAX_WIDTH], kv[4][BATCH_MAX_WIDTH];
+	float px[9][BATCH_MAX_WIDTH], py[9][BATCH_MAX_WIDTH],
+	      pw[9][BATCH_MAX_WIDTH];
+} __attribute__((aligned(32)));
+
+static inline __attribute__((always_inline))
+int batch_in_span(const float *knots, int span, float u) {
+	return knots[span] <= u && u < knots[span + 1];
+}
+
+/* batch_gather(p, u, v, width, l)
+ *
+ * Find the spans for each lane and fetch the knots around them. Control
+ * points are only gathered per lane if the lanes don't all share one span
+ * pair; returns the shared row of control points if they do, or NULL.
+ */
+/* Always inlined, so that the kernels never call out to non-VEX code with
+ * the upper halves of the AVX registers dirty. */
+static inline __attribute__((always_inline))
+const struct nurbs_point *batch_gather(
+		const struct nurbs_patch *p, const float *u, const float *v,
+		int width, struct batch_lanes *l) {
+	int su[BATCH_MAX_WIDTH], sv[BATCH_MAX_WIDTH];
+	int uniform = 1;
+
+	for (int lane = 0; lane < width; lane++) {
+		/* Neighbouring lanes usually share a span, so try the
+		 * previous lane's before searching. */
+		int a = lane ? su[lane - 1] : 2, b = lane ? sv[lane - 1] : 2;
+
+		if (!lane || !batch_in_span(p->xy_knots, a, u[lane]))
+			a = nurbs_find_span(p->xy_knots, p->points, u[lane]);
+		if (!lane || !batch_in_span(nurbs_t_knots, b, v[lane]))
+			b = nurbs_find_span(nurbs_t_knots, NURBS_T_POINTS,
+			                    v[lane]);
+
+		su[lane] = a;
+		sv[lane] = b;
+		uniform &= a == su[0] && b == sv[0];
+
+		l->u[lane] = u[lane];
+		l->v[lane] = v[lane];
+
+		for (int k = 0; k < 4; k++) {
+			l->ku[k][lane] = p->xy_knots[su[lane] - 1 + k];
+			l->kv[k][lane] = nurbs_t_knots[sv[lane] - 1 + k];
+		}
+	}
+
+	if (uniform)
+		return p->t[su[0] - 2] + (sv[0] - 2);
+
+	for (int lane = 0; lane < width; lane++) {
+		for (int i = 0; i < 3; i++) {
+			const struct nurbs_point *row = p->t[su[lane] - 2 + i]
+			                              + (sv[lane] - 2);
+			for (int j = 0; j < 3; j++) {
+				l->px[i * 3 + j][lane] = row[j].x;
+				l->py[i * 3 + j][lane] = row[j].y;
+				l->pw[i * 3 + j][lane] = row[j].weight;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Same steps as nurbs_basis(), with k[0..3] holding knots[span - 1]
+ * through knots[span + 2] for each lane. */
+#define BATCH_BASIS(vec, k, t, out) do { \
+	vec left1 = (t) - *(vec *)(k)[1], left2 = (t) - *(vec *)(k)[0]; \
+	vec right1 = *(vec *)(k)[2] - (t), right2 = *(vec *)(k)[3] - (t); \
+	vec temp = 1 / (right1 + left1); \
+	vec n0 = right1 * temp, n1 = left1 * temp; \
+	temp = n0 / (right1 + left2); \
+	(out)[0] = right1 * temp; \
+	vec saved = left2 * temp; \
+	temp = n1 / (right2 + left1); \
+	(out)[1] = saved + right2 * temp; \
+	(out)[2] = left1 * temp; \
+} while (0)
+
+#define BATCH_KERNEL(name, vec, width, attr) \
+static attr void name(const struct nurbs_patch *p, const float *u, \
+                      const float *v, struct xy *out, int n) { \
+	int i; \
+	for (i = 0; i + width <= n; i += width) { \
+		struct batch_lanes l; \
+		const struct nurbs_point *shared = \
+			batch_gather(p, u + i, v + i, width, &l); \
+\
+		vec px[9], py[9], pw[9]; \
+		for (int k = 0; k < 9; k++) { \
+			if (shared) { \
+				int at = k / 3 * NURBS_T_POINTS + k % 3; \
+				px[k] = (vec){ 0 } + shared[at].x; \
+				py[k] = (vec){ 0 } + shared[at].y; \
+				pw[k] = (vec){ 0 } + shared[at].weight; \
+			} else { \
+				px[k] = *(vec *)l.px[k]; \
+				py[k] = *(vec *)l.py[k]; \
+				pw[k] = *(vec *)l.pw[k]; \
+			} \
+		} \
+\
+		vec uu = *(vec *)l.u, vv = *(vec *)l.v; \
+		vec nu[3], nv[3]; \
+		BATCH_BASIS(vec, l.ku, uu, nu); \
+		BATCH_BASIS(vec, l.kv, vv, nv); \
+\
+		vec x = { 0 }, y = { 0 }, div = { 0 }; \
+		for (int a = 0; a < 3; a++) { \
+			for (int b = 0; b < 3; b++) { \
+				vec r = nu[a] * nv[b] * pw[a * 3 + b]; \
+				div += r; \
+				x += r * px[a * 3 + b]; \
+				y += r * py[a * 3 + b]; \
+			} \
+		} \
+\
+		x /= div; \
+		y /= div; \
+\
+		for (int lane = 0; lane < width; lane++) { \
+			out[i + lane].x = x[lane]; \
+			out[i + lane].y = y[lane]; \
+		} \
+	} \
+\
+	for (; i < n; i++) \
+		out[i] = nurbs_evaluate(p, u[i], v[i]); \
+}
+
+/* Sweeps are batched the same way. Each lane gathers the three live points
+ * of the line and the three live transforms of the path, unless the lanes
+ * all share both spans, and the kernel follows nurbs_line_evaluate() and
+ * then nurbs_sweep_evaluate(). */
+struct sweep_lanes {
+	float u[BATCH_MAX_WIDTH], v[BATCH_MAX_WIDTH];
+	float ku[4][BATCH_MAX_WIDTH], kv[4][BATCH_MAX_WIDTH];
+	float px[3][BATCH_MAX_WIDTH], py[3][BATCH_MAX_WIDTH],
+	      pw[3][BATCH_MAX_WIDTH];
+	float m[6][3][BATCH_MAX_WIDTH];	/* xx, xy, yx, yy, dx, dy */
+} __attribute__((aligned(32)));
+
+/* sweep_gather(s, u, v, width, l, su, sv)
+ *
+ * As batch_gather(), for a sweep. Returns whether the lanes share one span
+ * pair, which is then left in *su and *sv, and the points and transforms
+ * not gathered.
+ */
+static inline __attribute__((always_inline))
+int sweep_gather(const struct nurbs_sweep *s, const float *u, const float *v,
+                 int width, struct sweep_lanes *l, int *su, int *sv) {
+	const struct nurbs_line *line = s->line;
+	const float *knots = nurbs_line_knots(line);
+	int a[BATCH_MAX_WIDTH], b[BATCH_MAX_WIDTH];
+	int uniform = 1;
+
+	for (int lane = 0; lane < width; lane++) {
+		a[lane] = lane ? a[lane - 1] : 2;
+		b[lane] = lane ? b[lane - 1] : 2;
+
+		if (!lane || !batch_in_span(knots, a[lane], u[lane]))
+			a[lane] = nurbs_find_span(knots, line->points, u[lane]);
+		if (!lane || !batch_in_span(nurbs_t_knots, b[lane], v[lane]))
+			b[lane] = nurbs_find_span(nurbs_t_knots, NURBS_T_POINTS,
+			                          v[lane]);
+		uniform &= a[lane] == a[0] && b[lane] == b[0];
+
+		l->u[lane] = u[lane];
+		l->v[lane] = v[lane];
+
+		for (int k = 0; k < 4; k++) {
+			l->ku[k][lane] = knots[a[lane] - 1 + k];
+			l->kv[k][lane] = nurbs_t_knots[b[lane] - 1 + k];
+		}
+	}
+
+	*su = a[0];
+	*sv = b[0];
+	if (uniform)
+		return 1;
+
+	for (int lane = 0; lane < width; lane++) {
+		const struct nurbs_point *row = line->t + a[lane] - 2;
+		const struct nurbs_affine *path = s->path + b[lane] - 2;
+		for (int i = 0; i < 3; i++) {
+			const struct nurbs_point *pt = &row[i];
+			const struct nurbs_affine *t = &path[i];
+			l->px[i][lane] = pt->x;
+			l->py[i][lane] = pt->y;
+			l->pw[i][lane] = pt->weight;
+			l->m[0][i][lane] = t->xx;
+			l->m[1][i][lane] = t->xy;
+			l->m[2][i][lane] = t->yx;
+			l->m[3][i][lane] = t->yy;
+			l->m[4][i][lane] = t->dx;
+			l->m[5][i][lane] = t->dy;
+		}
+	}
+
+	return 0;
+}
+
+#define SWEEP_KERNEL(name, vec, width, attr) \
+static attr void name(const struct nurbs_sweep *s, const float *u, \
+                      const float *v, struct xy *out, int n) { \
+	int i; \
+	for (i = 0; i + width <= n; i += width) { \
+		struct sweep_lanes l; \
+		int su, sv; \
+		int shared = sweep_gather(s, u + i, v + i, width, &l, \
+		                          &su, &sv); \
+\
+		vec px[3], py[3], pw[3], m[6][3]; \
+		for (int k = 0; k < 3; k++) { \
+			if (shared) { \
+				const struct nurbs_point *cp = \
+					&s->line->t[su - 2 + k]; \
+				const struct nurbs_affine *t = \
+					&s->path[sv - 2 + k]; \
+				px[k] = (vec){ 0 } + cp->x; \
+				py[k] = (vec){ 0 } + cp->y; \
+				pw[k] = (vec){ 0 } + cp->weight; \
+				m[0][k] = (vec){ 0 } + t->xx; \
+				m[1][k] = (vec){ 0 } + t->xy; \
+				m[2][k] = (vec){ 0 } + t->yx; \
+				m[3][k] = (vec){ 0 } + t->yy; \
+				m[4][k] = (vec){ 0 } + t->dx; \
+				m[5][k] = (vec){ 0 } + t->dy; \
+			} else { \
+				px[k] = *(vec *)l.px[k]; \
+				py[k] = *(vec *)l.py[k]; \
+				pw[k] = *(vec *)l.pw[k]; \
+				for (int f = 0; f < 6; f++) \
+					m[f][k] = *(vec *)l.m[f][k]; \
+			} \
+		} \
+\
+		vec uu = *(vec *)l.u, vv = *(vec *)l.v; \
+		vec nu[3], nv[3]; \
+		BATCH_BASIS(vec, l.ku, uu, nu); \
+		BATCH_BASIS(vec, l.kv, vv, nv); \
+\
+		/* The line at u */ \
+		vec cx = { 0 }, cy = { 0 }, div = { 0 }; \
+		for (int a = 0; a < 3; a++) { \
+			vec r = nu[a] * pw[a]; \
+			div += r; \
+			cx += r * px[a]; \
+			cy += r * py[a]; \
+		} \
+\
+		cx /= div; \
+		cy /= div; \
+\
+		/* The path transforms blended at v, and applied */ \
+		vec t[6]; \
+		for (int f = 0; f < 6; f++) { \
+			t[f] = (vec){ 0 }; \
+			for (int b = 0; b < 3; b++) \
+				t[f] += nv[b] * m[f][b]; \
+		} \
+\
+		vec x = t[0] * cx + t[1] * cy + t[4]; \
+		vec y = t[2] * cx + t[3] * cy + t[5]; \
+\
+		for (int lane = 0; lane < width; lane++) { \
+			out[i + lane].x = x[lane]; \
+			out[i + lane].y = y[lane]; \
+		} \
+	} \
+\
+	for (; i < n; i++) \
+		out[i] = nurbs_sweep_evaluate(s, u[i], v[i]); \
+}
+
+static void batch_scalar(const struct nurbs_patch *p, const float *u,
+                         const float *v, struct xy *out, int n) {
+	for (int i = 0; i < n; i++)
+		out[i] = nurbs_evaluate(p, u[i], v[i]);
+}
+
+typedef void batch_fn(const struct nurbs_patch *p, const float *u,
+                      const float *v, struct xy *out, int n);
+
+static void sweep_scalar(const struct nurbs_sweep *s, const float *u,
+                         const float *v, struct xy *out, int n) {
+	for (int i = 0; i < n; i++)
+		out[i] = nurbs_sweep_evaluate(s, u[i], v[i]);
+}
+
+typedef void sweep_fn(const struct nurbs_sweep *s, const float *u,
+                      const float *v, struct xy *out, int n);
+
+static batch_fn *batch_impl = batch_scalar;
+static sweep_fn *sweep_impl = sweep_scalar;
+static const char *batch_isa = "scalar";
+
+#if defined(__x86_64__) || defined(__i386__)
+
+typedef float batch_v4 __attribute__((vector_size(16)));
+typedef float batch_v8 __attribute__((vector_size(32)));
+
+BATCH_KERNEL(batch_sse2, batch_v4, 4, __attribute__((target("sse2"))))
+BATCH_KERNEL(batch_avx2, batch_v8, 8, __attribute__((target("avx2"))))
+SWEEP_KERNEL(sweep_sse2, batch_v4, 4, __attribute__((target("sse2"))))
+SWEEP_KERNEL(sweep_avx2, batch_v8, 8, __attribute__((target("avx2"))))
+
+__attribute__((constructor))
+static void batch_init(void) {
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		batch_impl = batch_avx2;
+		sweep_impl = sweep_avx2;
+		batch_isa = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		batch_impl = batch_sse2;
+		sweep_impl = sweep_sse2;
+		batch_isa = "sse2";
+	}
+}
+
+#endif
+
+void nurbs_evaluate_batch(const struct nurbs_patch *p, const float *u,
+                          const float *v, struct xy *out, int n) {
+	batch_impl(p, u, v, out, n);
+}
+
+void nurbs_sweep_evaluate_batch(const struct nurbs_sweep *s, const float *u,
+                                const float *v, struct xy *out, int n) {
+	sweep_impl(s, u, v, out, n);
+}
+
+const char *nurbs_batch_isa(void) {
+	return batch_isa;
+}
+
+/* Rational Bézier form
+ *
+ * A quadratic B-spline restricted to one nonzero span [k0, k1) is a
+ * quadratic Bézier curve. Inserting k0 and k1 until each has multiplicity
+ * two gives its control points directly: the middle one is unchanged, and
+ * the ends are the curve's values at the span boundaries. Doing this in
+ * homogeneous coordinates, first along u and then along v, splits a patch
+ * into rational Bézier pieces.
+ */
+
+static struct nurbs_hpoint hpoint_lerp(struct nurbs_hpoint a,
+                                       struct nurbs_hpoint b, float t) {
+	struct nurbs_hpoint out = {
+		a.x + (b.x - a.x) * t,
+		a.y + (b.y - a.y) * t,
+		a.w + (b.w - a.w) * t,
+	};
+	return out;
+}
+
+/* bezier_extract(knots, span, p, stride, out)
+ *
+ * Insert knots[span] and knots[span + 1] to full multiplicity, producing
+ * the three Bézier control points for that span from the homogeneous
+ * control points p[0], p[stride], p[2 * stride] (those numbered span - 2
+ * through span).
+ */
+static void bezier_extract(const float *knots, int span,
+                           const struct nurbs_hpoint *p, int stride,
+                           struct nurbs_hpoint out[3]) {
+	float k0 = knots[span], k1 = knots[span + 1];
+
+	out[0] = hpoint_lerp(p[0], p[stride],
+	                     (k0 - knots[span - 1]) / (k1 - knots[span - 1]));
+	out[1] = p[stride];
+	out[2] = hpoint_lerp(p[stride], p[2 * stride],
+	                     (k1 - k0) / (knots[span + 2] - k0));
+}
+
+static int count_spans(const float *knots, int points) {
+	int spans = 0;
+	for (int k = 2; k < points; k++)
+		spans += knots[k] < knots[k + 1];
+	return spans;
+}
+
+size_t nurbs_bezier_size(const struct nurbs_patch *p) {
+	return sizeof (struct nurbs_bezier_patch)
+	     + count_spans(p->xy_knots, p->points)
+	       * count_spans(nurbs_t_knots, NURBS_T_POINTS)
+	       * sizeof (struct nurbs_bezier_piece);
+}
+
+int nurbs_bezier_compile_to(const struct nurbs_patch *p,
+                            struct nurbs_bezier_patch *out) {
+	struct nurbs_hpoint *h = malloc(p->points * NURBS_T_POINTS
+	                                * sizeof *h);
+	if (!h) {
+		printf("oom in nurbs_bezier_compile\n");
+		return -1;
+	}
+
+	out->u_pieces = count_spans(p->xy_knots, p->points);
+	out->v_pieces = count_spans(nurbs_t_knots, NURBS_T_POINTS);
+
+	/* Homogeneous control points, in the same [i][j] order as p->t */
+	for (int i = 0; i < p->points; i++) {
+		for (int j = 0; j < NURBS_T_POINTS; j++) {
+			const struct nurbs_point *pt = &p->t[i][j];
+			h[i * NURBS_T_POINTS + j] = (struct nurbs_hpoint){
+				pt->x * pt->weight, pt->y * pt->weight,
+				pt->weight
+			};
+		}
+	}
+
+	struct nurbs_bezier_piece *piece = out->piece;
+
+	for (int su = 2; su < p->points; su++) {
+		if (p->xy_knots[su] == p->xy_knots[su + 1])
+			continue;
+
+		for (int sv = 2; sv < NURBS_T_POINTS; sv++) {
+			if (nurbs_t_knots[sv] == nurbs_t_knots[sv + 1])
+				continue;
+
+			/* Split along u for each of the three columns that
+			 * are live in this v span, then along v. */
+			struct nurbs_hpoint col[3][3];
+			const struct nurbs_hpoint *base =
+				h + (su - 2) * NURBS_T_POINTS + (sv - 2);
+			for (int j = 0; j < 3; j++)
+				bezier_extract(p->xy_knots, su, base + j,
+				               NURBS_T_POINTS, col[j]);
+
+			for (int i = 0; i < 3; i++) {
+				struct nurbs_hpoint row[3] = {
+					col[0][i], col[1][i], col[2][i]
+				};
+				bezier_extract(nurbs_t_knots, sv, row, 1,
+				               piece->c[i]);
+			}
+
+			piece->u0 = p->xy_knots[su];
+			piece->u1 = p->xy_knots[su + 1];
+			piece->v0 = nurbs_t_knots[sv];
+			piece->v1 = nurbs_t_knots[sv + 1];
+			piece++;
+		}
+	}
+
+	free(h);
+	return 0;
+}
+
+struct nurbs_bezier_patch *nurbs_bezier_compile(const struct nurbs_patch *p) {
+	struct nurbs_bezier_patch *out = malloc(nurbs_bezier_size(p));
+	if (!out) {
+		printf("oom in nurbs_bezier_compile\n");
+		return NULL;
+	}
+
+	if (nurbs_bezier_compile_to(p, out) < 0) {
+		free(out);
+		return NULL;
+	}
+
+	return out;
+}
+
+/* bezier_find_piece(b, u, v)
+ *
+ * Find the piece containing (u, v), clamping to the edge pieces outside
+ * the domain in the same way as nurbs_find_span().
+ */
+static const struct nurbs_bezier_piece *bezier_find_piece(
+		const struct nurbs_bezier_patch *b, float u, float v) {
+	int low = 0, high = b->u_pieces;
+	while (high - low > 1) {
+		int mid = (low + high) / 2;
+		if (u < b->piece[mid * b->v_pieces].u0)
+			high = mid;
+		else
+			low = mid;
+	}
+
+	const struct nurbs_bezier_piece *row = b->piece + low * b->v_pieces;
+	int j = 0;
+	while (j < b->v_pieces - 1 && v >= row[j + 1].v0)
+		j++;
+
+	return row + j;
+}
+
+struct xy nurbs_bezier_evaluate(const struct nurbs_bezier_patch *b,
+                                float u, float v) {
+	const struct nurbs_bezier_piece *pc = bezier_find_piece(b, u, v);
+	float s = (u - pc->u0) / (pc->u1 - pc->u0);
+	float t = (v - pc->v0) / (pc->v1 - pc->v0);
+
+	float bu[3] = { (1 - s) * (1 - s), 2 * s * (1 - s), s * s };
+	float bv[3] = { (1 - t) * (1 - t), 2 * t * (1 - t), t * t };
+
+	float x = 0, y = 0, w = 0;
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			float r = bu[i] * bv[j];
+			x += r * pc->c[i][j].x;
+			y += r * pc->c[i][j].y;
+			w += r * pc->c[i][j].w;
+		}
+	}
+
+	struct xy out = { x / w, y / w };
+	return out;
+}
+
+/* Forward differencing
+ *
+ * Along a line (u0 + k du, v0 + k dv) through one piece, each homogeneous
+ * coordinate is a product of two quadratics in k, i.e. a quartic. Its
+ * forward difference table is built from the power-basis coefficients
+ * (rather than from sampled values, which would lose most of the
+ * precision to cancellation), and each step is then four adds per
+ * coordinate plus the divide by w.
+ */
+
+/* Coefficients in k of the quadratic Bernstein polynomials at s0 + a k */
+static void bernstein_poly(double s0, double a, double out[3][3]) {
+	double q0 = 1 - s0;
+
+	out[0][0] = q0 * q0;
+	out[0][1] = -2 * q0 * a;
+	out[0][2] = a * a;
+
+	out[1][0] = 2 * s0 * q0;
+	out[1][1] = 2 * a * (q0 - s0);
+	out[1][2] = -2 * a * a;
+
+	out[2][0] = s0 * s0;
+	out[2][1] = 2 * s0 * a;
+	out[2][2] = a * a;
+}
+
+/* Steps from x until x + k dx leaves [x0, x1); x1 == INFINITY if the
+ * piece extends past the end of the domain. */
+static int steps_until(double x, double dx, double x1) {
+	if (dx <= 0 || x1 == INFINITY)
+		return NURBS_STEPPER_RESTART;
+
+	double steps = ceil((x1 - x) / dx);
+	if (steps < 1)
+		return 1;
+	if (steps > NURBS_STEPPER_RESTART)
+		return NURBS_STEPPER_RESTART;
+	return steps;
+}
+
+static void stepper_setup(struct nurbs_stepper *s) {
+	const struct nurbs_bezier_patch *b = s->patch;
+	double u = s->u0 + s->k * s->du, v = s->v0 + s->k * s->dv;
+	const struct nurbs_bezier_piece *pc = bezier_find_piece(b, u, v);
+
+	double uw = pc->u1 - pc->u0, vw = pc->v1 - pc->v0;
+	double bu[3][3], bv[3][3];
+	bernstein_poly((u - pc->u0) / uw, s->du / uw, bu);
+	bernstein_poly((v - pc->v0) / vw, s->dv / vw, bv);
+
+	/* Pieces on the far edges extend outward, like the span search */
+	int last_u = pc - b->piece >= (b->u_pieces - 1) * b->v_pieces;
+	int last_v = (pc - b->piece) % b->v_pieces == b->v_pieces - 1;
+	int left = steps_until(u, s->du, last_u ? INFINITY : pc->u1);
+	int left_v = steps_until(v, s->dv, last_v ? INFINITY : pc->v1);
+	s->left = left < left_v ? left : left_v;
+
+	for (int ch = 0; ch < 3; ch++) {
+		double c[5] = { 0, 0, 0, 0, 0 };
+
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < 3; j++) {
+				const struct nurbs_hpoint *h = &pc->c[i][j];
+				double val = ch == 0 ? h->x
+				           : ch == 1 ? h->y : h->w;
+
+				for (int m = 0; m < 3; m++)
+					for (int n = 0; n < 3; n++)
+						c[m + n] += bu[i][m] * bv[j][n]
+						          * val;
+			}
+		}
+
+		double *d = s->d[ch];
+		d[0] = c[0];
+		d[1] = c[1] + c[2] + c[3] + c[4];
+		d[2] = 2 * c[2] + 6 * c[3] + 14 * c[4];
+		d[3] = 6 * c[3] + 36 * c[4];
+		d[4] = 24 * c[4];
+	}
+}
+
+void nurbs_stepper_start(struct nurbs_stepper *s,
+                         const struct nurbs_bezier_patch *b,
+                         float u, float v, float du, float dv) {
+	s->patch = b;
+	s->u0 = u;
+	s->v0 = v;
+	s->du = du;
+	s->dv = dv;
+	s->k = 0;
+	s->left = 0;
+}
+
+struct xy nurbs_stepper_next(struct nurbs_stepper *s) {
+	if (!s->left)
+		stepper_setup(s);
+
+	double (*d)[5] = s->d;
+	double rw = 1 / d[2][0];
+	struct xy out = { d[0][0] * rw, d[1][0] * rw };
+
+	for (int ch = 0; ch < 3; ch++) {
+		d[ch][0] += d[ch][1];
+		d[ch][1] += d[ch][2];
+		d[ch][2] += d[ch][3];
+		d[ch][3] += d[ch][4];
+	}
+
+	s->k++;
+	s->left--;
+	return out;
+}
+
+/* Fixed point
+ *
+ * Parameters are Q24: 1 << 24 is 1.0. Each piece's homogeneous control
+ * points are divided by the piece's largest weight, so weights are Q24
+ * in (0, 1], and the coordinates are stored in 1/256 DAC units. The
+ * quadratic Bernstein basis is computed in Q24 from the local parameter,
+ * which is found by multiplying by a precomputed reciprocal of the piece
+ * width. Every product fits in 64 bits, and the only divide is the final
+ * one by the weight.
+ */
+
+#define FIXED_COORD_BITS	8
+#define FIXED_COORD_MAX		(1 << 30)
+
+static uint32_t to_q24(float x) {
+	return lrint(x * (double)NURBS_FIXED_ONE);
+}
+
+struct nurbs_fixed_patch *nurbs_fixed_compile(
+		const struct nurbs_bezier_patch *b, float scale) {
+	int pieces = b->u_pieces * b->v_pieces;
+	struct nurbs_fixed_patch *out = malloc(sizeof *out
+		+ pieces * sizeof (struct nurbs_fixed_piece));
+	if (!out) {
+		printf("oom in nurbs_fixed_compile\n");
+		return NULL;
+	}
+
+	out->u_pieces = b->u_pieces;
+	out->v_pieces = b->v_pieces;
+
+	for (int k = 0; k < pieces; k++) {
+		const struct nurbs_bezier_piece *pc = &b->piece[k];
+		struct nurbs_fixed_piece *f = &out->piece[k];
+
+		f->u0 = to_q24(pc->u0);
+		f->v0 = to_q24(pc->v0);
+		if (to_q24(pc->u1) <= f->u0 || to_q24(pc->v1) <= f->v0) {
+			printf("knot span too narrow for "
+			       "nurbs_fixed_compile\n");
+			free(out);
+			return NULL;
+		}
+
+		f->u_scale = (1ULL << 48) / (to_q24(pc->u1) - f->u0);
+		f->v_scale = (1ULL << 48) / (to_q24(pc->v1) - f->v0);
+
+		float wmax = 0;
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++)
+				if (pc->c[i][j].w > wmax)
+					wmax = pc->c[i][j].w;
+
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < 3; j++) {
+				const struct nurbs_hpoint *h = &pc->c[i][j];
+				double x = (double)h->x / wmax * scale
+				         * (1 << FIXED_COORD_BITS);
+				double y = (double)h->y / wmax * scale
+				         * (1 << FIXED_COORD_BITS);
+				if (fabs(x) >= FIXED_COORD_MAX
+				    || fabs(y) >= FIXED_COORD_MAX
+				    || to_q24(h->w / wmax) == 0) {
+					printf("patch out of range in "
+					       "nurbs_fixed_compile\n");
+					free(out);
+					return NULL;
+				}
+
+				f->c[i][j][0] = lrint(x);
+				f->c[i][j][1] = lrint(y);
+				f->c[i][j][2] = to_q24(h->w / wmax);
+			}
+		}
+	}
+
+	return out;
+}
+
+static inline void fixed_bernstein(uint64_t s, uint64_t out[3]) {
+	uint64_t q = NURBS_FIXED_ONE - s, half = NURBS_FIXED_ONE / 2;
+	out[0] = (q * q + half) >> 24;
+	out[1] = (2 * s * q + half) >> 24;
+	out[2] = (s * s + half) >> 24;
+}
+
+static inline int16_t fixed_clamp(int64_t v) {
+	return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+/* fixed_blend(f, u, v, sum)
+ *
+ * The homogeneous point at (u, v): sum[0] and sum[1] are the coordinates
+ * times the weight, sum[2] the weight, as nurbs_fixed_evaluate() divides
+ * them.
+ */
+static void fixed_blend(const struct nurbs_fixed_patch *f, uint32_t u,
+                        uint32_t v, int64_t sum[3]) {
+	int low = 0, high = f->u_pieces;
+	while (high - low > 1) {
+		int mid = (low + high) / 2;
+		if (u < f->piece[mid * f->v_pieces].u0)
+			high = mid;
+		else
+			low = mid;
+	}
+
+	const struct nurbs_fixed_piece *pc = f->piece + low * f->v_pieces;
+	for (int j = 1; j < f->v_pieces && v >= pc[1].v0; j++)
+		pc++;
+
+	/* Parameters outside the domain are clamped to it */
+	uint64_t s = u > pc->u0 ? ((u - pc->u0) * pc->u_scale) >> 24 : 0;
+	uint64_t t = v > pc->v0 ? ((v - pc->v0) * pc->v_scale) >> 24 : 0;
+	if (s > NURBS_FIXED_ONE)
+		s = NURBS_FIXED_ONE;
+	if (t > NURBS_FIXED_ONE)
+		t = NURBS_FIXED_ONE;
+
+	uint64_t bu[3], bv[3];
+	fixed_bernstein(s, bu);
+	fixed_bernstein(t, bv);
+
+	/* Blend each row along v, then the rows along u */
+	sum[0] = sum[1] = sum[2] = 0;
+	for (int i = 0; i < 3; i++) {
+		int64_t row[3] = { 0, 0, 0 };
+		for (int j = 0; j < 3; j++)
+			for (int c = 0; c < 3; c++)
+				row[c] += (int64_t)bv[j] * pc->c[i][j][c];
+
+		for (int c = 0; c < 3; c++)
+			sum[c] += (int64_t)bu[i] * (row[c] >> 24);
+	}
+}
+
+void nurbs_fixed_evaluate(const struct nurbs_fixed_patch *f, uint32_t u,
+                          uint32_t v, int16_t *x, int16_t *y) {
+	int64_t sum[3];
+	fixed_blend(f, u, v, sum);
+
+	/* sum[0] and sum[1] are the coordinates times the weight, both
+	 * scaled by 2^32 once w is shifted to match; the divide truncates to
+	 * DAC units the same way a float to int16 conversion would. */
+	int64_t w = (sum[2] >> 24) << FIXED_COORD_BITS;
+	*x = fixed_clamp(sum[0] / w);
+	*y = fixed_clamp(sum[1] / w);
+}
+
+struct xy nurbs_fixed_evaluate_unrounded(const struct nurbs_fixed_patch *f,
+                                         uint32_t u, uint32_t v) {
+	int64_t sum[3];
+	fixed_blend(f, u, v, sum);
+
+	double w = (double)((sum[2] >> 24) << FIXED_COORD_BITS);
+	return (struct xy){ sum[0] / w, sum[1] / w };
+}
+
+/* Arc length
+ *
+ * The length of a line up to u is the integral of its speed |C'(u)|,
+ * which is smooth within a knot span. Each nonzero span is cut into
+ * ARCLEN_SUB pieces and each piece integrated by 5-point Gauss-Legendre
+ * quadrature. The running totals are then inverted at equal steps of
+ * length, refining each entry with a few bracketed Newton steps.
+ */
+
+#define ARCLEN_SUB	16
+#define ARCLEN_NEWTON	4
+
+static const double gauss_x[5] = {
+	0, -0.5384693101056831, 0.5384693101056831,
+	-0.9061798459386640, 0.9061798459386640,
+};
+static const double gauss_w[5] = {
+	0.5688888888888889, 0.4786286704993665, 0.4786286704993665,
+	0.2369268850561891, 0.2369268850561891,
+};
+
+/* line_speed(line, span, u)
+ *
+ * Return |C'(u)| for the part of a line in the given span. With A the
+ * weighted sum of the control points and W the sum of the weights,
+ * C = A / W and C' = (A' - C W') / W.
+ */
+static double line_speed(const struct nurbs_line *line, int span, float u) {
+	const float *knots = nurbs_line_knots(line);
+	float n[3], dn[3], d2n[3];
+	nurbs_basis_deriv(knots, span, u, n, dn, d2n);
+
+	double ax = 0, ay = 0, w = 0, dax = 0, day = 0, dw = 0;
+	for (int i = 0; i < 3; i++) {
+		const struct nurbs_point *pt = &line->t[span - 2 + i];
+		ax += n[i] * pt->weight * pt->x;
+		ay += n[i] * pt->weight * pt->y;
+		w += n[i] * pt->weight;
+		dax += dn[i] * pt->weight * pt->x;
+		day += dn[i] * pt->weight * pt->y;
+		dw += dn[i] * pt->weight;
+	}
+
+	return hypot(dax - ax / w * dw, day - ay / w * dw) / w;
+}
+
+static double piece_length(const struct nurbs_line *line, int span,
+                           double a, double b) {
+	double mid = (a + b) / 2, half = (b - a) / 2, sum = 0;
+	for (int i = 0; i < 5; i++)
+		sum += gauss_w[i] * line_speed(line, span,
+		                               mid + half * gauss_x[i]);
+	return sum * half;
+}
+
+struct nurbs_arclen *nurbs_arclen_build(const struct nurbs_line *line,
+                                        int entries) {
+	const float *knots = nurbs_line_knots(line);
+	int nodes = count_spans(knots, line->points) * ARCLEN_SUB + 1;
+
+	struct nurbs_arclen *out = malloc(sizeof *out
+	                                  + entries * sizeof (float));
+	double *at = malloc(nodes * sizeof *at);
+	double *len = malloc(nodes * sizeof *len);
+	int *span = malloc(nodes * sizeof *span);
+	if (!out || !at || !len || !span) {
+		printf("oom in nurbs_arclen_build\n");
+		goto bail;
+	}
+
+	if (entries < 2) {
+		printf("nurbs_arclen_build needs at least 2 entries\n");
+		goto bail;
+	}
+
+	/* Running length at the end of every piece */
+	int m = 0;
+	at[0] = knots[2];
+	len[0] = 0;
+	for (int k = 2; k < line->points; k++) {
+		if (knots[k] == knots[k + 1])
+			continue;
+
+		for (int q = 1; q <= ARCLEN_SUB; q++) {
+			at[m + 1] = knots[k]
+			          + (knots[k + 1] - knots[k]) * q / ARCLEN_SUB;
+			len[m + 1] = len[m]
+			           + piece_length(line, k, at[m], at[m + 1]);
+			span[m] = k;
+			m++;
+		}
+	}
+
+	double total = len[nodes - 1];
+	if (!(total > 0)) {
+		printf("zero-length line in nurbs_arclen_build\n");
+		goto bail;
+	}
+
+	out->entries = entries;
+	out->length = total;
+
+	m = 0;
+	for (int e = 0; e < entries; e++) {
+		double target = total * e / (entries - 1);
+		while (m < nodes - 2 && len[m + 1] < target)
+			m++;
+
+		/* Solve for the u where the length from at[m] reaches
+		 * want, keeping within [lo, hi] */
+		double want = target - len[m], piece = len[m + 1] - len[m];
+		double lo = at[m], hi = at[m + 1];
+		double x = piece > 0 ? lo + (hi - lo) * want / piece : lo;
+
+		for (int i = 0; i < ARCLEN_NEWTON && piece > 0; i++) {
+			double f = piece_length(line, span[m], at[m], x) - want;
+			if (f > 0)
+				hi = x;
+			else
+				lo = x;
+
+			double speed = line_speed(line, span[m], x);
+			double next = speed > 0 ? x - f / speed : lo;
+			x = next >= lo && next <= hi ? next : (lo + hi) / 2;
+		}
+
+		out->u[e] = x;
+	}
+
+	out->u[0] = knots[2];
+	out->u[entries - 1] = knots[line->points];
+
+	free(at);
+	free(len);
+	free(span);
+	return out;
+
+bail:
+	free(out);
+	free(at);
+	free(len);
+	free(span);
+	return NULL;
+}
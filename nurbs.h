@@ -1,6 +1,9 @@
 #ifndef NURBS_H
 #define NURBS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define NURBS_T_POINTS 4
 
 extern const float nurbs_t_knots[NURBS_T_POINTS + 3];
@@ -16,21 +19,214 @@ struct nurbs_point {
 	float weight;
 } __attribute__((packed));
 
+/* A curve's points + 3 knots follow its control points directly, so a
+ * line is position-independent and can be used straight out of a mapped
+ * file. */
 struct nurbs_line {
 	int points;
-	const float *knots;
 	struct nurbs_point t[];
 } __attribute__((packed));
 
+static inline const float *nurbs_line_knots(const struct nurbs_line *line) {
+	return (const float *)(line->t + line->points);
+}
+
 struct nurbs_patch {
 	int points;
 	const float *xy_knots;
 	struct nurbs_point t[][NURBS_T_POINTS];
 } __attribute__((packed));
 
+/* A patch swept out by moving a line along a path of affine transforms:
+ * control point [i][j] of the equivalent patch is path[j] applied to
+ * line->t[i], with line->t[i]'s weight. Since the weights don't vary
+ * along v and the v basis functions sum to one, the surface at (u, v) is
+ * just the blend of the path transforms at v applied to the line's point
+ * at u, so the control points never need to be copied. */
+struct nurbs_affine {
+	float xx, xy;
+	float yx, yy;
+	float dx, dy;
+};
+
+struct nurbs_sweep {
+	const struct nurbs_line *line;
+	struct nurbs_affine path[NURBS_T_POINTS];
+};
+
 struct nurbs_line *nurbs_load_line(const char *filename);
+
+/* Check that a line fits in size bytes and has a valid knot vector, before
+ * evaluating one that came from elsewhere. Returns 0 if it's usable. */
+int nurbs_line_check(const struct nurbs_line *line, size_t size);
+
+/* A library of named curves in one .nubl file (see nurbs.c for the
+ * format), mapped read-only and validated once at open. Lines returned by
+ * nurbs_library_line() point into the mapping and stay valid until the
+ * library is closed. */
+struct nurbs_library;
+
+struct nurbs_library *nurbs_library_open(const char *filename);
+void nurbs_library_close(struct nurbs_library *lib);
+int nurbs_library_count(const struct nurbs_library *lib);
+int nurbs_library_find(const struct nurbs_library *lib, const char *name);
+const char *nurbs_library_name(const struct nurbs_library *lib, int i);
+const struct nurbs_line *nurbs_library_line(const struct nurbs_library *lib,
+                                            int i);
+
+/* Indices k of the nonzero knot spans of shape i, precomputed by the
+ * generator. */
+const int32_t *nurbs_library_spans(const struct nurbs_library *lib, int i,
+                                   int *count);
 struct nurbs_patch *nurbs_extrude(const struct nurbs_line *line);
 
+/* nurbs_evaluate() only touches the 3x3 control points whose basis
+ * functions are nonzero at (u, v), so its cost doesn't depend on the size
+ * of the patch. nurbs_evaluate_ref() sums over every control point, and is
+ * kept as a reference for checking faster evaluators. */
 struct xy nurbs_evaluate(const struct nurbs_patch *p, float u, float v);
+struct xy nurbs_evaluate_ref(const struct nurbs_patch *p, float u, float v);
+
+/* Position and derivatives of a patch at (u, v), from the same basis
+ * functions as nurbs_evaluate() in a single pass. Within a knot span the
+ * surface is smooth; at a span boundary these are the derivatives of the
+ * span starting there. */
+struct nurbs_deriv {
+	struct xy p;
+	struct xy du, dv;
+	struct xy duu, duv, dvv;
+};
+
+void nurbs_evaluate_deriv(const struct nurbs_patch *p, float u, float v,
+                          struct nurbs_deriv *out);
+
+struct xy nurbs_line_evaluate(const struct nurbs_line *line, float u);
+struct xy nurbs_sweep_evaluate(const struct nurbs_sweep *s, float u, float v);
+
+/* Build the equivalent patch of a sweep, e.g. to compile it. */
+struct nurbs_patch *nurbs_sweep_patch(const struct nurbs_sweep *s);
+
+/* Evaluate n points of one patch at once, writing (u[i], v[i]) to out[i].
+ * Uses AVX2 or SSE2 lanes where the CPU has them (picked at startup; see
+ * nurbs_batch_isa()) and nurbs_evaluate() otherwise. Every lane performs
+ * the same operations in the same order as nurbs_evaluate(), so results
+ * agree with it to within NURBS_BATCH_ULP units in the last place; the
+ * slack only exists for compilers that contract into FMA on one path. */
+#define NURBS_BATCH_ULP 4
+
+void nurbs_evaluate_batch(const struct nurbs_patch *p, const float *u,
+                          const float *v, struct xy *out, int n);
+
+/* The same for a sweep, agreeing with nurbs_sweep_evaluate() */
+void nurbs_sweep_evaluate_batch(const struct nurbs_sweep *s, const float *u,
+                                const float *v, struct xy *out, int n);
+const char *nurbs_batch_isa(void);
+
+/* Rational Bézier form of a patch, for faster repeated sampling. Each
+ * piece covers one nonzero knot span in u and one in v, and holds a 3x3
+ * grid of homogeneous control points (w*x, w*y, w). Pieces are stored
+ * u-major: piece[i * v_pieces + j]. */
+struct nurbs_hpoint {
+	float x;
+	float y;
+	float w;
+};
+
+struct nurbs_bezier_piece {
+	float u0, u1;
+	float v0, v1;
+	struct nurbs_hpoint c[3][3];
+};
+
+struct nurbs_bezier_patch {
+	int u_pieces;
+	int v_pieces;
+	struct nurbs_bezier_piece piece[];
+};
+
+struct nurbs_bezier_patch *nurbs_bezier_compile(const struct nurbs_patch *p);
+
+/* Or compile into a caller's buffer of nurbs_bezier_size() bytes, e.g. to
+ * pack many patches into one block. Returns 0 on success. */
+size_t nurbs_bezier_size(const struct nurbs_patch *p);
+int nurbs_bezier_compile_to(const struct nurbs_patch *p,
+                            struct nurbs_bezier_patch *out);
+struct xy nurbs_bezier_evaluate(const struct nurbs_bezier_patch *b,
+                                float u, float v);
+
+/* Forward-differencing sampler for a compiled patch, producing the points
+ * at (u + k*du, v + k*dv) for k = 0, 1, 2, ... with du, dv >= 0. Each
+ * sample costs a few adds and one divide; the difference table is rebuilt
+ * at every piece boundary and at least every NURBS_STEPPER_RESTART
+ * samples, which bounds the accumulated rounding error. */
+#define NURBS_STEPPER_RESTART 256
+
+struct nurbs_stepper {
+	const struct nurbs_bezier_patch *patch;
+	double u0, v0, du, dv;
+	int k;
+	int left;
+	double d[3][5];
+};
+
+void nurbs_stepper_start(struct nurbs_stepper *s,
+                         const struct nurbs_bezier_patch *b,
+                         float u, float v, float du, float dv);
+struct xy nurbs_stepper_next(struct nurbs_stepper *s);
+
+/* Integer-only form of a compiled patch, for CPUs without a fast FPU.
+ * Coordinates are multiplied by scale (the DAC scale, for rendering) when
+ * compiling, and nurbs_fixed_evaluate() takes u and v as Q24 fractions of
+ * NURBS_FIXED_ONE and writes clamped int16 coordinates directly. Before
+ * the final truncation the result is within NURBS_FIXED_ERROR units of the
+ * exact surface, apart from how far rounding the parameters and the ends
+ * of pieces to Q24 moves it; see nurbs.c for the formats. To check that,
+ * nurbs_fixed_evaluate_unrounded() gives the same result in floating point,
+ * before truncating and clamping. */
+#define NURBS_FIXED_ONE		(1 << 24)
+#define NURBS_FIXED_ERROR	0.05
+
+struct nurbs_fixed_piece {
+	uint32_t u0, v0;
+	uint64_t u_scale, v_scale;	/* 2^48 / width, in Q24 */
+	int32_t c[3][3][3];		/* w*x, w*y, w */
+};
+
+struct nurbs_fixed_patch {
+	int u_pieces;
+	int v_pieces;
+	struct nurbs_fixed_piece piece[];
+};
+
+struct nurbs_fixed_patch *nurbs_fixed_compile(
+		const struct nurbs_bezier_patch *b, float scale);
+void nurbs_fixed_evaluate(const struct nurbs_fixed_patch *f, uint32_t u,
+                          uint32_t v, int16_t *x, int16_t *y);
+struct xy nurbs_fixed_evaluate_unrounded(const struct nurbs_fixed_patch *f,
+                                         uint32_t u, uint32_t v);
+
+/* Arc-length parameterization of a line. u[] holds the parameter at
+ * entries equal steps of length from the start of the curve to the end,
+ * so sampling nurbs_arclen_param() at equal steps of s in [0, 1] gives
+ * evenly spaced points. Release it with free(). */
+struct nurbs_arclen {
+	int entries;
+	float length;
+	float u[];
+};
+
+struct nurbs_arclen *nurbs_arclen_build(const struct nurbs_line *line,
+                                        int entries);
+
+static inline float nurbs_arclen_param(const struct nurbs_arclen *a,
+                                       float s) {
+	float x = s * (a->entries - 1);
+	int i = x;
+	if (i < 0)
+		i = 0;
+	else if (i > a->entries - 2)
+		i = a->entries - 2;
+	return a->u[i] + (a->u[i + 1] - a->u[i]) * (x - i);
+}
 
 #endif
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+
+struct pipeline_block {
+	int slow;
+	struct etherdream_point pts[];
+};
+
+struct pipeline {
+	int block_points;
+	int blocks;
+	size_t block_size;
+	long long block_ns;
+
+	pipeline_fill_fn *fill;
+	void *arg;
+	pthread_t thread;
+
+	/* Written only by the producer */
+	unsigned long produce __attribute__((aligned(64)));
+	unsigned long slow;
+
+	/* Written only by the consumer */
+	unsigned long consume __attribute__((aligned(64)));
+	unsigned long absorbed, stalls;
+	int min_depth;
+
+	char ring[] __attribute__((aligned(64)));
+};
+
+static long long now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void sleep_ns(long long ns) {
+	nanosleep(&(struct timespec){ .tv_sec = ns / 1000000000,
+	                              .tv_nsec = ns % 1000000000 }, NULL);
+}
+
+static struct pipeline_block *block(struct pipeline *pl, unsigned long i) {
+	return (void *)(pl->ring + (i % pl->blocks) * pl->block_size);
+}
+
+static void *pipeline_thread_func(void *arg) {
+	struct pipeline *pl = arg;
+	unsigned long produce = pl->produce;
+
+	while (1) {
+		/* Wait for a free block, a fraction of a block at a time */
+		while (produce - __atomic_load_n(&pl->consume, __ATOMIC_ACQUIRE)
+		       >= (unsigned long)pl->blocks)
+			sleep_ns(pl->block_ns / 4);
+
+		struct pipeline_block *b = block(pl, produce);
+		long long start = now_ns();
+		pl->fill(pl->arg, b->pts, pl->block_points);
+		b->slow = now_ns() - start > pl->block_ns;
+
+		if (b->slow)
+			__atomic_store_n(&pl->slow, pl->slow + 1,
+			                 __ATOMIC_RELAXED);
+
+		produce++;
+		__atomic_store_n(&pl->produce, produce, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+struct pipeline *pipeline_start(int block_points, int ahead_ms, int pps,
+                                pipeline_fill_fn *fill, void *arg) {
+	long long block_ns = (long long)block_points * 1000000000 / pps;
+	int blocks = ((long long)ahead_ms * 1000000 + block_ns - 1) / block_ns;
+	if (blocks < 2)
+		blocks = 2;
+
+	size_t block_size = sizeof (struct pipeline_block)
+	                  + block_points * sizeof (struct etherdream_point);
+	block_size = (block_size + 63) & ~(size_t)63;
+
+	struct pipeline *pl;
+	if (posix_memalign((void **)&pl, 64,
+	                   sizeof *pl + blocks * block_size)) {
+		printf("oom in pipeline_start\n");
+		return NULL;
+	}
+
+	*pl = (struct pipeline){
+		.block_points = block_points,
+		.blocks = blocks,
+		.block_size = block_size,
+		.block_ns = block_ns,
+		.fill = fill,
+		.arg = arg,
+		.min_depth = blocks,
+	};
+
+	if (pthread_create(&pl->thread, NULL, pipeline_thread_func, pl)) {
+		printf("couldn't start render thread\n");
+		free(pl);
+		return NULL;
+	}
+
+	/* Let the ring fill up before output starts */
+	while (__atomic_load_n(&pl->produce, __ATOMIC_ACQUIRE)
+	       < (unsigned long)blocks)
+		sleep_ns(block_ns / 4);
+
+	return pl;
+}
+
+const struct etherdream_point *pipeline_next(struct pipeline *pl) {
+	unsigned long consume = pl->consume;
+	unsigned long produce = __atomic_load_n(&pl->produce,
+	                                        __ATOMIC_ACQUIRE);
+
+	if (produce == consume) {
+		pl->stalls++;
+		pl->min_depth = 0;
+		do {
+			sleep_ns(pl->block_ns / 16);
+			produce = __atomic_load_n(&pl->produce,
+			                          __ATOMIC_ACQUIRE);
+		} while (produce == consume);
+	} else {
+		if ((int)(produce - consume) < pl->min_depth)
+			pl->min_depth = produce - consume;
+		if (block(pl, consume)->slow)
+			pl->absorbed++;
+	}
+
+	return block(pl, consume)->pts;
+}
+
+void pipeline_release(struct pipeline *pl) {
+	__atomic_store_n(&pl->consume, pl->consume + 1, __ATOMIC_RELEASE);
+}
+
+void pipeline_stats(struct pipeline *pl, struct pipeline_stats *out) {
+	unsigned long produce = __atomic_load_n(&pl->produce,
+	                                        __ATOMIC_ACQUIRE);
+
+	*out = (struct pipeline_stats){
+		.capacity = pl->blocks,
+		.depth = produce - pl->consume,
+		.min_depth = pl->min_depth,
+		.blocks = pl->consume,
+		.slow = __atomic_load_n(&pl->slow, __ATOMIC_RELAXED),
+		.absorbed = pl->absorbed,
+		.stalls = pl->stalls,
+	};
+}
@@ -0,0 +1,35 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "etherdream.h"
+
+/* A render thread that keeps a single-producer/single-consumer ring of
+ * point blocks filled ahead of the output loop. The consumer takes a block
+ * with pipeline_next(), hands it to the DAC, and then gives it back with
+ * pipeline_release(); neither side ever takes a lock. */
+
+typedef void pipeline_fill_fn(void *arg, struct etherdream_point *pts, int n);
+
+struct pipeline_stats {
+	int capacity;		/* blocks in the ring */
+	int depth;		/* blocks ready right now */
+	int min_depth;		/* lowest depth seen by the consumer */
+	unsigned long blocks;	/* blocks consumed */
+	unsigned long slow;	/* blocks that took longer to render than
+				 * they take to play */
+	unsigned long absorbed;	/* slow blocks that were ready in time
+				 * anyway: underruns avoided */
+	unsigned long stalls;	/* times the consumer found the ring empty */
+};
+
+struct pipeline;
+
+struct pipeline *pipeline_start(int block_points, int ahead_ms, int pps,
+                                pipeline_fill_fn *fill, void *arg);
+const struct etherdream_point *pipeline_next(struct pipeline *pl);
+void pipeline_release(struct pipeline *pl);
+/* Counters are updated by the consumer, so call this from the thread that
+ * calls pipeline_next(). */
+void pipeline_stats(struct pipeline *pl, struct pipeline_stats *out);
+
+#endif
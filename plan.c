@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <string.h>
+
+#include "plan.h"
+
+/* Ends closer than this, in DAC units, make a shape closed */
+#define PLAN_CLOSED	1.0f
+
+/* Improvement passes stop when nothing changes, or after this many */
+#define PLAN_ROUNDS	16
+
+static float dist(struct xy a, struct xy b) {
+	return hypotf(a.x - b.x, a.y - b.y);
+}
+
+static int closed(const struct plan_shape *sh) {
+	return dist(sh->at[0], sh->at[sh->samples]) < PLAN_CLOSED;
+}
+
+/* move_points(s, d)
+ *
+ * The fewest points to move d from rest to rest: accelerating then
+ * decelerating, with a stretch at full speed if there's room for one.
+ */
+static int move_points(const struct plan_scanner *s, float d) {
+	float v = s->max_speed, a = s->max_accel;
+	if (d <= v * v / a)
+		return ceilf(2 * sqrtf(d / a));
+	return ceilf(d / v + v / a);
+}
+
+int plan_transit(const struct plan_scanner *s, struct xy from, struct xy to) {
+	float d = dist(from, to);
+	if (d <= s->max_speed)
+		return 0;
+	return move_points(s, d) + 2 * s->dwell;
+}
+
+struct xy plan_transit_point(const struct plan_scanner *s, struct xy from,
+                             struct xy to, int i, int n) {
+	int m = n - 2 * s->dwell;
+	int t = i - s->dwell + 1;
+	if (m < 1 || t <= 0)
+		return from;
+	if (t >= m)
+		return to;
+
+	/* Accelerate at the limit up to the cruising speed that covers d in
+	 * exactly m points, hold it, and decelerate at the limit */
+	double d = dist(from, to), a = s->max_accel;
+	double disc = a * a * m * m - 4 * a * d;
+	double vc = (a * m - sqrt(disc > 0 ? disc : 0)) / 2;
+	double ta = vc / a, pos;
+
+	if (t < ta)
+		pos = a * t * t / 2;
+	else if (t <= m - ta)
+		pos = a * ta * ta / 2 + vc * (t - ta);
+	else
+		pos = d - a * (m - t) * (m - t) / 2;
+
+	float f = d > 0 ? pos / d : 1;
+	return (struct xy){ from.x + (to.x - from.x) * f,
+	                    from.y + (to.y - from.y) * f };
+}
+
+struct xy plan_step_start(const struct plan_shape *shapes,
+                          const struct plan_step *st) {
+	return shapes[st->shape].at[st->start];
+}
+
+struct xy plan_step_end(const struct plan_shape *shapes,
+                        const struct plan_step *st) {
+	const struct plan_shape *sh = &shapes[st->shape];
+	return closed(sh) ? sh->at[st->start] : sh->at[sh->samples - st->start];
+}
+
+/* Draw a step the other way round. A closed shape keeps its start. */
+static void flip(const struct plan_shape *shapes, struct plan_step *st) {
+	const struct plan_shape *sh = &shapes[st->shape];
+	if (!closed(sh))
+		st->start = sh->samples - st->start;
+	st->reverse = !st->reverse;
+}
+
+/* Beam position before step i */
+static struct xy before(const struct plan_shape *shapes,
+                        const struct plan_step *steps, int i,
+                        struct xy from) {
+	return i ? plan_step_end(shapes, &steps[i - 1]) : from;
+}
+
+static int total(const struct plan_scanner *s,
+                 const struct plan_shape *shapes, struct plan_step *steps,
+                 int count, struct xy from) {
+	int sum = 0;
+	for (int i = 0; i < count; i++) {
+		struct xy prev = before(shapes, steps, i, from);
+		steps[i].transit = plan_transit(s, prev,
+		                                plan_step_start(shapes,
+		                                                &steps[i]));
+		sum += steps[i].transit;
+	}
+
+	return sum;
+}
+
+/* Nearest shape first, from wherever the last one ended */
+static void greedy(const struct plan_shape *shapes, int count,
+                   struct xy from, struct plan_step *steps) {
+	int used[PLAN_MAX_SHAPES] = { 0 };
+	struct xy at = from;
+
+	for (int i = 0; i < count; i++) {
+		float best = INFINITY;
+		for (int j = 0; j < count; j++) {
+			if (used[j])
+				continue;
+
+			const struct plan_shape *sh = &shapes[j];
+			int loop = closed(sh);
+			int step = loop ? 1 : sh->samples;
+			int last = loop ? sh->samples - 1 : sh->samples;
+			for (int k = 0; k <= last; k += step) {
+				float d = dist(at, sh->at[k]);
+				if (d < best) {
+					best = d;
+					steps[i] = (struct plan_step){
+						.shape = j,
+						.start = k,
+						.reverse = !loop && k != 0,
+					};
+				}
+			}
+		}
+
+		used[steps[i].shape] = 1;
+		at = plan_step_end(shapes, &steps[i]);
+	}
+}
+
+/* two_opt(s, shapes, steps, count, from)
+ *
+ * Reverse any run of steps, each drawn the other way round, that makes
+ * the transits at its ends cheaper; the transits within it stay the same.
+ * A run of one step just flips it. Returns whether anything changed.
+ */
+static int two_opt(const struct plan_scanner *s,
+                   const struct plan_shape *shapes, struct plan_step *steps,
+                   int count, struct xy from) {
+	int changed = 0;
+
+	for (int i = 0; i < count; i++) {
+		for (int j = i; j < count; j++) {
+			struct xy prev = before(shapes, steps, i, from);
+			struct xy first = plan_step_start(shapes, &steps[i]);
+			struct xy last = plan_step_end(shapes, &steps[j]);
+
+			int old = plan_transit(s, prev, first);
+			int new = plan_transit(s, prev, last);
+			if (j + 1 < count) {
+				struct xy next = plan_step_start(shapes,
+				                                 &steps[j + 1]);
+				old += plan_transit(s, last, next);
+				new += plan_transit(s, first, next);
+			}
+
+			if (new >= old)
+				continue;
+
+			for (int a = i, b = j; a < b; a++, b--) {
+				struct plan_step t = steps[a];
+				steps[a] = steps[b];
+				steps[b] = t;
+			}
+			for (int k = i; k <= j; k++)
+				flip(shapes, &steps[k]);
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+/* Move each closed shape's start to the sample that's cheapest to get to
+ * and to leave from */
+static int restart(const struct plan_scanner *s,
+                   const struct plan_shape *shapes, struct plan_step *steps,
+                   int count, struct xy from) {
+	int changed = 0;
+
+	for (int i = 0; i < count; i++) {
+		const struct plan_shape *sh = &shapes[steps[i].shape];
+		if (!closed(sh))
+			continue;
+
+		struct xy prev = before(shapes, steps, i, from);
+		int has_next = i + 1 < count;
+		struct xy next = has_next
+		               ? plan_step_start(shapes, &steps[i + 1]) : prev;
+
+		int best = -1, best_cost = 0;
+		for (int k = 0; k < sh->samples; k++) {
+			int cost = plan_transit(s, prev, sh->at[k]);
+			if (has_next)
+				cost += plan_transit(s, sh->at[k], next);
+			if (best < 0 || cost < best_cost) {
+				best = k;
+				best_cost = cost;
+			}
+		}
+
+		int cost = plan_transit(s, prev, sh->at[steps[i].start]);
+		if (has_next)
+			cost += plan_transit(s, sh->at[steps[i].start], next);
+		if (best_cost < cost) {
+			steps[i].start = best;
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+static int improve(const struct plan_scanner *s,
+                   const struct plan_shape *shapes, struct plan_step *steps,
+                   int count, struct xy from) {
+	for (int round = 0; round < PLAN_ROUNDS; round++) {
+		int changed = two_opt(s, shapes, steps, count, from);
+		changed |= restart(s, shapes, steps, count, from);
+		if (!changed)
+			break;
+	}
+
+	return total(s, shapes, steps, count, from);
+}
+
+int plan_frame(const struct plan_scanner *s, const struct plan_shape *shapes,
+               int count, struct xy from, struct plan_step *steps) {
+	if (count > PLAN_MAX_SHAPES)
+		return -1;
+
+	struct plan_step given[PLAN_MAX_SHAPES];
+	for (int i = 0; i < count; i++)
+		given[i] = (struct plan_step){ .shape = i };
+
+	greedy(shapes, count, from, steps);
+	int cost = improve(s, shapes, steps, count, from);
+	int given_cost = improve(s, shapes, given, count, from);
+
+	if (given_cost < cost) {
+		memcpy(steps, given, count * sizeof *steps);
+		cost = given_cost;
+	}
+
+	return cost;
+}
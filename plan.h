@@ -0,0 +1,62 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include "nurbs.h"
+
+/* Frame planning: choosing the order in which to draw the shapes of a
+ * frame, where each one starts and which way round it goes, so that the
+ * scanner spends as few points as possible moving between them with the
+ * laser off. All positions are in DAC units. */
+
+/* How fast the scanner can move, in DAC units per point and per point
+ * per point, and how many points the laser takes to switch; a blanked
+ * move is held for dwell points at each end. */
+struct plan_scanner {
+	float max_speed;
+	float max_accel;
+	int dwell;
+};
+
+/* A shape to draw, sampled at samples + 1 points evenly spaced in its
+ * parameter over [0, 1]. If its ends meet it's closed, and it can start
+ * at any sample; otherwise it starts at one end or the other. */
+struct plan_shape {
+	const struct xy *at;
+	int samples;
+};
+
+struct plan_step {
+	int shape;
+	int start;		/* sample it starts at */
+	int reverse;		/* drawn towards decreasing parameter */
+	int transit;		/* blanked points to get to it */
+};
+
+#define PLAN_MAX_SHAPES	64
+
+/* Points needed to get from one position to another: none if it's no
+ * further than the scanner goes in a point, so the two can be joined while
+ * lit, and otherwise the fewest for a move from rest to rest within the
+ * limits, plus the dwell at each end. */
+int plan_transit(const struct plan_scanner *s, struct xy from, struct xy to);
+
+/* Point i of the n that plan_transit() gives for a move, following the
+ * fastest profile that takes exactly that many. */
+struct xy plan_transit_point(const struct plan_scanner *s, struct xy from,
+                             struct xy to, int i, int n);
+
+/* Plan a frame of count shapes, with the beam starting at from: fill in
+ * steps[0] to steps[count - 1] in drawing order, and return the total
+ * number of transit points, or -1 if there are more than PLAN_MAX_SHAPES.
+ * Both the nearest-shape-first order and the order given are improved with
+ * 2-opt and by moving the starts of closed shapes, and the better kept. */
+int plan_frame(const struct plan_scanner *s, const struct plan_shape *shapes,
+               int count, struct xy from, struct plan_step *steps);
+
+/* Where a step starts and ends */
+struct xy plan_step_start(const struct plan_shape *shapes,
+                          const struct plan_step *st);
+struct xy plan_step_end(const struct plan_shape *shapes,
+                        const struct plan_step *st);
+
+#endif
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "rcu.h"
+
+/* Each reader's slot holds the generation it entered in, or 0 when it's
+ * outside any read section. rcu_synchronize() starts a new generation
+ * after the writer's swap, and waits for every slot to be 0 or newer:
+ * anyone who entered after that must have seen the new pointer.
+ *
+ * Threads that find every slot taken are counted instead, in one of two
+ * counts picked by a phase bit. rcu_synchronize() flips the phase and
+ * waits for the old phase's count to drain. A reader that sees the phase
+ * change under it while entering backs out and counts itself in the new
+ * one, so a count can only be entered before the flip, and the writer
+ * never waits on readers that came after it. */
+struct reader {
+	unsigned long gen;
+	int used;
+} __attribute__((aligned(64)));
+
+static struct reader readers[RCU_READERS];
+static unsigned long generation = 1;
+
+/* Stands in for a slot for threads that couldn't claim one */
+static struct reader overflow;
+static unsigned long overflow_readers[2];
+static unsigned overflow_phase;
+static pthread_mutex_t overflow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct reader *self;
+static __thread int depth;
+static __thread unsigned phase;	/* entered under, on the fallback */
+
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+
+#define WAIT_NS 100000
+
+/* Give a thread's slot back when it exits */
+static void release(void *arg) {
+	struct reader *r = arg;
+	__atomic_store_n(&r->gen, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+static void key_init(void) {
+	int res = pthread_key_create(&reader_key, release);
+	assert(res == 0);
+}
+
+static struct reader *claim(void) {
+	pthread_once(&reader_once, key_init);
+
+	for (int i = 0; i < RCU_READERS; i++) {
+		struct reader *r = &readers[i];
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&r->used, &unused, 1, 0,
+		                                __ATOMIC_ACQ_REL,
+		                                __ATOMIC_RELAXED)) {
+			pthread_setspecific(reader_key, r);
+			return r;
+		}
+	}
+
+	return &overflow;
+}
+
+void rcu_read_enter(void) {
+	if (depth++)
+		return;
+	if (!self)
+		self = claim();
+
+	if (self == &overflow) {
+		for (;;) {
+			phase = __atomic_load_n(&overflow_phase,
+			                        __ATOMIC_SEQ_CST);
+			__atomic_add_fetch(&overflow_readers[phase], 1,
+			                   __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&overflow_phase, __ATOMIC_SEQ_CST)
+			    == phase)
+				return;
+			__atomic_sub_fetch(&overflow_readers[phase], 1,
+			                   __ATOMIC_RELEASE);
+		}
+	}
+
+	__atomic_store_n(&self->gen,
+	                 __atomic_load_n(&generation, __ATOMIC_ACQUIRE),
+	                 __ATOMIC_SEQ_CST);
+}
+
+void rcu_read_exit(void) {
+	if (--depth)
+		return;
+
+	if (self == &overflow)
+		__atomic_sub_fetch(&overflow_readers[phase], 1,
+		                   __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&self->gen, 0, __ATOMIC_RELEASE);
+}
+
+void rcu_synchronize(void) {
+	unsigned long gen = __atomic_add_fetch(&generation, 1,
+	                                       __ATOMIC_SEQ_CST);
+
+	for (int i = 0; i < RCU_READERS; i++) {
+		for (;;) {
+			unsigned long g = __atomic_load_n(&readers[i].gen,
+			                                  __ATOMIC_SEQ_CST);
+			if (!g || g >= gen)
+				break;
+
+			struct timespec ts = { 0, WAIT_NS };
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	pthread_mutex_lock(&overflow_lock);
+	unsigned old = __atomic_fetch_xor(&overflow_phase, 1,
+	                                  __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&overflow_readers[old], __ATOMIC_SEQ_CST)) {
+		struct timespec ts = { 0, WAIT_NS };
+		nanosleep(&ts, NULL);
+	}
+	pthread_mutex_unlock(&overflow_lock);
+}
@@ -0,0 +1,18 @@
+#ifndef RCU_H
+#define RCU_H
+
+/* Deferred reclamation for data that readers reach through a shared
+ * pointer. A reader brackets its use of the pointer with rcu_read_enter()
+ * and rcu_read_exit(), which only store to a slot of the reader's own, so
+ * readers never wait for anyone. A writer swaps in the new version with
+ * an atomic exchange, then calls rcu_synchronize() before freeing the old
+ * one: it returns once every reader that could still be using it has
+ * left. Read sections may nest. Each thread that reads takes one of
+ * RCU_READERS slots until it exits; any more share a slower fallback. */
+#define RCU_READERS 64
+
+void rcu_read_enter(void);
+void rcu_read_exit(void);
+void rcu_synchronize(void);
+
+#endif
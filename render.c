@@ -1,127 +1,1435 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "rcu.h"
 #include "render.h"
+#include "scene.h"
+
+#define DEFAULT_LIBRARY	"data/shapes.nubl"
+#define DEFAULT_SCENE	"data/default.scene"
+
+/* Everything kept for each patch of the scene, in one flat table. The
+ * compiled forms of all the patches share one block. */
+struct patch {
+	const struct nurbs_sweep *sweep;
+	float start, scale;	/* first tick, and 1 / ticks */
+	struct nurbs_bezier_patch *compiled;
+	struct nurbs_fixed_patch *fixed;
+	struct tess *cache;
+	struct tess *retired;	/* the grid cache replaced, not yet freed */
 
-struct nurbs_patch *make_move(const struct nurbs_line *line,
-                              struct xy path[NURBS_T_POINTS]) {
+	/* Optional reparameterization of u, by arc length or by a motion
+	 * schedule. Arc-length tables are shared between patches of the same
+	 * shape, and reparam_owned marks the ones to free. */
+	struct nurbs_arclen *reparam;
+	int reparam_owned;
+	double schedule_points, schedule_uniform;
+};
 
-	size_t size = sizeof (struct nurbs_patch)
-	            + sizeof (struct nurbs_point) * line->points * 4;
+/* A loaded shape library and scene, and everything built from them.
+ * Rendering reads the current one through a single pointer, so a reload
+ * builds a whole new show and swaps it in; see rcu.h. */
+struct show {
+	struct nurbs_library *shapes;
+	struct scene *scene;
+	struct patch *patches;
+	int patch_count;
+	void *compiled_block;
+};
 
-	struct nurbs_patch *out = malloc(size);
-	assert(out);
+static struct show *current;
 
-	out->points = line->points;
-	out->xy_knots = line->knots;
+/* What's been asked of the current show, to do again for a reloaded one.
+ * Changes to it and to the current show are serialized by reload_lock,
+ * which rendering never takes. */
+static struct {
+	char library[PATH_MAX], scene[PATH_MAX];
+	int compiled, fixed;
+	int arclen_entries;
+	float max_speed, max_accel;
+	int schedule_entries;
+	float tess_error;
+	int tess_threads;
+} options;
 
-	for (int i = 0; i < line->points; i++) {
-		for (int j = 0; j < 4; j++) {
-			out->t[i][j].x = line->t[i].x + path[j].x;
-			out->t[i][j].y = line->t[i].y + path[j].y;
-			out->t[i][j].weight = line->t[i].weight;
-		}
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* show_enter()
+ *
+ * Start reading the current show; rendering brackets every use of it with
+ * this and rcu_read_exit().
+ */
+static const struct show *show_enter(void) {
+	rcu_read_enter();
+	return __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+}
+
+static void reparam_clear(struct show *sh);
+
+static void show_free(struct show *sh) {
+	if (!sh)
+		return;
+
+	reparam_clear(sh);
+	for (int i = 0; i < sh->patch_count; i++) {
+		free(sh->patches[i].fixed);
+		free(sh->patches[i].cache);
 	}
 
-	return out;
+	free(sh->compiled_block);
+	free(sh->patches);
+	free(sh->scene);
+	if (sh->shapes)
+		nurbs_library_close(sh->shapes);
+	free(sh);
 }
 
-struct nurbs_patch *make_spin(const struct nurbs_line *line,
-                              const float angles[4]) {
+static struct show *show_load(const char *library, const char *scene) {
+	struct show *sh = calloc(1, sizeof *sh);
+	if (!sh) {
+		printf("oom in show_load\n");
+		return NULL;
+	}
+
+	sh->shapes = nurbs_library_open(library);
+	if (!sh->shapes)
+		goto bail;
+
+	sh->scene = scene_load(scene, sh->shapes);
+	if (!sh->scene)
+		goto bail;
+
+	struct scene *sc = sh->scene;
+	sh->patches = calloc(sc->patches, sizeof *sh->patches);
+	if (!sh->patches) {
+		printf("oom in show_load\n");
+		goto bail;
+	}
 
-	size_t size = sizeof (struct nurbs_patch)
-	            + sizeof (struct nurbs_point) * line->points * 4;
+	sh->patch_count = sc->patches;
+	for (int i = 0; i < sc->patches; i++) {
+		sh->patches[i].sweep = &sc->patch[i].sweep;
+		sh->patches[i].start = sc->patch[i].start;
+		sh->patches[i].scale = 1.0f / sc->patch[i].ticks;
+	}
 
-	struct nurbs_patch *out = malloc(size);
-	assert(out);
+	return sh;
 
-	out->points = line->points;
-	out->xy_knots = line->knots;
+bail:
+	show_free(sh);
+	return NULL;
+}
 
-	for (int i = 0; i < line->points; i++) {
-		for (int j = 0; j < 4; j++) {
-			float tsin = sinf(angles[j]);
-			float tcos = cosf(angles[j]);
-			float x = line->t[i].x, y = line->t[i].y;
+static void show_compile(struct show *sh) {
+	/* Build every patch first, to size the block */
+	struct nurbs_patch **p = malloc(sh->patch_count * sizeof *p);
+	assert(p);
+
+	size_t size = 0;
+	for (int i = 0; i < sh->patch_count; i++) {
+		p[i] = nurbs_sweep_patch(sh->patches[i].sweep);
+		assert(p[i]);
+		size += nurbs_bezier_size(p[i]);
+	}
 
-			out->t[i][j].x = x * tcos - y * tsin;
-			out->t[i][j].y = x * tsin + y * tcos;
-			out->t[i][j].weight = line->t[i].weight;
+	free(sh->compiled_block);
+	sh->compiled_block = malloc(size);
+	assert(sh->compiled_block);
+
+	char *at = sh->compiled_block;
+	for (int i = 0; i < sh->patch_count; i++) {
+		struct patch *pa = &sh->patches[i];
+		pa->compiled = (struct nurbs_bezier_patch *)at;
+		int res = nurbs_bezier_compile_to(p[i], pa->compiled);
+		assert(res == 0);
+		at += nurbs_bezier_size(p[i]);
+		free(p[i]);
+	}
+
+	free(p);
+}
+
+#define DAC_SCALE	10000
+
+static void show_compile_fixed(struct show *sh) {
+	for (int i = 0; i < sh->patch_count; i++) {
+		struct patch *pa = &sh->patches[i];
+		struct nurbs_bezier_patch *b = pa->compiled;
+		if (!b) {
+			struct nurbs_patch *p = nurbs_sweep_patch(pa->sweep);
+			assert(p);
+			b = nurbs_bezier_compile(p);
+			assert(b);
+			free(p);
 		}
+
+		free(pa->fixed);
+		pa->fixed = nurbs_fixed_compile(b, DAC_SCALE);
+		assert(pa->fixed);
+		if (b != pa->compiled)
+			free(b);
 	}
+}
 
-	return out;
+static void reparam_clear(struct show *sh) {
+	for (int i = 0; i < sh->patch_count; i++) {
+		struct patch *pa = &sh->patches[i];
+		if (pa->reparam_owned)
+			free(pa->reparam);
+		pa->reparam = NULL;
+		pa->reparam_owned = 0;
+		pa->schedule_points = pa->schedule_uniform = 0;
+	}
+}
+
+static void show_arclen(struct show *sh, int entries) {
+	reparam_clear(sh);
+
+	/* One table per shape, built by its first patch */
+	struct patch **first = calloc(nurbs_library_count(sh->shapes),
+	                              sizeof *first);
+	assert(first);
+
+	for (int i = 0; i < sh->patch_count; i++) {
+		struct patch *pa = &sh->patches[i];
+		struct patch **f = &first[sh->scene->patch[i].shape];
+		if (*f) {
+			pa->reparam = (*f)->reparam;
+			continue;
+		}
+
+		pa->reparam = nurbs_arclen_build(pa->sweep->line, entries);
+		assert(pa->reparam);
+		pa->reparam_owned = 1;
+		*f = pa;
+	}
+
+	free(first);
+}
+
+void render_init(void) {
+	snprintf(options.library, sizeof options.library, "%s",
+	         DEFAULT_LIBRARY);
+	snprintf(options.scene, sizeof options.scene, "%s", DEFAULT_SCENE);
+
+	current = show_load(options.library, options.scene);
+	assert(current);
+}
+
+void render_compile(void) {
+	pthread_mutex_lock(&reload_lock);
+	options.compiled = 1;
+	show_compile(current);
+	pthread_mutex_unlock(&reload_lock);
 }
 
-struct xy move_path[][4] = {
-	{ { -2.0,  2.0 }, { -2.0,  2.0 }, { -1.5,  2.0 }, { -1.0,  2.0 } },
-	{ { -1.0,  2.0 }, { -0.5,  2.0 }, {  0.5,  2.0 }, {  1.0,  2.0 } },
-	{ {  1.0,  2.0 }, {  1.5,  2.0 }, {  2.0,  2.0 }, {  2.0,  2.0 } },
+void render_compile_fixed(void) {
+	pthread_mutex_lock(&reload_lock);
+	options.fixed = 1;
+	show_compile_fixed(current);
+	pthread_mutex_unlock(&reload_lock);
+}
 
-	{ {  2.0,  2.0 }, {  2.0,  2.0 }, {  2.0,  1.5 }, {  2.0,  1.0 } },
-	{ {  2.0,  1.0 }, {  2.0,  0.5 }, {  2.0, -0.5 }, {  2.0, -1.0 } },
-	{ {  2.0, -1.0 }, {  2.0, -1.5 }, {  2.0, -2.0 }, {  2.0, -2.0 } },
+void render_arclen(int entries) {
+	pthread_mutex_lock(&reload_lock);
+	options.arclen_entries = entries;
+	options.schedule_entries = 0;
+	show_arclen(current, entries);
+	pthread_mutex_unlock(&reload_lock);
+}
 
-	{ {  2.0, -2.0 }, {  2.0, -2.0 }, {  1.5, -2.0 }, {  1.0, -2.0 } },
-	{ {  1.0, -2.0 }, {  0.5, -2.0 }, { -0.5, -2.0 }, { -1.0, -2.0 } },
-	{ { -1.0, -2.0 }, { -1.5, -2.0 }, { -2.0, -2.0 }, { -2.0, -2.0 } },
+/* Motion schedules
+ *
+ * Each patch is sampled along u, through the middle of its v range, at
+ * SCHEDULE_SAMPLES points per knot span. At each sample the scanner may
+ * go no faster than max_speed, nor than sqrt(max_accel / curvature) so
+ * that it can follow the bend. Where two spans meet at an angle theta,
+ * passing the corner at speed s changes the velocity by 2 s sin(theta/2)
+ * in one point, which caps s there. Forward and backward passes then
+ * limit the speed so that it never has to change by more than max_accel
+ * per point, and the time taken between samples gives u at equal steps
+ * of time. That's stored like an arc-length table, just at equal steps of
+ * time rather than of length.
+ */
 
-	{ { -2.0, -2.0 }, { -2.0, -2.0 }, { -2.0, -1.5 }, { -2.0, -1.0 } },
-	{ { -2.0, -1.0 }, { -2.0, -0.5 }, { -2.0,  0.5 }, { -2.0,  1.0 } },
-	{ { -2.0,  1.0 }, { -2.0,  1.5 }, { -2.0,  2.0 }, { -2.0,  2.0 } },
+#define SCHEDULE_SAMPLES	256
+#define SCHEDULE_V		0.5f
+
+struct sample {
+	float u;
+	struct xy p, du;
+	double speed, dist;
 };
 
-#define MOVE_PATCHES	12
-#define SPIN_PATCHES	12
+static double cross(struct xy a, struct xy b) {
+	return (double)a.x * b.y - (double)a.y * b.x;
+}
 
-#define PATCHES (MOVE_PATCHES + SPIN_PATCHES)
+static double norm(struct xy a) {
+	return hypot(a.x, a.y);
+}
 
-#define TAU (2 * M_PI)
-#define INCR (TAU / SPIN_PATCHES)
+/* The speed reached from speed v accelerating at a over a distance d */
+static double reach(double v, double a, double d) {
+	return sqrt(v * v + 2 * a * d);
+}
 
-static struct nurbs_patch *patches[PATCHES];
+/* corner_speed(a, b, max_accel)
+ *
+ * The fastest a scanner can turn from direction a to direction b in one
+ * point; unlimited if they're the same.
+ */
+static double corner_speed(struct xy a, struct xy b, double max_accel) {
+	double la = norm(a), lb = norm(b);
+	if (!(la > 0 && lb > 0))
+		return INFINITY;
 
-void render_init(void) {
-	struct nurbs_line *circle_line = nurbs_load_line("data/circle.nub"),
-	                  *square_line = nurbs_load_line("data/square.nub");
-	assert(circle_line);
-	assert(square_line);
-
-	for (int i = 0; i < MOVE_PATCHES; i++)
-		patches[i] = make_move(circle_line, move_path[i]);
-
-	for (int i = 0; i < SPIN_PATCHES; i++) {
-		float theta = INCR * i;
-		float angles[] = {
-			theta,
-			fmod(theta + INCR*1/4, TAU),
-			fmod(theta + INCR*3/4, TAU),
-			fmod(theta + INCR, TAU),
-		};
+	double dot = ((double)a.x * b.x + (double)a.y * b.y) / (la * lb);
+	double half = sqrt((1 - (dot < 1 ? dot : 1)) / 2);
+	return half > 1e-6 ? max_accel / (2 * half) : INFINITY;
+}
+
+/* schedule_build(p, max_speed, max_accel, entries, points, uniform)
+ *
+ * Build the schedule for a patch. *points is set to the fewest points a
+ * trace can take within the limits, and *uniform to the fewest it would
+ * take sampled evenly in u.
+ */
+static struct nurbs_arclen *schedule_build(const struct nurbs_patch *p,
+                                           double max_speed, double max_accel,
+                                           int entries, double *points,
+                                           double *uniform) {
+	const float *knots = p->xy_knots;
+	int spans = 0;
+	for (int k = 2; k < p->points; k++)
+		spans += knots[k] < knots[k + 1];
+
+	int n = spans * (SCHEDULE_SAMPLES + 1);
+	struct sample *sm = malloc(n * sizeof *sm);
+	double *t = malloc(n * sizeof *t);
+	struct nurbs_arclen *out = malloc(sizeof *out
+	                                  + entries * sizeof (float));
+	assert(sm && t && out && entries >= 2);
+
+	/* Sample every span from end to end, so that where spans meet
+	 * there are two samples at the same point, one with each span's
+	 * tangent. */
+	double need = 0;
+	int m = 0;
+	for (int k = 2; k < p->points; k++) {
+		if (knots[k] == knots[k + 1])
+			continue;
 
-		patches[MOVE_PATCHES + i] = make_spin(square_line, angles);
+		for (int q = 0; q <= SCHEDULE_SAMPLES; q++) {
+			float u = knots[k] + (knots[k + 1] - knots[k])
+			                     * q / SCHEDULE_SAMPLES;
+			if (q == SCHEDULE_SAMPLES)
+				u = nextafterf(knots[k + 1], knots[k]);
+
+			struct nurbs_deriv d;
+			nurbs_evaluate_deriv(p, u, SCHEDULE_V, &d);
+
+			struct sample *s = &sm[m++];
+			s->u = u;
+			s->p = (struct xy){ d.p.x * DAC_SCALE,
+			                    d.p.y * DAC_SCALE };
+			s->du = (struct xy){ d.du.x * DAC_SCALE,
+			                     d.du.y * DAC_SCALE };
+			struct xy duu = { d.duu.x * DAC_SCALE,
+			                  d.duu.y * DAC_SCALE };
+
+			double v = norm(s->du), limit = max_speed;
+			if (v > 0) {
+				double bend = fabs(cross(s->du, duu))
+				            / (v * v * v);
+				if (bend > 0 && sqrt(max_accel / bend) < limit)
+					limit = sqrt(max_accel / bend);
+			}
+			s->speed = limit;
+
+			/* Sampled evenly in u, n points a trace move
+			 * du / n and accelerate by duu / n^2 per point */
+			if (v / max_speed > need)
+				need = v / max_speed;
+			if (sqrt(norm(duu) / max_accel) > need)
+				need = sqrt(norm(duu) / max_accel);
+		}
 	}
+
+	/* Corners between spans, and at the seam if the curve is closed */
+	int closed = norm((struct xy){ sm[n - 1].p.x - sm[0].p.x,
+	                               sm[n - 1].p.y - sm[0].p.y }) < 1;
+	for (int i = SCHEDULE_SAMPLES; i < n; i += SCHEDULE_SAMPLES + 1) {
+		int next = i + 1 < n ? i + 1 : 0;
+		if (next == 0 && !closed)
+			break;
+
+		double c = corner_speed(sm[i].du, sm[next].du, max_accel);
+		sm[i].speed = fmin(sm[i].speed, c);
+		sm[next].speed = fmin(sm[next].speed, c);
+
+		struct xy jump = { sm[next].du.x - sm[i].du.x,
+		                   sm[next].du.y - sm[i].du.y };
+		if (c < INFINITY && norm(jump) / max_accel > need)
+			need = norm(jump) / max_accel;
+	}
+
+	/* An open curve has to stop at its ends */
+	if (!closed)
+		sm[0].speed = sm[n - 1].speed = 0;
+
+	sm[0].dist = 0;
+	for (int i = 1; i < n; i++)
+		sm[i].dist = norm((struct xy){ sm[i].p.x - sm[i - 1].p.x,
+		                               sm[i].p.y - sm[i - 1].p.y });
+
+	/* Limit acceleration and braking; going round twice carries the
+	 * limits across the seam of a closed curve. */
+	for (int pass = 0; pass < (closed ? 2 : 1); pass++) {
+		for (int i = 1; i < n; i++)
+			sm[i].speed = fmin(sm[i].speed, reach(sm[i - 1].speed,
+			                   max_accel, sm[i].dist));
+		if (closed)
+			sm[0].speed = fmin(sm[0].speed, sm[n - 1].speed);
+	}
+
+	for (int pass = 0; pass < (closed ? 2 : 1); pass++) {
+		for (int i = n - 2; i >= 0; i--)
+			sm[i].speed = fmin(sm[i].speed, reach(sm[i + 1].speed,
+			                   max_accel, sm[i + 1].dist));
+		if (closed)
+			sm[n - 1].speed = fmin(sm[n - 1].speed, sm[0].speed);
+	}
+
+	/* Time, in points, to reach each sample */
+	t[0] = 0;
+	for (int i = 1; i < n; i++) {
+		double v = sm[i - 1].speed + sm[i].speed;
+		t[i] = t[i - 1] + (sm[i].dist > 0 ? 2 * sm[i].dist / v : 0);
+	}
+
+	out->entries = entries;
+	out->length = 0;
+	for (int i = 1; i < n; i++)
+		out->length += sm[i].dist;
+
+	for (int e = 0, i = 0; e < entries; e++) {
+		double want = t[n - 1] * e / (entries - 1);
+		while (i < n - 2 && t[i + 1] < want)
+			i++;
+
+		double dt = t[i + 1] - t[i];
+		double f = dt > 0 ? (want - t[i]) / dt : 0;
+		out->u[e] = sm[i].u + (sm[i + 1].u - sm[i].u) * fmin(f, 1);
+	}
+
+	*points = t[n - 1];
+	*uniform = need;
+
+	free(sm);
+	free(t);
+	return out;
 }
 
+static void show_schedule(struct show *sh, float max_speed, float max_accel,
+                          int entries) {
+	reparam_clear(sh);
+
+	for (int i = 0; i < sh->patch_count; i++) {
+		struct patch *pa = &sh->patches[i];
+		struct nurbs_patch *p = nurbs_sweep_patch(pa->sweep);
+		assert(p);
+		pa->reparam = schedule_build(p, max_speed, max_accel, entries,
+		                             &pa->schedule_points,
+		                             &pa->schedule_uniform);
+		pa->reparam_owned = 1;
+		free(p);
+	}
+}
+
+void render_schedule(float max_speed, float max_accel, int entries) {
+	pthread_mutex_lock(&reload_lock);
+	options.max_speed = max_speed;
+	options.max_accel = max_accel;
+	options.schedule_entries = entries;
+	options.arclen_entries = 0;
+	show_schedule(current, max_speed, max_accel, entries);
+	pthread_mutex_unlock(&reload_lock);
+}
+
+void render_schedule_stats(struct render_schedule_stats *out) {
+	*out = (struct render_schedule_stats){ 0 };
+	const struct show *sh = show_enter();
+
+	for (int i = 0; i < sh->patch_count; i++) {
+		const struct patch *pa = &sh->patches[i];
+		if (!pa->schedule_points)
+			continue;
+
+		out->patches++;
+		out->points = fmax(out->points, pa->schedule_points);
+		out->uniform_points = fmax(out->uniform_points,
+		                           pa->schedule_uniform);
+	}
+
+	rcu_read_exit();
+}
+
+
 static int16_t clamp(float v) {
 	return v >= 32767 ? 32767 : (v <= -32768 ? -32768 : v);
 }
 
-void render_point(struct etherdream_point *pt, float u, float redraw_count) {
+static void render_dac(struct etherdream_point *pt, struct xy dac) {
+	pt->x = clamp(dac.x);
+	pt->y = clamp(dac.y);
+	pt->r = 65535;
+	pt->g = 65535;
+	pt->b = 65535;
+}
+
+static void render_xy(struct etherdream_point *pt, struct xy xy) {
+	/* Convert to DAC format */
+	render_dac(pt, (struct xy){ xy.x * DAC_SCALE, xy.y * DAC_SCALE });
+}
+
+/* A patch tessellated into a grid of v.n rows of u.n points, in DAC
+ * units. Along each axis, at[] holds the breakpoints and scale[] one over
+ * the width of each cell; index[] maps each of (1 << bits) equal slices of
+ * [0, 1) to the last breakpoint at or before its start, so finding the
+ * cell for a point is a table lookup and, at most, a short scan. */
+struct tess_axis {
+	int n, bits;
+	const float *at, *scale;
+	const int *index;
+};
+
+struct tess {
+	struct tess_axis u, v;
+	const struct xy *pts;
+	float max_error;
+	size_t size;
+};
+
+/* Patches are split until they fit in TESS_MAX_POINTS, or their error is
+ * in bounds. Each pass checks every cell at TESS_PROBES x TESS_PROBES
+ * points, edges included. */
+#define TESS_MAX_POINTS	(1 << 20)
+#define TESS_START_U	8
+#define TESS_START_V	2
+#define TESS_PROBES	5
+
+static float clampf(float v) {
+	return v >= 32767 ? 32767 : (v <= -32768 ? -32768 : v);
+}
+
+static struct xy dac_point(const struct nurbs_sweep *s, float u, float v) {
+	struct xy xy = nurbs_sweep_evaluate(s, u, v);
+	return (struct xy){ xy.x * DAC_SCALE, xy.y * DAC_SCALE };
+}
+
+static struct xy bilerp(struct xy p00, struct xy p10, struct xy p01,
+                        struct xy p11, float s, float t) {
+	struct xy a = { p00.x + (p10.x - p00.x) * s,
+	                p00.y + (p10.y - p00.y) * s };
+	struct xy b = { p01.x + (p11.x - p01.x) * s,
+	                p01.y + (p11.y - p01.y) * s };
+	return (struct xy){ a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t };
+}
+
+/* The distance between two points as the DAC would see them */
+static float dac_error(struct xy a, struct xy b) {
+	return hypotf(clampf(a.x) - clampf(b.x), clampf(a.y) - clampf(b.y));
+}
+
+/* refine(at, n, split)
+ *
+ * Add a breakpoint in the middle of every interval marked in split[],
+ * returning the new count.
+ */
+static int refine(float *at, int n, const unsigned char *split) {
+	int m = n;
+	for (int i = 0; i < n - 1; i++)
+		m += split[i];
+
+	for (int i = n - 1, j = m - 1; i > 0; i--) {
+		at[j--] = at[i];
+		if (split[i - 1])
+			at[j--] = (at[i - 1] + at[i]) / 2;
+	}
+
+	return m;
+}
+
+static int index_bits(int n) {
+	int bits = 0;
+	while ((1 << bits) < n)
+		bits++;
+	return bits;
+}
+
+static void axis_init(struct tess_axis *a, float *at, float *scale,
+                      int *index, int n) {
+	a->n = n;
+	a->bits = index_bits(n);
+	a->at = at;
+	a->scale = scale;
+	a->index = index;
+
+	for (int k = 0; k < n - 1; k++)
+		scale[k] = 1 / (at[k + 1] - at[k]);
+
+	for (int b = 0, k = 0; b < 1 << a->bits; b++) {
+		while (k < n - 2 && at[k + 1] <= (float)b / (1 << a->bits))
+			k++;
+		index[b] = k;
+	}
+}
+
+/* axis_find(a, x)
+ *
+ * Return the cell along a that x, in [0, 1), falls in.
+ */
+static inline int axis_find(const struct tess_axis *a, float x) {
+	int b = x * (1 << a->bits);
+	if (b >= 1 << a->bits)
+		b = (1 << a->bits) - 1;
+	else if (b < 0)
+		b = 0;
+
+	int k = a->index[b];
+	while (k < a->n - 2 && x >= a->at[k + 1])
+		k++;
+	return k;
+}
+
+static struct xy tess_lookup(const struct tess *t, float u, float v) {
+	int i = axis_find(&t->u, u), j = axis_find(&t->v, v);
+	const struct xy *row = t->pts + j * t->u.n + i;
+
+	return bilerp(row[0], row[1], row[t->u.n], row[t->u.n + 1],
+	              (u - t->u.at[i]) * t->u.scale[i],
+	              (v - t->v.at[j]) * t->v.scale[j]);
+}
+
+/* tessellate(s, max_error)
+ *
+ * Build the grid for one sweep. Every pass checks each cell against the
+ * surface; a cell that's out along one of its rows needs another column,
+ * and one that's out along a column needs another row.
+ */
+static struct tess *tessellate(const struct nurbs_sweep *s, float max_error) {
+	int nu = TESS_START_U + 1, nv = TESS_START_V + 1;
+	float *u = malloc(TESS_MAX_POINTS * sizeof *u);
+	float *v = malloc(TESS_MAX_POINTS * sizeof *v);
+	struct xy *pts = NULL;
+	unsigned char *split_u = malloc(TESS_MAX_POINTS);
+	unsigned char *split_v = malloc(TESS_MAX_POINTS);
+	assert(u && v && split_u && split_v);
+
+	for (int i = 0; i < nu; i++)
+		u[i] = (float)i / (nu - 1);
+	for (int j = 0; j < nv; j++)
+		v[j] = (float)j / (nv - 1);
+
+	float worst;
+	for (;;) {
+		pts = realloc(pts, nu * nv * sizeof *pts);
+		assert(pts);
+		for (int j = 0; j < nv; j++)
+			for (int i = 0; i < nu; i++)
+				pts[j * nu + i] = dac_point(s, u[i], v[j]);
+
+		memset(split_u, 0, nu - 1);
+		memset(split_v, 0, nv - 1);
+		int splits = 0;
+		worst = 0;
+
+		for (int j = 0; j < nv - 1; j++)
+		for (int i = 0; i < nu - 1; i++) {
+			const struct xy *row = pts + j * nu + i;
+
+			for (int b = 0; b < TESS_PROBES; b++)
+			for (int a = 0; a < TESS_PROBES; a++) {
+				int edge_u = a == 0 || a == TESS_PROBES - 1;
+				int edge_v = b == 0 || b == TESS_PROBES - 1;
+				if (edge_u && edge_v)
+					continue;
+
+				float fs = (float)a / (TESS_PROBES - 1);
+				float ft = (float)b / (TESS_PROBES - 1);
+				float pu = u[i] + (u[i + 1] - u[i]) * fs;
+				float pv = v[j] + (v[j + 1] - v[j]) * ft;
+				struct xy want = dac_point(s, pu, pv);
+				struct xy got = bilerp(row[0], row[1],
+					row[nu], row[nu + 1], fs, ft);
+
+				float err = dac_error(want, got);
+				if (err > worst)
+					worst = err;
+				if (err <= max_error)
+					continue;
+
+				/* In the middle of a cell, split whichever way
+				 * interpolating along just one axis does
+				 * worse. */
+				int need_u = !edge_u, need_v = !edge_v;
+				if (need_u && need_v) {
+					struct xy iu = bilerp(
+						dac_point(s, u[i], pv),
+						dac_point(s, u[i + 1], pv),
+						want, want, fs, 0);
+					struct xy iv = bilerp(
+						dac_point(s, pu, v[j]), want,
+						dac_point(s, pu, v[j + 1]),
+						want, 0, ft);
+					if (dac_error(want, iu)
+					    >= dac_error(want, iv))
+						need_v = 0;
+					else
+						need_u = 0;
+				}
+
+				if (need_u && !split_u[i]) {
+					split_u[i] = 1;
+					splits++;
+				}
+				if (need_v && !split_v[j]) {
+					split_v[j] = 1;
+					splits++;
+				}
+			}
+		}
+
+		if (!splits)
+			break;
+
+		int mu = nu, mv = nv;
+		for (int i = 0; i < nu - 1; i++)
+			mu += split_u[i];
+		for (int j = 0; j < nv - 1; j++)
+			mv += split_v[j];
+		if ((long)mu * mv > TESS_MAX_POINTS)
+			break;
+
+		nu = refine(u, nu, split_u);
+		nv = refine(v, nv, split_v);
+	}
+
+	/* Everything goes in a single block */
+	int slices_u = 1 << index_bits(nu), slices_v = 1 << index_bits(nv);
+	size_t size = sizeof (struct tess)
+	            + nu * nv * sizeof *pts
+	            + 2 * (nu + nv) * sizeof (float)
+	            + (slices_u + slices_v) * sizeof (int);
+	struct tess *t = malloc(size);
+	assert(t);
+
+	struct xy *t_pts = (struct xy *)(t + 1);
+	float *t_u = (float *)(t_pts + nu * nv), *t_v = t_u + nu;
+	float *scale_u = t_v + nv, *scale_v = scale_u + nu;
+	int *index_u = (int *)(scale_v + nv), *index_v = index_u + slices_u;
+
+	memcpy(t_pts, pts, nu * nv * sizeof *pts);
+	memcpy(t_u, u, nu * sizeof *u);
+	memcpy(t_v, v, nv * sizeof *v);
+	axis_init(&t->u, t_u, scale_u, index_u, nu);
+	axis_init(&t->v, t_v, scale_v, index_v, nv);
+	t->pts = t_pts;
+	t->max_error = worst;
+	t->size = size;
+
+	free(pts);
+	free(u);
+	free(v);
+	free(split_u);
+	free(split_v);
+	return t;
+}
+
+/* Build a patch's grid and swap it in. A reader may still be using the
+ * one it replaces, so that's kept in retired for free_retired(). */
+static void tessellate_patch(struct show *sh, int patch,
+                             float max_error) {
+	struct tess *t = tessellate(sh->patches[patch].sweep, max_error);
+	sh->patches[patch].retired =
+		__atomic_exchange_n(&sh->patches[patch].cache, t,
+		                    __ATOMIC_ACQ_REL);
+}
+
+/* Free the replaced grids, once nothing can be rendering from them */
+static void free_retired(struct show *sh) {
+	int any = 0;
+	for (int i = 0; i < sh->patch_count; i++)
+		any |= sh->patches[i].retired != NULL;
+	if (!any)
+		return;
+
+	rcu_synchronize();
+	for (int i = 0; i < sh->patch_count; i++) {
+		free(sh->patches[i].retired);
+		sh->patches[i].retired = NULL;
+	}
+}
+
+struct tess_job {
+	pthread_t thread;
+	struct show *sh;
+	int *next;
+	float max_error;
+};
+
+static void *tess_thread_func(void *arg) {
+	struct tess_job *job = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(job->next, 1, __ATOMIC_RELAXED))
+	       < job->sh->patch_count)
+		tessellate_patch(job->sh, i, job->max_error);
+
+	return NULL;
+}
+
+static void show_tessellate(struct show *sh, float max_error, int threads) {
+	if (threads < 1)
+		threads = 1;
+	if (threads > RENDER_MAX_THREADS)
+		threads = RENDER_MAX_THREADS;
+	if (threads > sh->patch_count)
+		threads = sh->patch_count;
+
+	int next = 0;
+	struct tess_job jobs[threads];
+
+	for (int i = 0; i < threads; i++)
+		jobs[i] = (struct tess_job){ .sh = sh, .next = &next,
+		                             .max_error = max_error };
+
+	for (int i = 1; i < threads; i++) {
+		int res = pthread_create(&jobs[i].thread, NULL,
+		                         tess_thread_func, &jobs[i]);
+		assert(res == 0);
+	}
+
+	tess_thread_func(&jobs[0]);
+
+	for (int i = 1; i < threads; i++)
+		pthread_join(jobs[i].thread, NULL);
+
+	free_retired(sh);
+}
+
+void render_tessellate_patch(int patch, float max_error) {
+	pthread_mutex_lock(&reload_lock);
+	assert(patch >= 0 && patch < current->patch_count);
+	tessellate_patch(current, patch, max_error);
+	free_retired(current);
+	pthread_mutex_unlock(&reload_lock);
+}
+
+void render_tessellate(float max_error, int threads) {
+	pthread_mutex_lock(&reload_lock);
+	options.tess_error = max_error;
+	options.tess_threads = threads < 1 ? 1 : threads;
+	show_tessellate(current, max_error, threads);
+	pthread_mutex_unlock(&reload_lock);
+}
+
+void render_cache_stats(struct render_cache_stats *out) {
+	*out = (struct render_cache_stats){ 0 };
+	const struct show *sh = show_enter();
+
+	for (int i = 0; i < sh->patch_count; i++) {
+		const struct tess *t = __atomic_load_n(&sh->patches[i].cache,
+		                                       __ATOMIC_ACQUIRE);
+		if (!t)
+			continue;
+
+		out->patches++;
+		out->points += t->u.n * t->v.n;
+		out->bytes += t->size;
+		if (t->max_error > out->max_error)
+			out->max_error = t->max_error;
+	}
+
+	rcu_read_exit();
+}
+
+/* locate(sh, u, redraw_count, cu, v)
+ *
+ * Map a position in the pattern to a patch, and the (u, v) to evaluate
+ * it at.
+ */
+static int locate(const struct show *sh, float u, float redraw_count,
+                  float *cu, float *v) {
 	/* Figure out which patch we're in */
-	float ipart, fpart = modff(u * PATCHES, &ipart);
-	int patch = ipart;
+	const struct scene *scene = sh->scene;
+	float x = u * scene->ticks;
+	int tick = x < scene->ticks ? (int)x : scene->ticks - 1;
+	int patch = scene->tick_patch[tick];
+
+	*v = (x - sh->patches[patch].start) * sh->patches[patch].scale;
+	*cu = fmod(u * redraw_count, 1.0);
+	return patch;
+}
+
+/* A patch at (cu, v) in DAC units, before clamping */
+static struct xy patch_dac(const struct patch *pa, float cu, float v) {
+	if (pa->reparam)
+		cu = nurbs_arclen_param(pa->reparam, cu);
+
+	const struct tess *t = __atomic_load_n(&pa->cache, __ATOMIC_ACQUIRE);
+	if (t)
+		return tess_lookup(t, cu, v);
 
 	/* Evaluate the NURBS surface */
-	struct xy xy = nurbs_evaluate(patches[patch],
-	                              fmod(u * redraw_count, 1.0), fpart);
+	return dac_point(pa->sweep, cu, v);
+}
 
-	/* Convert to DAC format */
-	pt->x = clamp(xy.x * 10000);
-	pt->y = clamp(xy.y * 10000);
+static void point(const struct show *sh, struct etherdream_point *pt,
+                  float u, float redraw_count) {
+	float cu, v;
+	int patch = locate(sh, u, redraw_count, &cu, &v);
+	render_dac(pt, patch_dac(&sh->patches[patch], cu, v));
+}
+
+void render_point(struct etherdream_point *pt, float u, float redraw_count) {
+	point(show_enter(), pt, u, redraw_count);
+	rcu_read_exit();
+}
+
+static void render_fixed(struct etherdream_point *pt,
+                         const struct patch *pa, uint32_t u, uint32_t v) {
+	nurbs_fixed_evaluate(pa->fixed, u, v, &pt->x, &pt->y);
 	pt->r = 65535;
 	pt->g = 65535;
 	pt->b = 65535;
 }
+
+/* run_fixed(sh, pts, n, p, period, redraw_count)
+ *
+ * render_run() in integers only. Sample q is in tick q * ticks / period,
+ * at u = q * redraw_count / period mod 1; the numerators are stepped along
+ * with the sample, and scaled to Q24 by multiplying by a reciprocal rather
+ * than dividing. That takes one divide per patch, and redraw_count is
+ * rounded to Q16 once per call.
+ */
+static void run_fixed(const struct show *sh, struct etherdream_point *pts,
+                      int n, int p, int period, float redraw_count) {
+	const struct scene *scene = sh->scene;
+	uint64_t redraw = lrintf(redraw_count * 65536);
+	uint64_t u_period = (uint64_t)period << 16;
+	uint64_t u_inv = (1ULL << 40) / period;
+	uint64_t ticks = scene->ticks;
+
+	int q = p % period;
+	int tick = (uint64_t)q * ticks / period;
+	uint64_t rem = (uint64_t)q * ticks % period;
+	uint64_t u_num = q * redraw % u_period;
+
+	const struct scene_patch *sp = NULL;
+	int patch = -1;
+	uint64_t v_inv = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (scene->tick_patch[tick] != patch) {
+			patch = scene->tick_patch[tick];
+			sp = &scene->patch[patch];
+			v_inv = (1ULL << 56) / ((uint64_t)period * sp->ticks);
+		}
+
+		/* v is (tick - start + rem / period) / ticks */
+		uint64_t v_num = (uint64_t)(tick - sp->start) * period + rem;
+		render_fixed(&pts[i], &sh->patches[patch],
+		             (u_num * u_inv) >> 32, (v_num * v_inv) >> 32);
+
+		if (++q == period) {
+			q = tick = 0;
+			rem = u_num = 0;
+			continue;
+		}
+
+		rem += ticks;
+		while (rem >= (uint64_t)period) {
+			rem -= period;
+			tick++;
+		}
+
+		u_num += redraw;
+		while (u_num >= u_period)
+			u_num -= u_period;
+	}
+}
+
+/* Samples evaluated together by points() */
+#define BATCH_POINTS	256
+
+/* points(sh, pts, u, n, redraw_count)
+ *
+ * point() on each u[i], except that each run of two or more samples in
+ * the same patch is evaluated with nurbs_sweep_evaluate_batch(), unless
+ * the patch has a grid.
+ */
+static void points(const struct show *sh, struct etherdream_point *pts,
+                   const float *u, int n, float redraw_count) {
+	float cu[BATCH_POINTS], v[BATCH_POINTS];
+	int patch[BATCH_POINTS];
+	struct xy xy[BATCH_POINTS];
+
+	for (int base = 0; base < n; base += BATCH_POINTS) {
+		int chunk = n - base < BATCH_POINTS ? n - base : BATCH_POINTS;
+		for (int i = 0; i < chunk; i++)
+			patch[i] = locate(sh, u[base + i], redraw_count, &cu[i],
+			                  &v[i]);
+
+		for (int i = 0, count; i < chunk; i += count) {
+			const struct patch *pa = &sh->patches[patch[i]];
+			for (count = 1; i + count < chunk; count++)
+				if (patch[i + count] != patch[i])
+					break;
+
+			struct etherdream_point *out = pts + base + i;
+			if (count == 1
+			    || __atomic_load_n(&pa->cache, __ATOMIC_ACQUIRE)) {
+				for (int j = 0; j < count; j++)
+					render_dac(&out[j],
+					           patch_dac(pa, cu[i + j],
+					                     v[i + j]));
+				continue;
+			}
+
+			if (pa->reparam)
+				for (int j = i; j < i + count; j++)
+					cu[j] = nurbs_arclen_param(pa->reparam,
+					                           cu[j]);
+
+			nurbs_sweep_evaluate_batch(pa->sweep, cu + i, v + i, xy,
+			                           count);
+			for (int j = 0; j < count; j++)
+				render_xy(&out[j], xy[j]);
+		}
+	}
+}
+
+void render_points(struct etherdream_point *pts, const float *u, int n,
+                   float redraw_count) {
+	points(show_enter(), pts, u, n, redraw_count);
+	rcu_read_exit();
+}
+
+static void run(const struct show *sh, struct etherdream_point *pts, int n,
+                int p, int period, float redraw_count) {
+	const struct patch *patches = sh->patches;
+	if (patches[0].fixed && !patches[0].reparam) {
+		run_fixed(sh, pts, n, p, period, redraw_count);
+		return;
+	}
+
+	if (!patches[0].compiled || patches[0].reparam) {
+		float u[BATCH_POINTS];
+		for (int i = 0; i < n; i += BATCH_POINTS) {
+			int count = n - i < BATCH_POINTS ? n - i : BATCH_POINTS;
+			for (int j = 0; j < count; j++)
+				u[j] = (float)((p + i + j) % period) / period;
+			points(sh, pts + i, u, count, redraw_count);
+		}
+		return;
+	}
+
+	double du = (double)redraw_count / period;
+
+	for (int i = 0; i < n; ) {
+		/* Start a stepper at the next point, and run it until the
+		 * patch changes or the curve wraps around. */
+		float cu, v;
+		int q = (p + i) % period;
+		int patch = locate(sh, (float)q / period, redraw_count, &cu,
+		                   &v);
+		double dv = (double)sh->scene->ticks
+		          / ((double)period * sh->scene->patch[patch].ticks);
+
+		int count = n - i;
+		if (period - q < count)
+			count = period - q;
+		if (ceil((1 - v) / dv) < count)
+			count = ceil((1 - v) / dv);
+		if (ceil((1 - cu) / du) < count)
+			count = ceil((1 - cu) / du);
+
+		/* Rounding can put the end of the run across a boundary that
+		 * render_point() wouldn't have crossed yet; back off so that
+		 * every point lands in the same patch as it would there. */
+		while (count > 1) {
+			float lcu, lv;
+			float lu = (float)(q + count - 1) / period;
+			if (locate(sh, lu, redraw_count, &lcu, &lv) == patch
+			    && lcu >= cu)
+				break;
+			count--;
+		}
+
+		struct nurbs_stepper s;
+		nurbs_stepper_start(&s, patches[patch].compiled, cu, v, du,
+		                    dv);
+
+		for (int j = 0; j < count; j++)
+			render_xy(&pts[i + j], nurbs_stepper_next(&s));
+
+		i += count;
+	}
+}
+
+void render_run(struct etherdream_point *pts, int n, int p, int period,
+                float redraw_count) {
+	run(show_enter(), pts, n, p, period, redraw_count);
+	rcu_read_exit();
+}
+
+struct pattern_job {
+	pthread_t thread;
+	struct etherdream_point *pts;
+	int start, count, period;
+	float redraw_count;
+};
+
+static void *pattern_thread_func(void *arg) {
+	struct pattern_job *job = arg;
+	render_run(job->pts + job->start, job->count, job->start, job->period,
+	           job->redraw_count);
+	return NULL;
+}
+
+void render_pattern(struct etherdream_point *pts, int period,
+                    float redraw_count, int threads) {
+	if (threads < 1)
+		threads = 1;
+	if (threads > RENDER_MAX_THREADS)
+		threads = RENDER_MAX_THREADS;
+
+	struct pattern_job jobs[threads];
+	int chunk = (period + threads - 1) / threads;
+
+	for (int i = 0; i < threads; i++) {
+		int start = i * chunk < period ? i * chunk : period;
+		jobs[i] = (struct pattern_job){
+			.pts = pts,
+			.start = start,
+			.count = period - start < chunk ? period - start
+			                                : chunk,
+			.period = period,
+			.redraw_count = redraw_count,
+		};
+	}
+
+	/* The first slice is rendered on the calling thread */
+	for (int i = 1; i < threads; i++) {
+		int res = pthread_create(&jobs[i].thread, NULL,
+		                         pattern_thread_func, &jobs[i]);
+		assert(res == 0);
+	}
+
+	pattern_thread_func(&jobs[0]);
+
+	for (int i = 1; i < threads; i++)
+		pthread_join(jobs[i].thread, NULL);
+}
+
+void render_sweep(struct etherdream_point *pts, int n,
+                  const struct nurbs_sweep *s, float redraw_count) {
+	for (int i = 0; i < n; i++) {
+		float v = (float)i / n;
+		float u = fmod(v * redraw_count, 1.0);
+		render_xy(&pts[i], nurbs_sweep_evaluate(s, u, v));
+	}
+}
+
+/* Frames
+ *
+ * Each shape of a frame is sampled at FRAME_SAMPLES + 1 points for the
+ * planner, which picks its start among them. The points left over from
+ * the transits are shared out in proportion to the shapes' lengths, so
+ * they're all drawn at about the same brightness.
+ */
+#define FRAME_SAMPLES	32
+
+static void render_blank(struct etherdream_point *pt, struct xy dac) {
+	render_dac(pt, dac);
+	pt->r = 0;
+	pt->g = 0;
+	pt->b = 0;
+}
+
+static struct xy dac_clamp(struct xy p) {
+	return (struct xy){ clampf(p.x), clampf(p.y) };
+}
+
+void render_frame(struct etherdream_point *pts, int n, const float *u,
+                  int count, const struct plan_scanner *scanner,
+                  struct xy *beam, struct render_frame_stats *st) {
+	static __thread struct xy at[PLAN_MAX_SHAPES][FRAME_SAMPLES + 1];
+	struct plan_shape shapes[PLAN_MAX_SHAPES];
+	struct plan_step steps[PLAN_MAX_SHAPES];
+	const struct patch *pa[PLAN_MAX_SHAPES];
+	float v[PLAN_MAX_SHAPES], length[PLAN_MAX_SHAPES], sum = 0;
+
+	assert(count >= 1 && count <= PLAN_MAX_SHAPES);
+	const struct show *sh = show_enter();
+
+	for (int j = 0; j < count; j++) {
+		float cu;
+		pa[j] = &sh->patches[locate(sh, u[j], 1, &cu, &v[j])];
+		shapes[j] = (struct plan_shape){ at[j], FRAME_SAMPLES };
+
+		struct xy *p = at[j];
+		length[j] = 0;
+		for (int k = 0; k <= FRAME_SAMPLES; k++) {
+			float t = (float)k / FRAME_SAMPLES;
+			p[k] = dac_clamp(patch_dac(pa[j], t, v[j]));
+			if (k)
+				length[j] += hypotf(p[k].x - p[k - 1].x,
+				                    p[k].y - p[k - 1].y);
+		}
+		sum += length[j];
+	}
+
+	/* What it would cost to draw them as given, each from its start */
+	st->in_order_blank = 0;
+	for (int j = 0; j < count; j++)
+		st->in_order_blank += plan_transit(scanner,
+		                                   j ? at[j - 1][FRAME_SAMPLES]
+		                                     : *beam, at[j][0]);
+
+	int blank = plan_frame(scanner, shapes, count, *beam, steps);
+	int lit = n - blank > 0 ? n - blank : 0;
+	int i = 0;
+
+	for (int s = 0; s < count && i < n; s++) {
+		const struct plan_step *step = &steps[s];
+		int j = step->shape;
+
+		struct xy start = plan_step_start(shapes, step);
+		for (int k = 0; k < step->transit && i < n; k++) {
+			struct xy p = plan_transit_point(scanner, *beam, start,
+			                                 k, step->transit);
+			render_blank(&pts[i++], p);
+		}
+		*beam = start;
+
+		/* This shape's share of the lit points; the last gets what's
+		 * left after rounding */
+		int m = sum > 0 ? lit * length[j] / sum : lit / count;
+		if (s == count - 1 || m > n - i)
+			m = n - i;
+
+		float t0 = (float)step->start / FRAME_SAMPLES;
+		float dir = step->reverse ? -1 : 1;
+		for (int k = 0; k < m; k++) {
+			/* Only a closed shape can go round past either end */
+			float t = t0 + dir * (m > 1 ? (float)k / (m - 1) : 0);
+			if (t < 0)
+				t += 1;
+			else if (t > 1)
+				t -= 1;
+
+			*beam = dac_clamp(patch_dac(pa[j], t, v[j]));
+			render_dac(&pts[i++], *beam);
+		}
+	}
+
+	rcu_read_exit();
+
+	/* Anything left, if the transits took the whole frame */
+	for (; i < n; i++)
+		render_blank(&pts[i], *beam);
+
+	st->lit = lit < n ? lit : n;
+	st->blank = n - st->lit;
+}
+
+/* Reloading
+ *
+ * A reload builds a complete new show off to the side, does everything to
+ * it that was done to the old one, and only then swaps it in. Rendering
+ * carries on with the old show meanwhile, and picks up the new one at its
+ * next call.
+ */
+
+static void show_setup(struct show *sh) {
+	if (options.compiled)
+		show_compile(sh);
+	if (options.fixed)
+		show_compile_fixed(sh);
+	if (options.arclen_entries)
+		show_arclen(sh, options.arclen_entries);
+	if (options.schedule_entries)
+		show_schedule(sh, options.max_speed, options.max_accel,
+		              options.schedule_entries);
+	if (options.tess_threads)
+		show_tessellate(sh, options.tess_error, options.tess_threads);
+}
+
+/* reload(library, scene)
+ *
+ * Load and publish a new show, freeing the old one once nothing can be
+ * rendering from it. Called with reload_lock held.
+ */
+static int reload(const char *library, const char *scene) {
+	struct show *sh = show_load(library, scene);
+	if (!sh)
+		return -1;
+
+	show_setup(sh);
+	struct show *old = __atomic_exchange_n(&current, sh,
+	                                       __ATOMIC_SEQ_CST);
+	rcu_synchronize();
+	show_free(old);
+	return 0;
+}
+
+int render_load_scene(const char *filename) {
+	pthread_mutex_lock(&reload_lock);
+	int res = reload(options.library, filename);
+	if (res == 0)
+		snprintf(options.scene, sizeof options.scene, "%s", filename);
+	pthread_mutex_unlock(&reload_lock);
+	return res;
+}
+
+int render_reload(void) {
+	pthread_mutex_lock(&reload_lock);
+	int res = reload(options.library, options.scene);
+	pthread_mutex_unlock(&reload_lock);
+	return res;
+}
+
+/* Changes are picked up from inotify on the directories holding the
+ * library and the scene, since editors and generators often write a new
+ * file and rename it into place. A burst of events is left to settle for
+ * WATCH_SETTLE_MS before reloading. The watcher runs at idle priority, so
+ * building a new show only takes time that rendering leaves spare. */
+#define WATCH_SETTLE_MS	200
+
+struct watch {
+	int fd;
+	int wd[2];
+	const char *name[2];
+};
+
+static const char *base_name(const char *path) {
+	const char *slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+static int watch_add(struct watch *w, int i, const char *path) {
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof dir, "%s", path);
+	char *slash = strrchr(dir, '/');
+	if (slash)
+		*slash = 0;
+	else
+		snprintf(dir, sizeof dir, ".");
+
+	w->name[i] = base_name(path);
+	w->wd[i] = inotify_add_watch(w->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (w->wd[i] < 0) {
+		perror(dir);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Whether any of the events in buf are for a watched file */
+static int watch_match(const struct watch *w, const char *buf, ssize_t len) {
+	const struct inotify_event *ev;
+	for (ssize_t at = 0; at < len; at += sizeof *ev + ev->len) {
+		ev = (const void *)(buf + at);
+		for (int i = 0; i < 2; i++)
+			if (ev->len && ev->wd == w->wd[i]
+			    && !strcmp(ev->name, w->name[i]))
+				return 1;
+	}
+
+	return 0;
+}
+
+static long long now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void *watch_thread_func(void *arg) {
+	struct watch *w = arg;
+	struct sched_param param = { 0 };
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;) {
+		ssize_t len = read(w->fd, buf, sizeof buf);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			perror("inotify");
+			return NULL;
+		}
+
+		if (!watch_match(w, buf, len))
+			continue;
+
+		struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+		while (poll(&pfd, 1, WATCH_SETTLE_MS) > 0)
+			if (read(w->fd, buf, sizeof buf) < 0 && errno != EINTR)
+				break;
+
+		long long start = now_ns();
+		if (render_reload() < 0) {
+			printf("reload failed; keeping the current show\n");
+			continue;
+		}
+
+		printf("reloaded %s and %s in %.1f ms\n", w->name[0],
+		       w->name[1], (now_ns() - start) / 1e6);
+	}
+}
+
+int render_watch(void) {
+	static struct watch w;
+	static char library[PATH_MAX], scene[PATH_MAX];
+
+	pthread_mutex_lock(&reload_lock);
+	snprintf(library, sizeof library, "%s", options.library);
+	snprintf(scene, sizeof scene, "%s", options.scene);
+	pthread_mutex_unlock(&reload_lock);
+
+	w.fd = inotify_init1(IN_CLOEXEC);
+	if (w.fd < 0) {
+		perror("inotify_init1");
+		return -1;
+	}
+
+	pthread_t thread;
+	if (watch_add(&w, 0, library) < 0 || watch_add(&w, 1, scene) < 0
+	    || pthread_create(&thread, NULL, watch_thread_func, &w)) {
+		close(w.fd);
+		return -1;
+	}
+
+	pthread_detach(thread);
+	return 0;
+}
@@ -1,10 +1,156 @@
 #ifndef RENDER_H
 #define RENDER_H
 
+#include <stddef.h>
+
+#ifdef RENDER_STANDALONE
+#include <stdint.h>
+
+/* The point format from etherdream.h, for building without libetherdream */
+struct etherdream_point {
+	int16_t x;
+	int16_t y;
+	uint16_t r;
+	uint16_t g;
+	uint16_t b;
+	uint16_t i;
+	uint16_t u1;
+	uint16_t u2;
+};
+#else
 #include "etherdream.h"
+#endif
 #include "nurbs.h"
+#include "plan.h"
 
+/* Open the shape library and load the default scene. */
 void render_init(void);
+
+/* Replace the scene with one loaded from a file (see scene.c). Everything
+ * that's been built for the old one with the calls below is built again
+ * for the new one before it's swapped in, so this is safe to call while
+ * rendering: rendering never waits for it, and carries on with the old
+ * scene until the new one is ready. Returns 0 on success, leaving the old
+ * scene in place otherwise. */
+int render_load_scene(const char *filename);
+
+/* Reload the shape library and the scene from their files, the same way. */
+int render_reload(void);
+
+/* Start a thread that watches the shape library and scene files, and
+ * reloads them whenever either changes. Returns 0 on success. */
+int render_watch(void);
+
+/* Build the rational Bézier form of every patch, which render_run() will
+ * then use. Optional; without it, render_run() evaluates each point. This
+ * and the other calls that build things for the scene must be made before
+ * rendering starts, but are repeated by every reload. */
+void render_compile(void);
+
+/* Build the fixed-point form of every patch (see nurbs_fixed_compile()),
+ * which render_run() will then use in preference to the Bézier form: it
+ * makes DAC coordinates with integer arithmetic alone, for boards without a
+ * fast FPU. Its points are within NURBS_FIXED_ERROR DAC units of the exact
+ * surface before truncation, and within 1 unit of render_point()'s
+ * otherwise; a sample that render_point() rounds into the next patch or
+ * trace can be off by its step. */
+void render_compile_fixed(void);
+
+/* Tessellate every patch into a grid of points, in DAC units, split
+ * adaptively until interpolating between them is within max_error DAC
+ * units of the surface after scaling and clamping. The patches are shared
+ * out among the given number of threads, and each one's grid is used as
+ * soon as it's built: from then on, render_point() on that patch is a
+ * lookup and a bilinear interpolation. render_run() still prefers the
+ * Bézier form, which is quicker for runs, if it has been compiled. Other
+ * threads may go on rendering meanwhile: a patch's old grid is only freed
+ * once none of them can still be using it. */
+void render_tessellate(float max_error, int threads);
+
+/* Rebuild the grid for a single patch. */
+void render_tessellate_patch(int patch, float max_error);
+
+struct render_cache_stats {
+	int patches;		/* patches with a grid */
+	int points;		/* grid points over all of them */
+	size_t bytes;		/* memory used by the grids */
+	float max_error;	/* worst error measured, in DAC units */
+};
+
+void render_cache_stats(struct render_cache_stats *out);
+
+/* Space points evenly along each shape by arc length, rather than evenly
+ * in u, using a table of the given number of entries per shape. Since
+ * runs are then no longer equal steps in u, render_run() evaluates every
+ * point like render_point(). This and render_schedule() replace each
+ * other. */
+void render_arclen(int entries);
+
+/* Instead, reparameterize each shape so that it's drawn as fast as a
+ * scanner can follow it: moving at most max_speed DAC units per point, and
+ * changing velocity by at most max_accel DAC units per point per point.
+ * Points spread out along straight runs and bunch up only where a shape
+ * bends sharply or turns a corner. The schedule only divides up the points
+ * each trace is given; render_schedule_stats() says how many it needs. */
+void render_schedule(float max_speed, float max_accel, int entries);
+
+struct render_schedule_stats {
+	int patches;		/* patches with a schedule */
+	double points;		/* fewest points per trace within the
+				 * limits, over all patches */
+	double uniform_points;	/* the same, sampling evenly in u */
+};
+
+void render_schedule_stats(struct render_schedule_stats *out);
+
 void render_point(struct etherdream_point *pt, float u, float redraw_count);
 
+/* Render n points, the same as calling render_point() on each u[i] to
+ * within a DAC unit. Runs of samples that fall in the same patch are
+ * evaluated together, with nurbs_sweep_evaluate_batch(). */
+void render_points(struct etherdream_point *pts, const float *u, int n,
+                   float redraw_count);
+
+/* Render n consecutive samples of a pattern of period points, starting at
+ * sample p: pts[i] is render_point() at u = ((p + i) % period) / period.
+ * Once render_compile() has been called, runs of points within a patch
+ * are produced by forward differencing; until then, or once u has been
+ * reparameterized, they're evaluated as render_points() does. */
+void render_run(struct etherdream_point *pts, int n, int p, int period,
+                float redraw_count);
+
+/* Thread counts given to render_pattern(), render_tessellate() and the
+ * ILDA functions are capped at this, as each thread's job is kept on the
+ * caller's stack. */
+#define RENDER_MAX_THREADS	64
+
+/* Render a whole pattern, pts[0] through pts[period - 1], splitting the
+ * work across the given number of threads. */
+void render_pattern(struct etherdream_point *pts, int period,
+                    float redraw_count, int threads);
+
+/* Render n points of a single sweep that isn't part of the scene, such as
+ * one from a feed: pts[i] is the sweep at v = i / n, tracing the line
+ * redraw_count times over the n points, like a patch of the pattern. */
+void render_sweep(struct etherdream_point *pts, int n,
+                  const struct nurbs_sweep *s, float redraw_count);
+
+/* Draw several patches of the pattern together as one frame of n points:
+ * the patch at each of u[0] to u[count - 1], traced once each at its own
+ * v. The frame planner (see plan.h) orders them, picks where each starts
+ * and which way round it goes, and fills the moves between them with as
+ * few blanked points as the scanner allows, starting from *beam and
+ * leaving it where the frame ends. The rest of the points are drawn lit.
+ * count is at most PLAN_MAX_SHAPES. */
+struct render_frame_stats {
+	int lit;		/* points drawing shapes */
+	int blank;		/* blanked points */
+	int in_order_blank;	/* blanked points drawing them as given,
+				 * each from the start of its line */
+};
+
+void render_frame(struct etherdream_point *pts, int n, const float *u,
+                  int count, const struct plan_scanner *scanner,
+                  struct xy *beam, struct render_frame_stats *st);
+
 #endif
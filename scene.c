@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scene.h"
+
+/* Scene files
+ *
+ * One patch per line, drawn in order; blank lines and anything after a #
+ * are ignored.
+ *
+ *   move <shape> <ticks> <x0> <y0> <x1> <y1> <x2> <y2> <x3> <y3>
+ *       Sweep the shape along a path, translating it by (x, y) at each
+ *       control point.
+ *
+ *   spin <shape> <ticks> <a0> <a1> <a2> <a3>
+ *       Sweep the shape round the origin, rotating it by each angle in
+ *       degrees at each control point.
+ *
+ * A patch with more ticks takes a bigger share of the pattern.
+ */
+
+#define LINE_MAX_LEN	512
+
+static struct nurbs_sweep make_move(const struct nurbs_line *line,
+                                    const float path[2 * NURBS_T_POINTS]) {
+	struct nurbs_sweep out = { .line = line };
+
+	for (int j = 0; j < NURBS_T_POINTS; j++) {
+		out.path[j] = (struct nurbs_affine){
+			1, 0,
+			0, 1,
+			path[2 * j], path[2 * j + 1]
+		};
+	}
+
+	return out;
+}
+
+static struct nurbs_sweep make_spin(const struct nurbs_line *line,
+                                    const float angles[NURBS_T_POINTS]) {
+	struct nurbs_sweep out = { .line = line };
+
+	for (int j = 0; j < NURBS_T_POINTS; j++) {
+		float tsin = sinf(angles[j] * M_PI / 180);
+		float tcos = cosf(angles[j] * M_PI / 180);
+
+		out.path[j] = (struct nurbs_affine){
+			tcos, -tsin,
+			tsin, tcos,
+			0, 0
+		};
+	}
+
+	return out;
+}
+
+/* parse_line(line, shapes, out)
+ *
+ * Parse one line of a scene file. Returns 1 if it describes a patch, 0
+ * if it's blank, and -1 if it's invalid.
+ */
+static int parse_line(char *line, const struct nurbs_library *shapes,
+                      struct scene_patch *out) {
+	char *hash = strchr(line, '#');
+	if (hash)
+		*hash = 0;
+
+	char kind[16], name[64];
+	float a[2 * NURBS_T_POINTS];
+	int ticks, used;
+	int fields = sscanf(line, " %15s %63s %d%n", kind, name, &ticks, &used);
+	if (fields <= 0)
+		return 0;
+	if (fields < 3 || ticks < 1)
+		return -1;
+
+	int want;
+	if (!strcmp(kind, "move"))
+		want = 2 * NURBS_T_POINTS;
+	else if (!strcmp(kind, "spin"))
+		want = NURBS_T_POINTS;
+	else
+		return -1;
+
+	char *s = line + used, *end;
+	for (int i = 0; i < want; i++, s = end) {
+		a[i] = strtof(s, &end);
+		if (end == s)
+			return -1;
+	}
+
+	if (strspn(s, " \t\r\n") != strlen(s))
+		return -1;
+
+	out->shape = nurbs_library_find(shapes, name);
+	if (out->shape < 0)
+		return -1;
+
+	const struct nurbs_line *l = nurbs_library_line(shapes, out->shape);
+	out->sweep = want == NURBS_T_POINTS ? make_spin(l, a)
+	                                    : make_move(l, a);
+	out->ticks = ticks;
+	return 1;
+}
+
+struct scene *scene_load(const char *filename,
+                         const struct nurbs_library *shapes) {
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		perror(filename);
+		return NULL;
+	}
+
+	/* Parse into a growing array first, then pack it into the block */
+	struct scene_patch *list = NULL;
+	int count = 0, ticks = 0, lineno = 0;
+	char line[LINE_MAX_LEN];
+
+	while (fgets(line, sizeof line, f)) {
+		lineno++;
+
+		struct scene_patch p;
+		int res = parse_line(line, shapes, &p);
+		if (res > 0 && p.ticks > SCENE_MAX_TICKS - ticks)
+			res = -1;
+		if (res < 0) {
+			printf("%s:%d: invalid patch\n", filename, lineno);
+			goto bail;
+		}
+		if (!res)
+			continue;
+
+		if (count % 64 == 0) {
+			void *grown = realloc(list,
+			                      (count + 64) * sizeof *list);
+			if (!grown) {
+				printf("oom in scene_load\n");
+				goto bail;
+			}
+			list = grown;
+		}
+
+		p.start = ticks;
+		ticks += p.ticks;
+		list[count++] = p;
+	}
+
+	if (!count) {
+		printf("%s: no patches\n", filename);
+		goto bail;
+	}
+
+	size_t size = sizeof (struct scene) + count * sizeof *list
+	            + ticks * sizeof (int);
+	struct scene *sc = malloc(size);
+	if (!sc) {
+		printf("oom in scene_load\n");
+		goto bail;
+	}
+
+	sc->patches = count;
+	sc->ticks = ticks;
+	sc->size = size;
+	memcpy(sc->patch, list, count * sizeof *list);
+
+	int *tick_patch = (int *)(sc->patch + count);
+	for (int i = 0; i < count; i++)
+		for (int t = 0; t < list[i].ticks; t++)
+			tick_patch[list[i].start + t] = i;
+	sc->tick_patch = tick_patch;
+
+	printf("scene: %d patches, %d ticks\n", count, ticks);
+	free(list);
+	fclose(f);
+	return sc;
+
+bail:
+	free(list);
+	fclose(f);
+	return NULL;
+}
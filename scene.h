@@ -0,0 +1,34 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stddef.h>
+
+#include "nurbs.h"
+
+/* A scene: the patches of a pattern in the order they're drawn, each
+ * given a share of the pattern in proportion to its ticks. It's loaded
+ * from a text file (see scene.c for the format) into a single block, with
+ * tick_patch[] giving the patch drawn during each tick so that finding
+ * the patch for a point in the pattern is one lookup. The sweeps point at
+ * lines in the shape library, which has to outlive the scene. Release it
+ * with free(). */
+#define SCENE_MAX_TICKS (1 << 20)
+
+struct scene_patch {
+	struct nurbs_sweep sweep;
+	int shape;		/* index in the library */
+	int start, ticks;
+};
+
+struct scene {
+	int patches;
+	int ticks;		/* over all patches */
+	const int *tick_patch;
+	size_t size;
+	struct scene_patch patch[];
+};
+
+struct scene *scene_load(const char *filename,
+                         const struct nurbs_library *shapes);
+
+#endif
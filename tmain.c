@@ -1,10 +1,18 @@
 #define _GNU_SOURCE
 
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "etherdream.h"
+#include "feed.h"
+#include "ilda.h"
+#include "instrument.h"
+#include "pipeline.h"
 #include "render.h"
 
 #define PPS             30000
@@ -14,8 +22,452 @@
 #define PATTERN_POINTS  (PPS * PATTERN_SECONDS)
 #define PER_FRAME       1000
 
-int main() {
+#define REDRAW_COUNT    (PATTERN_SECONDS * REFRESH_HZ)
+
+#define REPLAY_CAP_MB   64
+#define STATS_SECONDS   5
+#define MAX_REDRAWS     16
+#define ARCLEN_ENTRIES  4096
+#define SCHEDULE_ENTRIES 4096
+#define FEED_LATENCY_MS	100
+
+/* Scanner model for planning frames, unless -V gives one */
+#define FRAME_SPEED	2000
+#define FRAME_ACCEL	200
+#define FRAME_DWELL	2
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-r] [-c cap_mb] [-j threads] [-p ms] "
+	        "[-a] [-R counts] [-L] [-V speed,accel] [-F]\n"
+	        "       [-o file.ild [-d seconds]] [-i file.ild] [-s file]\n"
+	        "       [-w] [-f name] [-S shapes]\n"
+	        "  -r  render the pattern once up front and replay it\n"
+	        "  -c  memory cap for the replay buffer, or for the file\n"
+	        "      played with -i, in MB (default %d)\n"
+	        "  -j  threads to render the replay buffer with (at most %d)\n"
+	        "  -p  render on a separate thread, this far ahead\n"
+	        "  -a  drive every DAC found, each from its own thread\n"
+	        "  -R  comma-separated redraw counts per pattern, each above\n"
+	        "      0 and at most %d, assigned to DACs in turn\n"
+	        "      (default %d)\n"
+	        "  -L  space points evenly along each shape by arc length\n"
+	        "  -V  pace each shape for a scanner that moves at most speed\n"
+	        "      DAC units per point, and changes velocity by at most\n"
+	        "      accel per point\n"
+	        "  -F  render with integer arithmetic only\n"
+	        "  -o  render the pattern to an ILDA file and exit, one frame\n"
+	        "      per trace, using every thread\n"
+	        "  -d  seconds of the pattern to render with -o (default %d)\n"
+	        "  -i  play an ILDA file instead of the pattern\n"
+	        "  -s  load the pattern from a scene file\n"
+	        "  -w  reload the shapes and scene whenever their files\n"
+	        "      change (not with -r)\n"
+	        "  -f  draw what other processes send to the shared-memory\n"
+	        "      feed of this name (e.g. %s) on the first DAC, and\n"
+	        "      the pattern whenever there's nothing new\n"
+	        "  -S  draw this many copies of the pattern, spread evenly\n"
+	        "      through it, in each trace, ordered to spend as few\n"
+	        "      points as possible moving between them blanked; the\n"
+	        "      scanner is as given by -V, or %d,%d by default\n",
+	        name, REPLAY_CAP_MB, RENDER_MAX_THREADS, PATTERN_POINTS,
+	        REDRAW_COUNT, PATTERN_SECONDS,
+	        FEED_DEFAULT_NAME, FRAME_SPEED, FRAME_ACCEL);
+	exit(1);
+}
+
+/* parse_redraw(s)
+ *
+ * A redraw count given to -R, or -1 if it isn't one the renderer can
+ * draw: the fixed-point path rounds it to Q16, so it can't be below
+ * 1 / 65536, and each trace needs at least one point of the pattern.
+ */
+static float parse_redraw(const char *s) {
+	char *end;
+	float r = strtof(s, &end);
+	if (end == s || *end || !isfinite(r) || r < 1.0f / 65536
+	    || r > PATTERN_POINTS)
+		return -1;
+	return r;
+}
+
+/* replay_init(cap_mb, threads)
+ *
+ * Render the whole pattern into a buffer to be replayed by the output
+ * loop. Returns NULL if it would take more than cap_mb megabytes, in which
+ * case points are rendered live instead.
+ */
+static struct etherdream_point *replay_init(long cap_mb, int threads) {
+	size_t size = PATTERN_POINTS * sizeof (struct etherdream_point);
+	if (size > (size_t)cap_mb << 20) {
+		printf("Replay buffer needs %zu KB, over the %ld MB cap; "
+		       "rendering live\n", size >> 10, cap_mb);
+		return NULL;
+	}
+
+	struct etherdream_point *pattern = malloc(size);
+	if (!pattern) {
+		printf("oom allocating replay buffer; rendering live\n");
+		return NULL;
+	}
+
+	render_pattern(pattern, PATTERN_POINTS, REDRAW_COUNT, threads);
+	printf("Replay buffer: %d points, %zu KB, %d threads\n",
+	       PATTERN_POINTS, size >> 10, threads);
+	return pattern;
+}
+
+/* export(filename, seconds, redraw_count, threads)
+ *
+ * Render the given length of the pattern to an ILDA file, one frame per
+ * trace of the shapes.
+ */
+static int export(const char *filename, float seconds, float redraw_count,
+                  int threads) {
+	int frame_points = PATTERN_POINTS / redraw_count;
+	if (frame_points < 1)
+		frame_points = 1;
+	if (frame_points > ILDA_MAX_POINTS)
+		frame_points = ILDA_MAX_POINTS;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int points = seconds * PPS;
+	if (ilda_export(filename, points, PATTERN_POINTS, redraw_count,
+	                frame_points, threads) < 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed = end.tv_sec - start.tv_sec
+	               + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Exported %d points to %s in %.2f s (%.0f kpps), %d threads\n",
+	       points, filename, elapsed, points / elapsed / 1e3, threads);
+	return 0;
+}
+
+/* One DAC's output stream. Everything here belongs to its output thread;
+ * the patch set and replay buffer are shared but never written after
+ * startup, so the threads don't share any locks. */
+struct output {
+	int index;
+	struct etherdream *d;
+	pthread_t thread;
+
+	int p;
+	float redraw_count;
+	const struct etherdream_point *pattern;
+	int pattern_points;
+	int ahead_ms;
+	struct pipeline *pl;
+	int block_points;
+
+	/* With shapes > 1, each block is a planned frame of that many
+	 * shapes; see render_frame() */
+	int shapes;
+	struct plan_scanner scanner;
+	struct xy beam;
+	unsigned long frames, lit, in_order_lit, frame_points;
+
+	/* Blocks from the feed take priority over the pattern; sweeps are
+	 * rendered into feed_buf, points go to the DAC as they are */
+	struct feed *feed;
+	struct etherdream_point *feed_buf;
+
+#ifdef INSTRUMENT
+	struct instrument instr;
+#endif
+};
+
+/* fill_frame(o, pts, n)
+ *
+ * Draw the next frame of n points, with the patches at o->shapes points
+ * spread evenly through the pattern.
+ */
+static void fill_frame(struct output *o, struct etherdream_point *pts,
+                       int n) {
+	float u[PLAN_MAX_SHAPES];
+	for (int j = 0; j < o->shapes; j++) {
+		long long p = o->p + (long long)PATTERN_POINTS * j / o->shapes;
+		u[j] = (float)(p % PATTERN_POINTS) / PATTERN_POINTS;
+	}
+
+	struct render_frame_stats st;
+	INSTRUMENT_TIME(&o->instr.render,
+	                render_frame(pts, n, u, o->shapes, &o->scanner,
+	                             &o->beam, &st));
+	o->p = (o->p + n) % PATTERN_POINTS;
+
+	o->frames++;
+	o->frame_points += n;
+	o->lit += st.lit;
+	o->in_order_lit += st.in_order_blank < n ? n - st.in_order_blank : 0;
+
+	if (o->frame_points >= PPS * STATS_SECONDS) {
+		printf("DAC %d frames: %d shapes, %.1f%% of points lit "
+		       "(%.1f%% in the given order), %lu frames\n",
+		       o->index, o->shapes, 100.0 * o->lit / o->frame_points,
+		       100.0 * o->in_order_lit / o->frame_points, o->frames);
+		o->frame_points = o->lit = o->in_order_lit = 0;
+	}
+}
+
+static void fill_live(void *arg, struct etherdream_point *pts, int n) {
+	struct output *o = arg;
+	if (o->shapes > 1) {
+		fill_frame(o, pts, n);
+		return;
+	}
+
+	INSTRUMENT_TIME(&o->instr.render,
+	                render_run(pts, n, o->p, PATTERN_POINTS,
+	                           o->redraw_count));
+	o->p = (o->p + n) % PATTERN_POINTS;
+}
+
+static void print_pipeline_stats(struct output *o) {
+	struct pipeline_stats st;
+	pipeline_stats(o->pl, &st);
+	printf("DAC %d pipeline: depth %d/%d (min %d), %lu blocks, %lu slow, "
+	       "%lu underruns avoided, %lu stalls\n",
+	       o->index, st.depth, st.capacity, st.min_depth, st.blocks,
+	       st.slow, st.absorbed, st.stalls);
+}
+
+static void print_feed_stats(struct output *o) {
+	struct feed_stats st;
+	feed_stats(o->feed, &st);
+	printf("DAC %d feed: depth %d/%d, %lu blocks (latency %.1f ms mean, "
+	       "%.1f max), %lu stale, %lu invalid, %lu abandoned, "
+	       "%lu refused as full, %lu empty\n",
+	       o->index, st.depth, st.slots, st.consumed, st.mean_latency_ms,
+	       st.max_latency_ms, st.stale, st.invalid, st.abandoned, st.full,
+	       st.empty);
+}
+
+/* next_feed(o, n)
+ *
+ * Take the next block from the feed, if there is one, and return its
+ * points, setting *n to their count.
+ */
+static const struct etherdream_point *next_feed(struct output *o, int *n) {
+	const struct feed_item *it = feed_next(o->feed);
+	if (!it)
+		return NULL;
+
+	*n = it->count;
+	if (it->kind == FEED_POINTS)
+		return it->points;
+
+	render_sweep(o->feed_buf, *n, &it->sweep, it->redraw_count);
+	return o->feed_buf;
+}
+
+static void *output_thread_func(void *arg) {
+	struct output *o = arg;
+
+#ifdef INSTRUMENT
+	instrument_init(&o->instr);
+#endif
+
+	printf("DAC %d: connecting...\n", o->index);
+	if (etherdream_connect(o->d) < 0)
+		return NULL;
+
+	if (!o->pattern && o->ahead_ms > 0) {
+		o->pl = pipeline_start(o->block_points, o->ahead_ms, PPS,
+		                       fill_live, o);
+		if (!o->pl)
+			return NULL;
+	}
+
+	for (int frame = 1; ; frame++) {
+		struct etherdream_point buf[PER_FRAME];
+		const struct etherdream_point *out = buf;
+		int n = o->block_points;
+		const struct etherdream_point *fed = NULL;
+
+		if (o->feed && (fed = next_feed(o, &n))) {
+			out = fed;
+		} else if (o->pl) {
+			out = pipeline_next(o->pl);
+		} else if (o->pattern) {
+			/* Hand over a slice of the replay buffer directly */
+			out = o->pattern + o->p;
+			if (n > o->pattern_points - o->p)
+				n = o->pattern_points - o->p;
+			o->p = (o->p + n) % o->pattern_points;
+		} else {
+			fill_live(o, buf, n);
+		}
+
+		int res;
+		INSTRUMENT_TIME(&o->instr.write,
+		                res = etherdream_write(o->d, out, n, PPS, 1));
+		if (res != 0) {
+			INSTRUMENT_COUNT(o->instr.write_errors, 1);
+			printf("DAC %d: write %d\n", o->index, res);
+		} else {
+			INSTRUMENT_COUNT(o->instr.points, n);
+		}
+
+		if (fed)
+			feed_release(o->feed);
+
+		if (o->feed && frame % (PPS * STATS_SECONDS / PER_FRAME) == 0)
+			print_feed_stats(o);
+
+		if (o->pl && !fed) {
+			pipeline_release(o->pl);
+			if (frame % (PPS * STATS_SECONDS / PER_FRAME) == 0)
+				print_pipeline_stats(o);
+		}
+
+		INSTRUMENT_TIME(&o->instr.wait,
+		                etherdream_wait_for_ready(o->d));
+
+#ifdef INSTRUMENT
+		if (instrument_due(&o->instr, STATS_SECONDS))
+			instrument_dump(&o->instr, stderr, o->index, PPS);
+#endif
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int replay = 0, ahead_ms = 0, all = 0, even = 0, integer = 0;
+	int watch = 0, shapes = 1;
+	float max_speed = 0, max_accel = 0;
+	const char *export_file = NULL, *import_file = NULL;
+	const char *scene_file = NULL, *feed_name = NULL;
+	float export_seconds = PATTERN_SECONDS;
+	long cap_mb = REPLAY_CAP_MB;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	float redraws[MAX_REDRAWS] = { REDRAW_COUNT };
+	int nredraws = 1;
+
+	int opt;
+	const char *opts = "rc:j:p:aR:LV:Fo:d:i:s:wf:S:";
+	while ((opt = getopt(argc, argv, opts)) != -1) {
+		switch (opt) {
+		case 'r':
+			replay = 1;
+			break;
+		case 'c':
+			cap_mb = atol(optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > RENDER_MAX_THREADS)
+				usage(argv[0]);
+			break;
+		case 'p':
+			ahead_ms = atoi(optarg);
+			break;
+		case 'a':
+			all = 1;
+			break;
+		case 'R':
+			nredraws = 0;
+			for (char *s = strtok(optarg, ",");
+			     s && nredraws < MAX_REDRAWS;
+			     s = strtok(NULL, ",")) {
+				float r = parse_redraw(s);
+				if (r < 0)
+					usage(argv[0]);
+				redraws[nredraws++] = r;
+			}
+			if (!nredraws)
+				usage(argv[0]);
+			break;
+		case 'L':
+			even = 1;
+			break;
+		case 'V':
+			if (sscanf(optarg, "%f,%f", &max_speed, &max_accel) != 2
+			    || max_speed <= 0 || max_accel <= 0)
+				usage(argv[0]);
+			break;
+		case 'F':
+			integer = 1;
+			break;
+		case 'o':
+			export_file = optarg;
+			break;
+		case 'd':
+			export_seconds = atof(optarg);
+			if (export_seconds <= 0)
+				usage(argv[0]);
+			break;
+		case 'i':
+			import_file = optarg;
+			break;
+		case 's':
+			scene_file = optarg;
+			break;
+		case 'w':
+			watch = 1;
+			break;
+		case 'f':
+			feed_name = optarg;
+			break;
+		case 'S':
+			shapes = atoi(optarg);
+			if (shapes < 1 || shapes > PLAN_MAX_SHAPES)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* The replay buffer is rendered once, from the show as it is then */
+	if (watch && replay) {
+		fprintf(stderr, "%s: -w can't be used with -r\n", argv[0]);
+		usage(argv[0]);
+	}
+
+	/* One per processor by default, within what -j allows */
+	if (threads < 1)
+		threads = 1;
+	if (threads > RENDER_MAX_THREADS)
+		threads = RENDER_MAX_THREADS;
+
 	render_init();
+	if (scene_file && render_load_scene(scene_file) < 0)
+		return 1;
+	render_compile();
+	if (integer)
+		render_compile_fixed();
+	if (even)
+		render_arclen(ARCLEN_ENTRIES);
+	if (max_speed > 0) {
+		struct render_schedule_stats st;
+		render_schedule(max_speed, max_accel, SCHEDULE_ENTRIES);
+		render_schedule_stats(&st);
+		printf("Schedule: traces need %.0f points (%.0f sampled "
+		       "evenly), have %d\n", st.points, st.uniform_points,
+		       (int)(PATTERN_POINTS / redraws[0]));
+	}
+
+	if (export_file)
+		return export(export_file, export_seconds, redraws[0],
+		              threads) < 0;
+
+	struct etherdream_point *pattern = NULL;
+	int pattern_points = PATTERN_POINTS;
+	if (import_file) {
+		pattern = ilda_load(import_file, &pattern_points,
+		                    (size_t)cap_mb << 20, threads);
+		if (!pattern)
+			return 1;
+		printf("%s: %d points\n", import_file, pattern_points);
+	} else if (replay && shapes == 1) {
+		pattern = replay_init(cap_mb, threads);
+	}
+
+	if (watch && render_watch() < 0)
+		return 1;
+
 	etherdream_lib_start();
 
 	/* Sleep for a bit over a second, to ensure that we see all DACs */
@@ -31,32 +483,70 @@ int main() {
 		printf("DAC %d: Ether Dream %06lx\n", i,
 		       etherdream_get_id(etherdream_get(i)));
 
-	struct etherdream *d = etherdream_get(0);
-
-	printf("Connecting...\n");
-	if (etherdream_connect(d) < 0)
+	int outputs = all ? dac_count : 1;
+	struct output *o = calloc(outputs, sizeof *o);
+	if (!o)
 		return 1;
 
-	int p = 0;
-	while (1) {
-		struct etherdream_point buf[PER_FRAME];
+	/* Stagger each DAC's phase evenly through the pattern */
+	for (int i = 0; i < outputs; i++) {
+		o[i] = (struct output){
+			.index = i,
+			.d = etherdream_get(i),
+			.p = (long long)pattern_points * i / outputs,
+			.redraw_count = redraws[i % nredraws],
+			.ahead_ms = ahead_ms,
+			.block_points = PER_FRAME,
+			.shapes = import_file ? 1 : shapes,
+			.scanner = {
+				max_speed > 0 ? max_speed : FRAME_SPEED,
+				max_speed > 0 ? max_accel : FRAME_ACCEL,
+				FRAME_DWELL
+			},
+		};
 
-		for (int i = 0; i < PER_FRAME; i++) {
-			render_point(
-				&buf[i],
-				(float)p / PATTERN_POINTS,
-				PATTERN_SECONDS * REFRESH_HZ
-			);
+		/* A planned frame is one trace of the pattern */
+		if (o[i].shapes > 1) {
+			int n = PATTERN_POINTS / o[i].redraw_count;
+			o[i].block_points = n < 1 ? 1
+			                  : (n > PER_FRAME ? PER_FRAME : n);
+		}
 
-			p = (p + 1) % PATTERN_POINTS;
+		if (feed_name && i == 0) {
+			o[i].feed = feed_create(feed_name, FEED_DEFAULT_SLOTS,
+			                        FEED_LATENCY_MS);
+			o[i].feed_buf = malloc(FEED_MAX_POINTS
+			                       * sizeof *o[i].feed_buf);
+			if (!o[i].feed || !o[i].feed_buf)
+				return 1;
+			printf("Feed %s: %d blocks of up to %d points\n",
+			       feed_name, FEED_DEFAULT_SLOTS, FEED_MAX_POINTS);
 		}
 
-		int res = etherdream_write(d, buf, PER_FRAME, PPS, 1);
-		if (res != 0)
-			printf("write %d\n", res);
+		/* The replay buffer only holds the default pattern, but a
+		 * file is played the same on every DAC */
+		if ((o[i].redraw_count == REDRAW_COUNT && o[i].shapes == 1)
+		    || import_file) {
+			o[i].pattern = pattern;
+			o[i].pattern_points = pattern_points;
+		}
+	}
 
-		etherdream_wait_for_ready(d);
+	if (outputs == 1) {
+		output_thread_func(&o[0]);
+		return 1;
 	}
 
-	return 0;
+	for (int i = 0; i < outputs; i++) {
+		if (pthread_create(&o[i].thread, NULL, output_thread_func,
+		                   &o[i])) {
+			printf("couldn't start output thread %d\n", i);
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < outputs; i++)
+		pthread_join(o[i].thread, NULL);
+
+	return 1;
 }
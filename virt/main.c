@@ -15,16 +15,34 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#ifndef HEADLESS
 #include <SDL/SDL.h>
 #include <SDL/SDL_opengl.h>
+#endif
 
 #include <protocol.h>
 
@@ -32,18 +50,31 @@
 
 #define WINDOW_SIZE		600
 
-#define POINT_RATE		30000
+#define MAX_POINT_RATE		100000
 #define PERSIST_MS		100
 
 #define DAC_BUFFER_POINTS	1800
+#define RATE_QUEUE		16
+#define PLAYBACK_TICK_US	1000
+
+#define PLAYBACK_FLAG_UNDERFLOW	0x02
+
+#define DAC_PORT		7765
+#define BROADCAST_PORT		7654
+#define BROADCAST_SRC_PORT	7655
+
+#define IN_BUF_SIZE		65536
+#define OUT_BUF_SIZE		4096
+#define MAX_REPLY		32
+#define MAX_EVENTS		64
 
 #define FPS			60
 #define POV_FRAMES		(FPS * PERSIST_MS / 1000)
-#define MAX_DATA_PER_FRAME	(POINT_RATE * 2 / FPS)
+#define MAX_DATA_PER_FRAME	(MAX_POINT_RATE * 2 / FPS)
+#define FRAME_RING		(POV_FRAMES * 4)
 
-#define HOLDING(m) \
-	for (int _guard = (pthread_mutex_lock(m), 0); !_guard; \
-	     pthread_mutex_unlock(m)) while (!_guard++)
+#define LOAD(v_) __atomic_load_n(&(v_), __ATOMIC_ACQUIRE)
+#define STORE(v_, x_) __atomic_store_n(&(v_), (x_), __ATOMIC_RELEASE)
 
 #define CHK(call_, e_) if ((e_) < 0) { perror(call_); exit(1); }
 #define PACKED __attribute__((packed))
@@ -52,125 +83,315 @@
 struct frame {
 	struct dac_point data[MAX_DATA_PER_FRAME] PACKED;
 	int size;
-	long long last_copy;
+	long long start, end;
+};
+
+/* An event loop serving some of the DACs, on its own thread. Each fd is
+ * tagged with its DAC's index, shifted left one, with the low bit set for
+ * a connection and clear for a listener. */
+enum { LOOP_IN = 1, LOOP_OUT = 2 };
+
+struct loop {
+	pthread_t thread;
+#ifdef __linux__
+	int epfd;
+#else
+	int nfds;
+	struct pollfd *fds;
+	unsigned long *tags;
+#endif
 };
 
-struct {
+/* One virtual DAC.
+ *
+ * The point buffer, rate queue and frame history are single-producer,
+ * single-consumer rings indexed by free-running counters, each written
+ * by one side only. The DAC's event loop produces points and rates; the
+ * playback thread consumes them and produces frames, which the display
+ * consumes.
+ *
+ * While the DAC is running, the playback thread owns the consume side
+ * and the rest of the playback state. Otherwise the event loop does. */
+struct dac {
+	int index;
+	int listenfd, udpfd;
+	struct loop *loop;
+
+	/* The current connection, if any; owned by the event loop */
+	int fd;
+	int in_len, out_len;
+	int points_left, points_dropped;
+	unsigned long stop_tick;
+	char in[IN_BUF_SIZE];
+	char out[OUT_BUF_SIZE];
+
 	enum { DAC_IDLE = 0, DAC_PREPARED = 1, DAC_RUNNING = 2 } dac_state;
+	int point_rate;
+	int playback_flags;
+	int point_count;
+
+	/* Owned by the playback thread */
+	long long base, played;
 
 	struct dac_point point_buf[DAC_BUFFER_POINTS] PACKED;
-	int point_buf_produce, point_buf_consume;
+	unsigned long point_produce __attribute__((aligned(64)));
+	unsigned long point_consume __attribute__((aligned(64)));
+
+	int rate_queue[RATE_QUEUE];
+	unsigned long rate_produce __attribute__((aligned(64)));
+	unsigned long rate_consume __attribute__((aligned(64)));
+
+	/* Only the DAC on display keeps a frame history */
+	struct frame *frames;
+	unsigned long frame_produce __attribute__((aligned(64)));
+	unsigned long frame_consume __attribute__((aligned(64)));
+
+	/* Running totals for the stats output; unlike the rest, these
+	 * survive across connections. */
+	struct {
+		long long accepted;
+		long long underruns;
+		long long naks;
+	} stats;
+};
 
-	struct frame frames[POV_FRAMES];
-	int store_frame;
+struct dac *dacs;
+int dac_count = 1;
 
-	int point_count;
-} s;
+/* Counts passes of the playback thread over the DACs */
+unsigned long playback_ticks;
 
-pthread_mutex_t s_lock;
+/* If set, every point DAC 0 accepts from the network is appended here */
+FILE *dump_file;
 
-/* render()
+/* buffer_fullness(d)
+ *
+ * Return the number of points in the buffer. Either side of the ring gets
+ * an exact answer; anyone else gets a recent one.
+ */
+static int buffer_fullness(struct dac *d) {
+	unsigned long consume = LOAD(d->point_consume);
+	int fullness = LOAD(d->point_produce) - consume;
+	return MIN(fullness, DAC_BUFFER_POINTS);
+}
+
+#ifndef HEADLESS
+
+/* render(d)
  *
  * Render all buffered points to the screen.
  */
-static void render(void) {
-	/* Start with the oldest frame, up through newest */
-	int next = (s.store_frame + 1) % POV_FRAMES;
+static void render(struct dac *d) {
+	long long now = microseconds();
+	unsigned long produce = LOAD(d->frame_produce);
+	unsigned long oldest = d->frame_consume;
+
+	/* Hand back frames that have faded out. The newest one stays ours
+	 * even so, since points are still being added to it. */
+	while (oldest < produce
+	       && now - LOAD(d->frames[oldest % FRAME_RING].end)
+	          > PERSIST_MS * 1000)
+		oldest++;
 
-	/* Draw all active points */
-	for (int i = 0; i < POV_FRAMES; i++) {
-		struct frame *f = &s.frames[(next + i) % POV_FRAMES];
+	STORE(d->frame_consume, oldest);
+
+	/* Draw all active points, oldest first */
+	for (unsigned long i = oldest; i <= produce; i++) {
+		struct frame *f = &d->frames[i % FRAME_RING];
+		if (now - LOAD(f->end) > PERSIST_MS * 1000)
+			continue;
 
 		const int stride = sizeof (struct dac_point);
 		glColorPointer(3, GL_UNSIGNED_SHORT, stride, &f->data->r);
 		glVertexPointer(2, GL_SHORT, stride, &f->data->x);
-		glDrawArrays(GL_LINE_STRIP, 0, f->size); 
+		glDrawArrays(GL_LINE_STRIP, 0, LOAD(f->size));
 	}
-
-	/* Advance the frame buffer */
-	s.frames[next].size = 0;
-	s.frames[next].last_copy = s.frames[s.store_frame].last_copy;
-	s.store_frame = next;
 }
+#endif
 
-/* fill_status(status)
+/* fill_status(d, status)
  *
  * Fill in a struct dac_status with the current state of things.
  */
-void fill_status(struct dac_status *status) {
+void fill_status(struct dac *d, struct dac_status *status) {
 	memset(status, 0, sizeof *status);
-	status->playback_state = s.dac_state;
-	status->buffer_fullness = (s.point_buf_produce - s.point_buf_consume
-	                          + DAC_BUFFER_POINTS) % DAC_BUFFER_POINTS;
-	status->point_rate = (s.dac_state == DAC_RUNNING) ? 30000 : 0;
-	status->point_count = s.point_count;
+	int state = LOAD(d->dac_state);
+	status->playback_state = state;
+	status->buffer_fullness = buffer_fullness(d);
+	status->playback_flags = LOAD(d->playback_flags);
+	status->point_rate = (state == DAC_RUNNING) ? LOAD(d->point_rate) : 0;
+	status->point_count = LOAD(d->point_count);
 }
 
 /* broadcast_thread_func(arg)
  *
- * Send out periodic broadcasts announcing our presence.
+ * Send out periodic broadcasts announcing each DAC's presence.
  */
 void *broadcast_thread_func(void *arg) {
-	int udpfd = *(int *)arg;
 	const struct sockaddr_in dest_addr = {
 		.sin_family = AF_INET,
 		.sin_addr.s_addr = htonl(INADDR_ANY),
-		.sin_port = htons(7654)
+		.sin_port = htons(BROADCAST_PORT)
 	};
 
 	while (1) {
-		struct dac_broadcast broadcast = {
-			.mac_address = { 0x55, 0x55, 0x55, 0x55, 0x55, 0x55 },
-			.hw_revision = 4321,
-			.sw_revision = 2,
-			.buffer_capacity = DAC_BUFFER_POINTS,
-			.max_point_rate = POINT_RATE,
-		};
-
-		HOLDING(&s_lock)
-			fill_status(&broadcast.status);
-
-		CHK("sendto", sendto(udpfd, &broadcast, sizeof broadcast, 0,
-		                     (const struct sockaddr *)&dest_addr,
-		                     sizeof dest_addr));
+		for (int i = 0; i < dac_count; i++) {
+			struct dac *d = &dacs[i];
+
+			/* DAC 0 keeps the simulator's original ID */
+			struct dac_broadcast broadcast = {
+				.mac_address = { 0x55, 0x55, 0x55, 0x55,
+				                 0x55 ^ (i >> 8),
+				                 0x55 ^ (i & 0xff) },
+				.hw_revision = 4321,
+				.sw_revision = 2,
+				.buffer_capacity = DAC_BUFFER_POINTS,
+				.max_point_rate = MAX_POINT_RATE,
+			};
+
+			fill_status(d, &broadcast.status);
+
+			CHK("sendto", sendto(d->udpfd, &broadcast,
+			                     sizeof broadcast, 0,
+			                     (struct sockaddr *)&dest_addr,
+			                     sizeof dest_addr));
+		}
 
 		sleep(1);
 	}
 }
 
-/* check_write(fd, vbuf, len)
+#ifdef __linux__
+static void loop_init(struct loop *l, int max_fds) {
+	l->epfd = epoll_create1(0);
+	CHK("epoll_create1", l->epfd);
+}
+
+/* loop_watch(l, fd, events, tag)
  *
- * Write all of vbuf to a socket and assert that the write succeeds.
+ * Start or change watching fd for LOOP_IN and/or LOOP_OUT events, or
+ * stop watching it if events is 0.
  */
-static void check_write(int fd, const void *vbuf, size_t len) {
-	const char *buf = vbuf;
-	while (len) {
-		int res = write(fd, buf, len);
-		CHK("write", res);
-		len -= res;
-		buf += res;
+static void loop_watch(struct loop *l, int fd, int events,
+                       unsigned long tag) {
+	if (!events) {
+		CHK("epoll_ctl", epoll_ctl(l->epfd, EPOLL_CTL_DEL, fd, NULL));
+		return;
 	}
+
+	struct epoll_event ev = {
+		.events = (events & LOOP_IN ? EPOLLIN : 0)
+		        | (events & LOOP_OUT ? EPOLLOUT : 0),
+		.data.u64 = tag,
+	};
+
+	if (epoll_ctl(l->epfd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT)
+		CHK("epoll_ctl", epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev));
 }
 
-/* read_exactly(fd, vbuf, len)
+/* loop_wait(l, tags, events, max)
  *
- * Read exactly len bytes into buf.
+ * Wait for something to happen. Hangups and errors come back as LOOP_IN,
+ * so that the next read finds them.
  */
-static int read_exactly(int fd, void *vbuf, size_t len) {
-	char *buf = vbuf;
-	while (len) {
-		int res = read(fd, buf, len);
-		if (res < 0) {
-			perror("read");
-			return -1;
-		} else if (res == 0) {
-			return -1;
-		}
+static int loop_wait(struct loop *l, unsigned long *tags, int *events,
+                     int max) {
+	struct epoll_event ev[MAX_EVENTS];
+	int n = epoll_wait(l->epfd, ev, MIN(max, MAX_EVENTS), -1);
+	if (n < 0 && errno == EINTR)
+		return 0;
+	CHK("epoll_wait", n);
+
+	for (int i = 0; i < n; i++) {
+		tags[i] = ev[i].data.u64;
+		events[i] = (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)
+		             ? LOOP_IN : 0)
+		          | (ev[i].events & EPOLLOUT ? LOOP_OUT : 0);
+	}
 
-		len -= res;
-		buf += res;
+	return n;
+}
+#else
+/* Elsewhere, make do with poll() */
+static void loop_init(struct loop *l, int max_fds) {
+	l->fds = calloc(max_fds, sizeof *l->fds);
+	l->tags = calloc(max_fds, sizeof *l->tags);
+	assert(l->fds && l->tags);
+}
+
+static void loop_watch(struct loop *l, int fd, int events,
+                       unsigned long tag) {
+	int i = 0;
+	while (i < l->nfds && l->fds[i].fd != fd)
+		i++;
+
+	if (!events) {
+		l->nfds--;
+		l->fds[i] = l->fds[l->nfds];
+		l->tags[i] = l->tags[l->nfds];
+		return;
 	}
 
+	if (i == l->nfds)
+		l->nfds++;
+
+	l->fds[i] = (struct pollfd){
+		.fd = fd,
+		.events = (events & LOOP_IN ? POLLIN : 0)
+		        | (events & LOOP_OUT ? POLLOUT : 0),
+	};
+	l->tags[i] = tag;
+}
+
+static int loop_wait(struct loop *l, unsigned long *tags, int *events,
+                     int max) {
+	int res = poll(l->fds, l->nfds, -1);
+	if (res < 0 && errno == EINTR)
+		return 0;
+	CHK("poll", res);
+
+	int n = 0;
+	for (int i = 0; i < l->nfds && n < max; i++) {
+		int ev = l->fds[i].revents;
+		if (!ev)
+			continue;
+
+		tags[n] = l->tags[i];
+		events[n] = (ev & (POLLIN | POLLHUP | POLLERR) ? LOOP_IN : 0)
+		          | (ev & POLLOUT ? LOOP_OUT : 0);
+		n++;
+	}
+
+	return n;
+}
+#endif
+
+/* queue_out(d, vbuf, len)
+ *
+ * Queue up bytes to send on the connection. The caller has made sure
+ * there's room.
+ */
+static void queue_out(struct dac *d, const void *vbuf, size_t len) {
+	assert(d->out_len + len <= OUT_BUF_SIZE);
+	memcpy(d->out + d->out_len, vbuf, len);
+	d->out_len += len;
+}
+
+/* flush_out(d)
+ *
+ * Send as much queued output as the socket will take. Returns -1 if the
+ * connection failed.
+ */
+static int flush_out(struct dac *d) {
+	if (!d->out_len)
+		return 0;
+
+	int res = write(d->fd, d->out, d->out_len);
+	if (res < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+	memmove(d->out, d->out + res, d->out_len - res);
+	d->out_len -= res;
 	return 0;
 }
 
@@ -178,172 +399,473 @@ static int read_exactly(int fd, void *vbuf, size_t len) {
  *
  * Send a response (ACK or NAK, and status) back to the client.
  */
-static void send_resp(int fd, char resp, char cmd) {
+static void send_resp(struct dac *d, char resp, char cmd) {
 	struct dac_response response = { resp, cmd };
-	fill_status(&response.dac_status);
-	check_write(fd, &response, sizeof response);
+	if (resp != RESP_ACK)
+		__atomic_fetch_add(&d->stats.naks, 1, __ATOMIC_RELAXED);
+
+	fill_status(d, &response.dac_status);
+	queue_out(d, &response, sizeof response);
 }
 
-static void copy_points_into_frame(void) {
-	if (s.dac_state != DAC_RUNNING)
-		return;
+/* start_frame(d, now)
+ *
+ * Move on to a new frame in the history, unless the display is still
+ * using the slot it would go in. Returns NULL in that case.
+ */
+static struct frame *start_frame(struct dac *d, long long now) {
+	unsigned long next = d->frame_produce + 1;
+	if (next - LOAD(d->frame_consume) >= FRAME_RING)
+		return NULL;
+
+	struct frame *f = &d->frames[next % FRAME_RING];
+	f->size = 0;
+	f->start = f->end = now;
+	STORE(d->frame_produce, next);
+	return f;
+}
 
-	struct frame *f = s.frames + s.store_frame;
-	long long now = microseconds();
+/* play_points(d, n, now)
+ *
+ * Take n points off the buffer and copy them into the frame history for
+ * display. If the display has fallen behind, they're played but not shown.
+ */
+static void play_points(struct dac *d, int n, long long now) {
+	unsigned long consume = d->point_consume;
+	struct frame *f = NULL;
+
+	if (d->frames) {
+		f = &d->frames[d->frame_produce % FRAME_RING];
+		if (now - f->start >= 1000000 / FPS && start_frame(d, now))
+			f = &d->frames[d->frame_produce % FRAME_RING];
+	}
 
-	int fullness = s.point_buf_produce - s.point_buf_consume;
-	if (fullness < 0)
-		fullness += DAC_BUFFER_POINTS;
+	for (int done = 0; f && done < n; ) {
+		if (f->size == MAX_DATA_PER_FRAME && !(f = start_frame(d, now)))
+			break;
 
-	int n = MIN((now - f->last_copy) * POINT_RATE / 1000000,
-	            MIN(fullness, MAX_DATA_PER_FRAME - f->size));
+		int len = MIN(n - done, MAX_DATA_PER_FRAME - f->size);
+		int at = (consume + done) % DAC_BUFFER_POINTS;
+		int first = MIN(len, DAC_BUFFER_POINTS - at);
 
-	int first = MIN(n, DAC_BUFFER_POINTS - s.point_buf_consume);
-	
-	memcpy(f->data + f->size, s.point_buf + s.point_buf_consume,
-	       first * sizeof (struct dac_point));
-	memcpy(f->data + f->size + first, s.point_buf,
-	       (n - first) * sizeof (struct dac_point));
+		memcpy(f->data + f->size, d->point_buf + at,
+		       first * sizeof (struct dac_point));
+		memcpy(f->data + f->size + first, d->point_buf,
+		       (len - first) * sizeof (struct dac_point));
 
-	s.point_count += n;
-	s.point_buf_consume = (s.point_buf_consume + n) % DAC_BUFFER_POINTS;
-	f->last_copy = now;
-	f->size += n;
-
-	if (f->size == MAX_DATA_PER_FRAME) {
-		/* Advance the frame buffer */
-		int next = (s.store_frame + 1) % POV_FRAMES;
-		s.frames[next].size = 0;
-		s.frames[next].last_copy = s.frames[s.store_frame].last_copy;
-		s.store_frame = next;
+		STORE(f->size, f->size + len);
+		STORE(f->end, now);
+		done += len;
 	}
+
+	STORE(d->point_count, d->point_count + n);
+	STORE(d->point_consume, consume + n);
+}
+
+/* play_due(d, now)
+ *
+ * Play every point whose time has come. Points are due every 1/rate
+ * seconds, counting from d->base; d->played is how many have gone since
+ * then. A point flagged DAC_CTRL_RATE_CHANGE switches to the next queued
+ * rate once it's been played. Running out of points stops playback and
+ * sets the underflow flag, like the real thing.
+ */
+static void play_due(struct dac *d, long long now) {
+	while (1) {
+		int rate = d->point_rate;
+		long long due = (now - d->base) * rate / 1000000 + 1
+		              - d->played;
+		if (due <= 0)
+			return;
+
+		unsigned long consume = d->point_consume;
+		int avail = LOAD(d->point_produce) - consume;
+		int n = MIN(due, avail);
+		int change = 0;
+
+		for (int i = 0; i < n; i++) {
+			int at = (consume + i) % DAC_BUFFER_POINTS;
+			if (d->point_buf[at].control & DAC_CTRL_RATE_CHANGE) {
+				n = i + 1;
+				change = 1;
+				break;
+			}
+		}
+
+		play_points(d, n, now);
+		d->played += n;
+
+		if (change) {
+			if (d->rate_consume == LOAD(d->rate_produce))
+				continue;
+
+			/* Start counting again from the next point's time */
+			d->base += d->played * 1000000 / rate;
+			d->played = 0;
+			STORE(d->point_rate,
+			      d->rate_queue[d->rate_consume % RATE_QUEUE]);
+			STORE(d->rate_consume, d->rate_consume + 1);
+		} else if (n < due) {
+			__atomic_fetch_add(&d->stats.underruns, 1,
+			                   __ATOMIC_RELAXED);
+			STORE(d->playback_flags, PLAYBACK_FLAG_UNDERFLOW);
+			STORE(d->dac_state, DAC_IDLE);
+			return;
+		}
+	}
+}
+
+/* playback_thread_func(arg)
+ *
+ * Consume points from every DAC's buffer in real time, at its current
+ * point rate.
+ */
+static void *playback_thread_func(void *arg) {
+	while (1) {
+		long long now = microseconds();
+
+		for (int i = 0; i < dac_count; i++) {
+			struct dac *d = &dacs[i];
+
+			if (LOAD(d->dac_state) == DAC_RUNNING) {
+				play_due(d, now);
+			} else {
+				d->base = now;
+				d->played = 0;
+			}
+		}
+
+		STORE(playback_ticks, playback_ticks + 1);
+		microsleep(PLAYBACK_TICK_US);
+	}
+
+	return NULL;
+}
+
+/* stop_playback(d)
+ *
+ * Stop playback. The playback thread may be partway through a pass that
+ * started before it could see this, so note the pass after that one; the
+ * buffer is ours again once it's begun.
+ */
+static void stop_playback(struct dac *d) {
+	STORE(d->dac_state, DAC_IDLE);
+	d->stop_tick = LOAD(playback_ticks) + 2;
+}
+
+/* reset_playback(d)
+ *
+ * Empty the buffer and rate queue, and clear the status. Only called
+ * while the DAC isn't running; waits out the playback thread if it was
+ * only just stopped.
+ */
+static void reset_playback(struct dac *d) {
+	while (LOAD(playback_ticks) < d->stop_tick)
+		microsleep(PLAYBACK_TICK_US);
+
+	STORE(d->point_consume, d->point_produce);
+	STORE(d->rate_consume, d->rate_produce);
+	STORE(d->playback_flags, 0);
+	STORE(d->point_count, 0);
+}
+
+/* valid_rate(rate)
+ *
+ * Return whether a point rate is one we can play at.
+ */
+static int valid_rate(uint32_t rate) {
+	return rate > 0 && rate <= MAX_POINT_RATE;
+}
+
+/* push_points(d, pts, npoints)
+ *
+ * Copy points from a data command into the free space in point_buf, in at
+ * most two pieces if it wraps around, and publish them all at once.
+ * Returns the number that didn't fit and were dropped.
+ */
+static int push_points(struct dac *d, const struct dac_point *pts,
+                       int npoints) {
+	unsigned long produce = d->point_produce;
+	int space = DAC_BUFFER_POINTS - buffer_fullness(d);
+	int n = MIN(npoints, space);
+	int at = produce % DAC_BUFFER_POINTS;
+	int first = MIN(n, DAC_BUFFER_POINTS - at);
+
+	memcpy(d->point_buf + at, pts, first * sizeof (struct dac_point));
+	memcpy(d->point_buf, pts + first,
+	       (n - first) * sizeof (struct dac_point));
+
+	if (dump_file && d->index == 0)
+		fwrite(pts, sizeof (struct dac_point), n, dump_file);
+
+	STORE(d->point_produce, produce + n);
+	STORE(d->stats.accepted, d->stats.accepted + n);
+
+	return npoints - n;
 }
 
 static const char version_string[32] = "simulator";
 
-/* read_and_process_command(fd)
+/* command_length(cmd)
  *
- * Read a command from the network and process it.
+ * Return the length of a command, not counting any points that follow
+ * it, or -1 if it isn't one we know.
  */
-static int process_command(int fd) {
-	char buf[6];
-	char cmd;
-	if (read_exactly(fd, &cmd, sizeof cmd) < 0)
+static int command_length(char cmd) {
+	switch (cmd) {
+	case 'v':
+	case 'p':
+		return 1;
+	case 'q':
+		return sizeof (struct queue_command);
+	case 'd':
+		return sizeof (struct data_command);
+	case 'b':
+		return sizeof (struct begin_command);
+	default:
 		return -1;
+	}
+}
 
-	HOLDING(&s_lock)
-		copy_points_into_frame();
+/* process_command(d, buf)
+ *
+ * Process a command, which is all there in buf. Data commands only start
+ * here; their points are taken care of in process_input().
+ */
+static void process_command(struct dac *d, const char *buf) {
+	char cmd = buf[0];
 
 	switch (cmd) {
 	case 'v':
-		check_write(fd, version_string, sizeof version_string);
+		queue_out(d, version_string, sizeof version_string);
 		break;
 
 	case 'p':
-		HOLDING(&s_lock) {
-			if (s.dac_state == DAC_IDLE) {
-				s.dac_state = DAC_PREPARED;
-				send_resp(fd, RESP_ACK, cmd);
-			} else {
-				send_resp(fd, RESP_NAK_INVL, cmd);
-			}
+		if (LOAD(d->dac_state) == DAC_IDLE) {
+			reset_playback(d);
+			STORE(d->dac_state, DAC_PREPARED);
+			send_resp(d, RESP_ACK, cmd);
+		} else {
+			send_resp(d, RESP_NAK_INVL, cmd);
 		}
 		break;
 
-	case 'q':
-		/* Ignore the point_rate parameter */
-		if (read_exactly(fd, buf, 4) < 0)
-			return -1;
-
-		send_resp(fd, RESP_ACK, cmd);
+	case 'q': {
+		const struct queue_command *q = (const void *)buf;
+		uint32_t rate = q->point_rate;
+
+		if (LOAD(d->dac_state) == DAC_IDLE || !valid_rate(rate)) {
+			send_resp(d, RESP_NAK_INVL, cmd);
+		} else if (d->rate_produce - LOAD(d->rate_consume)
+		           >= RATE_QUEUE) {
+			send_resp(d, RESP_NAK_FULL, cmd);
+		} else {
+			d->rate_queue[d->rate_produce % RATE_QUEUE] = rate;
+			STORE(d->rate_produce, d->rate_produce + 1);
+			send_resp(d, RESP_ACK, cmd);
+		}
 		break;
+	}
 
-	case 'd':
-		if (read_exactly(fd, buf, 2) < 0)
-			return -1;
+	case 'd': {
+		const struct data_command *c = (const void *)buf;
+		d->points_left = c->npoints;
+		d->points_dropped = 0;
 
-		uint16_t npoints = *(uint16_t *)buf;;
+		if (!d->points_left)
+			send_resp(d, RESP_ACK, cmd);
+		break;
+	}
 
-		/* Read the data */
-		bool overflow = false;
-		while (npoints--) {
-			struct dac_point point;
-			if (read_exactly(fd, &point, sizeof point) < 0)
-				return -1;
+	case 'b': {
+		/* The low_water_mark parameter is ignored */
+		const struct begin_command *b = (const void *)buf;
+		uint32_t rate = b->point_rate;
+
+		if (LOAD(d->dac_state) == DAC_PREPARED && valid_rate(rate)) {
+			STORE(d->point_rate, rate);
+			STORE(d->dac_state, DAC_RUNNING);
+			send_resp(d, RESP_ACK, cmd);
+		} else {
+			printf("DAC %d: not starting - %s\n", d->index,
+			       valid_rate(rate) ? "not prepared" : "bad rate");
+			send_resp(d, RESP_NAK_INVL, cmd);
+		}
+		break;
+	}
+	}
+}
 
-			if (overflow)
-				continue;
+/* process_input(d)
+ *
+ * Work through as much of the input buffer as possible. Returns 1 if it
+ * stopped early because there mightn't be room for the reply, or -1 on a
+ * bogus command.
+ */
+static int process_input(struct dac *d) {
+	int pos = 0, full = 0;
 
-			HOLDING(&s_lock) {
-				int next = (s.point_buf_produce + 1)
-				         % DAC_BUFFER_POINTS;
+	while (1) {
+		if (d->points_left) {
+			/* Take whole points straight from the input buffer */
+			int avail = (d->in_len - pos)
+			            / (int)sizeof (struct dac_point);
+			int n = MIN(d->points_left, avail);
+			if (!n)
+				break;
+
+			d->points_dropped += push_points(d,
+				(const struct dac_point *)(d->in + pos), n);
+			d->points_left -= n;
+			pos += n * sizeof (struct dac_point);
+
+			if (!d->points_left)
+				send_resp(d, d->points_dropped ? RESP_NAK_INVL
+				                               : RESP_ACK, 'd');
+			continue;
+		}
 
-				if (next == s.point_buf_consume) {
-					overflow = true;
-					break;
-				}
+		if (pos == d->in_len)
+			break;
 
-				memcpy(s.point_buf + s.point_buf_produce,
-				       &point, sizeof point);
-				s.point_buf_produce = next;
-			}
+		if (d->out_len + MAX_REPLY > OUT_BUF_SIZE) {
+			full = 1;
+			break;
 		}
 
-		if (overflow)
-			send_resp(fd, RESP_NAK_INVL, cmd);
-		else
-			send_resp(fd, RESP_ACK, cmd);
+		int len = command_length(d->in[pos]);
+		if (len < 0) {
+			printf("DAC %d: bogus command %c\n", d->index,
+			       d->in[pos]);
+			return -1;
+		}
 
-		break;
+		if (d->in_len - pos < len)
+			break;
 
-	case 'b':
-		/* Ignore the low_water_mark and point_rate parameters */
-		if (read_exactly(fd, buf, 6) < 0)
-			return -1;
+		process_command(d, d->in + pos);
+		pos += len;
+	}
 
-		if (s.dac_state == DAC_PREPARED)
-			s.dac_state = DAC_RUNNING;
-		else
-			printf("dac: not starting - not prepared\n");
+	memmove(d->in, d->in + pos, d->in_len - pos);
+	d->in_len -= pos;
+	return full;
+}
 
-		send_resp(fd, RESP_ACK, cmd);
-		break;
+/* close_connection(d)
+ *
+ * Drop the current connection, stop playback, and go back to listening.
+ */
+static void close_connection(struct dac *d) {
+	printf("DAC %d: connection closed\n", d->index);
 
-	default:
-		printf("Bogus command %c\n", cmd);
-		exit(0);
+	loop_watch(d->loop, d->fd, 0, 0);
+	close(d->fd);
+	d->fd = -1;
+
+	stop_playback(d);
+
+	if (dump_file && d->index == 0)
+		fflush(dump_file);
+
+	loop_watch(d->loop, d->listenfd, LOOP_IN, d->index << 1);
+}
+
+/* accept_connection(d)
+ *
+ * Take a new connection. Like the real thing, a DAC only serves one at a
+ * time, so stop listening until it's closed.
+ */
+static void accept_connection(struct dac *d) {
+	struct sockaddr_in client = { 0 };
+	socklen_t len = sizeof client;
+
+	int fd = accept(d->listenfd, (struct sockaddr *)&client, &len);
+	if (fd < 0) {
+		perror("accept");
+		return;
 	}
 
-	return 1;
+	printf("DAC %d: connection from %s\n", d->index,
+	       inet_ntoa(client.sin_addr));
+
+	CHK("fcntl", fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+	loop_watch(d->loop, d->listenfd, 0, 0);
+
+	/* Reset everything for the new connection. The frame history is
+	 * left to fade out on its own. */
+	d->fd = fd;
+	d->in_len = d->out_len = 0;
+	d->points_left = 0;
+	reset_playback(d);
+
+	/* Send initial status response */
+	send_resp(d, RESP_ACK, '?');
+	flush_out(d);
+
+	loop_watch(d->loop, fd, d->out_len ? LOOP_OUT : LOOP_IN,
+	           d->index << 1 | 1);
 }
 
-static void *net_thread_func(void *arg) {
-	int srvfd = *(int *)arg;
+/* connection_event(d, events)
+ *
+ * Read whatever's arrived, act on it, and send replies. While replies are
+ * backed up, stop reading, so a client that doesn't read its replies
+ * only holds itself up.
+ */
+static void connection_event(struct dac *d, int events) {
+	if (events & LOOP_IN && d->in_len < IN_BUF_SIZE) {
+		int res = read(d->fd, d->in + d->in_len,
+		               IN_BUF_SIZE - d->in_len);
+		if (res == 0 || (res < 0 && errno != EAGAIN
+		                 && errno != EWOULDBLOCK)) {
+			if (res < 0)
+				perror("read");
+			close_connection(d);
+			return;
+		}
 
-	while (1) {
-		/* Reset everything before the next connection */
-		HOLDING(&s_lock)
-			memset(&s, 0, sizeof s);
+		if (res > 0)
+			d->in_len += res;
+	}
 
-		struct sockaddr_in client = { 0 };
-		socklen_t len = sizeof client;
+	int res = flush_out(d);
+	while (res == 0) {
+		res = process_input(d);
+		if (res < 0 || flush_out(d) < 0) {
+			close_connection(d);
+			return;
+		}
 
-		/* Wait for a connection */
-		int fd = accept(srvfd, (struct sockaddr *)&client, &len);
-		CHK("accept", fd);
-		printf("Connection from %s\n", inet_ntoa(client.sin_addr));
+		/* If replies were backed up but have all gone, carry on */
+		res = (res == 1 && !d->out_len) ? 0 : 1;
+	}
 
-		/* Send initial status response */
-		send_resp(fd, RESP_ACK, '?');
+	loop_watch(d->loop, d->fd, d->out_len ? LOOP_OUT : LOOP_IN,
+	           d->index << 1 | 1);
+}
 
-		while (process_command(fd) == 1);
+static void *loop_thread_func(void *arg) {
+	struct loop *l = arg;
 
-		printf("Connection closed\n");
-		close(fd);
+	while (1) {
+		unsigned long tags[MAX_EVENTS];
+		int events[MAX_EVENTS];
+		int n = loop_wait(l, tags, events, MAX_EVENTS);
+
+		for (int i = 0; i < n; i++) {
+			struct dac *d = &dacs[tags[i] >> 1];
+			if (tags[i] & 1)
+				connection_event(d, events[i]);
+			else
+				accept_connection(d);
+		}
 	}
+
+	return NULL;
 }
 
-static int socket_bind_and_assert(int type, int port) {
+static int socket_bind_and_assert(int type, struct in_addr ip, int port) {
 	int fd = socket(PF_INET, type, 0);
 	CHK("socket", fd);
 
@@ -353,7 +875,7 @@ static int socket_bind_and_assert(int type, int port) {
 
 	struct sockaddr_in addr = {
 		.sin_family = AF_INET,
-		.sin_addr.s_addr = htonl(INADDR_ANY),
+		.sin_addr = ip,
 		.sin_port = htons(port)
 	};
 
@@ -361,6 +883,115 @@ static int socket_bind_and_assert(int type, int port) {
 	return fd;
 }
 
+/* dacs_init(base_addr, loops, nloops)
+ *
+ * Set up every DAC's sockets, and share the DACs out between the event
+ * loops. Given a base address, DAC i listens on the port at that address
+ * plus i, which is what the host library expects; otherwise, DAC i
+ * listens on every address at the port plus i.
+ */
+static void dacs_init(const char *base_addr, struct loop *loops,
+                      int nloops) {
+	int res = posix_memalign((void **)&dacs, 64, dac_count * sizeof *dacs);
+	assert(res == 0);
+	memset(dacs, 0, dac_count * sizeof *dacs);
+
+	struct in_addr base = { htonl(INADDR_ANY) };
+	if (base_addr && !inet_aton(base_addr, &base)) {
+		fprintf(stderr, "bad address %s\n", base_addr);
+		exit(1);
+	}
+
+	for (int i = 0; i < nloops; i++)
+		loop_init(&loops[i], 2 * (dac_count / nloops + 1));
+
+	int shared_udpfd = -1;
+
+	for (int i = 0; i < dac_count; i++) {
+		struct dac *d = &dacs[i];
+		struct in_addr ip = base;
+		int port = DAC_PORT;
+
+		if (base_addr)
+			ip.s_addr = htonl(ntohl(base.s_addr) + i);
+		else
+			port += i;
+
+		d->index = i;
+		d->fd = -1;
+		d->loop = &loops[i % nloops];
+
+		d->listenfd = socket_bind_and_assert(SOCK_STREAM, ip, port);
+		CHK("listen", listen(d->listenfd, 1));
+
+		/* Broadcasts have to come from the DAC's own address, but
+		 * with no address of their own, all the DACs can share. */
+		if (base_addr) {
+			d->udpfd = socket_bind_and_assert(SOCK_DGRAM, ip,
+			                                  BROADCAST_SRC_PORT);
+		} else {
+			if (shared_udpfd < 0)
+				shared_udpfd = socket_bind_and_assert(
+					SOCK_DGRAM, ip, BROADCAST_SRC_PORT);
+			d->udpfd = shared_udpfd;
+		}
+
+		loop_watch(d->loop, d->listenfd, LOOP_IN, i << 1);
+	}
+
+	/* Only DAC 0 is ever shown */
+	dacs[0].frames = calloc(FRAME_RING, sizeof *dacs[0].frames);
+	assert(dacs[0].frames);
+}
+
+#ifdef HEADLESS
+/* headless_loop()
+ *
+ * Stand in for the display: release the frame history at the display
+ * rate, and print a line of stats across all the DACs every second.
+ */
+static void headless_loop(void) {
+	long long t = microseconds();
+	long long next_frame = t;
+	long long last_accepted = 0;
+
+	while (1) {
+		/* Nothing is drawn, so every frame is done with at once */
+		STORE(dacs[0].frame_consume, LOAD(dacs[0].frame_produce));
+
+		long long now = microseconds();
+		if (t + 1000000 < now) {
+			long long fullness = 0, accepted = 0;
+			long long underruns = 0, naks = 0;
+			int running = 0;
+
+			for (int i = 0; i < dac_count; i++) {
+				struct dac *d = &dacs[i];
+				fullness += buffer_fullness(d);
+				accepted += LOAD(d->stats.accepted);
+				underruns += LOAD(d->stats.underruns);
+				naks += LOAD(d->stats.naks);
+				running += LOAD(d->dac_state) == DAC_RUNNING;
+			}
+
+			printf("%lld pts/s, buffer %lld/%d, %lld underruns, "
+			       "%lld NAKs, %d/%d running\n",
+			       accepted - last_accepted, fullness / dac_count,
+			       DAC_BUFFER_POINTS, underruns, naks, running,
+			       dac_count);
+			fflush(stdout);
+
+			last_accepted = accepted;
+			t += 1000000;
+		}
+
+		next_frame += 1000000 / FPS;
+		long long delay_time = next_frame - microseconds();
+		if (delay_time > 0)
+			microsleep(delay_time);
+	}
+}
+#else
 SDL_Surface *video_init(int window_size) {
 	if (SDL_Init(SDL_INIT_VIDEO) < 0)
 		exit(1);
@@ -383,24 +1014,80 @@ SDL_Surface *video_init(int window_size) {
 
 	return scr;
 }
+#endif
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-n dacs] [-A base_addr] [-t loops] "
+	        "[-o dump_file]\n"
+	        "  -n  number of virtual DACs (default 1)\n"
+	        "  -A  give DAC i its own address, base_addr + i; otherwise\n"
+	        "      DAC i listens on port %d + i\n"
+	        "  -t  number of network threads (default 1)\n"
+	        "  -o  append every point DAC 0 receives to dump_file\n",
+	        name, DAC_PORT);
+	exit(1);
+}
 
 int main(int argc, char **argv) {
 	time_init();
 
-	CHK("pthread_mutex_init", pthread_mutex_init(&s_lock, NULL));
+	const char *base_addr = NULL;
+	int nloops = 1;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:A:t:o:")) != -1) {
+		switch (opt) {
+		case 'n':
+			dac_count = atoi(optarg);
+			break;
+		case 'A':
+			base_addr = optarg;
+			break;
+		case 't':
+			nloops = atoi(optarg);
+			break;
+		case 'o':
+			dump_file = fopen(optarg, "wb");
+			if (!dump_file) {
+				perror(optarg);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (dac_count < 1 || nloops < 1)
+		usage(argv[0]);
+	if (nloops > dac_count)
+		nloops = dac_count;
 
-	pthread_t broadcast_thread, net_thread;
+	/* A client going away mid-write shouldn't take everything down */
+	signal(SIGPIPE, SIG_IGN);
 
-	int udpfd = socket_bind_and_assert(SOCK_DGRAM, 7655);
-	int listenfd = socket_bind_and_assert(SOCK_STREAM, 7765);
-	CHK("listen", listen(listenfd, 1));
+	struct loop *loops = calloc(nloops, sizeof *loops);
+	assert(loops);
+	dacs_init(base_addr, loops, nloops);
 
-	int res = pthread_create(&broadcast_thread, NULL, 
-	                         broadcast_thread_func, &udpfd);
+	pthread_t broadcast_thread, playback_thread;
+
+	int res = pthread_create(&broadcast_thread, NULL,
+	                         broadcast_thread_func, NULL);
 	assert(res == 0);
-	res = pthread_create(&net_thread, NULL, net_thread_func, &listenfd);
+	res = pthread_create(&playback_thread, NULL, playback_thread_func,
+	                     NULL);
 	assert(res == 0);
 
+	for (int i = 0; i < nloops; i++) {
+		res = pthread_create(&loops[i].thread, NULL, loop_thread_func,
+		                     &loops[i]);
+		assert(res == 0);
+	}
+
+#ifdef HEADLESS
+	headless_loop();
+#else
 	video_init(WINDOW_SIZE);
 
 	long long t = microseconds();
@@ -416,8 +1103,7 @@ int main(int argc, char **argv) {
 
 		/* Clear the screen and render the next frame */
 		glClear(GL_COLOR_BUFFER_BIT);
-		HOLDING(&s_lock)
-			render();
+		render(&dacs[0]);
 
 		long long now = microseconds();
 		frames++;
@@ -438,6 +1124,7 @@ int main(int argc, char **argv) {
 		if (delay_time > 0)
 			SDL_Delay(delay_time);
 	}
+#endif
 
 	return 0;
 }
@@ -37,7 +37,7 @@ static inline long long microseconds(void) {
 	return time_diff * timer_freq_numer / timer_freq_denom;
 #else
 	struct timespec t;
-	clock_gettime(CLOCK_REALTIME, &t);
+	clock_gettime(CLOCK_MONOTONIC, &t);
 	return (t.tv_sec - start_time.tv_sec) * 1000000 +
 	       (t.tv_nsec - start_time.tv_nsec) / 1000;
 #endif
@@ -64,7 +64,7 @@ static inline void time_init(void) {
 	timer_freq_numer = timebase_info.numer;
 	timer_freq_denom = timebase_info.denom * 1000;
 #else
-	clock_gettime(CLOCK_REALTIME, &start_time);
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
 #endif
 }
 